@@ -40,6 +40,7 @@ typedef int bool;
 #define FLAG_SBIN 3
 #define FLAG_ROOT 0
 #define FLAG_VMM 4
+#define FLAG_SHARE 5
 struct Dir
 {
     struct File *f;
@@ -231,8 +232,8 @@ main(int argc, char **argv)
     int flag=FLAG_ROOT;
     struct Dir bin, sbin;
     struct File *b, *sb;
-    struct Dir vmm;
-    struct File *v;
+    struct Dir vmm, share;
+    struct File *v, *sh;
 
 
     assert(BLKSIZE % sizeof(struct File) == 0);
@@ -257,6 +258,10 @@ main(int argc, char **argv)
     v = diradd(&root, FTYPE_DIR, "vmm");
     startdir(v, &vmm);
 
+    // Host files guests may open through their I/O channel.
+    sh = diradd(&vmm, FTYPE_DIR, "share");
+    startdir(sh, &share);
+
     for (i = 3; i < argc; i++) {
         if(strcmp("-b", argv[i]) == 0) {
             flag = FLAG_BIN;
@@ -267,6 +272,9 @@ main(int argc, char **argv)
         } else if(strcmp("-g", argv[i]) == 0) {
             flag = FLAG_VMM;
             continue;
+        } else if(strcmp("-gs", argv[i]) == 0) {
+            flag = FLAG_SHARE;
+            continue;
         }
 
         switch (flag){
@@ -282,11 +290,15 @@ main(int argc, char **argv)
             case FLAG_VMM:
                 writefile(&vmm, argv[i]);
                 break;
+            case FLAG_SHARE:
+                writefile(&share, argv[i]);
+                break;
         }
     }
 
     finishdir(&bin);
     finishdir(&sbin);
+    finishdir(&share);
     finishdir(&vmm);
 
     finishdir(&root);
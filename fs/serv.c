@@ -355,9 +355,9 @@ serve(void)
 
    cprintf("HOST SERVE CALLED\n\n\n");
 
+    perm = 0;
+    req = ipc_recv((int32_t *) &whom, fsreq, &perm);
     while (1) {
-        perm = 0;
-        req = ipc_recv((int32_t *) &whom, fsreq, &perm);
         if (debug)
             cprintf("fs req %d from %08x [page %08x: %s]\n",
                     req, whom, vpt[PPN(fsreq)], fsreq);
@@ -366,7 +366,10 @@ serve(void)
         if (!(perm & PTE_P)) {
             cprintf("Invalid request from %08x: no argument page\n",
                     whom);
-            continue; // just leave it hanging...
+            // just leave it hanging...
+            perm = 0;
+            req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+            continue;
         }
 
         pg = NULL;
@@ -378,10 +381,22 @@ serve(void)
             cprintf("Invalid request code %d from %08x\n", whom, req);
             r = -E_INVAL;
         }
-        ipc_send(whom, r, pg, perm);
-        if(debug)
-            cprintf("FS: Sent response %d to %x\n", r, whom);
         sys_page_unmap(0, fsreq);
+        if(debug)
+            cprintf("FS: Sending response %d to %x\n", r, whom);
+        // Reply and wait for the next request in one go: the client gets
+        // the CPU straight back, and finds us receiving when it next
+        // calls.  If the reply cannot be sent, say because the client
+        // has exited, nothing was received either: just wait for the next
+        // request.
+        if ((r = ipc_call(whom, r, pg, perm, (envid_t *) &whom, fsreq,
+                          &perm)) < 0) {
+            if (debug)
+                cprintf("FS: reply failed: %e\n", r);
+            perm = 0;
+            r = ipc_recv((int32_t *) &whom, fsreq, &perm);
+        }
+        req = r;
     }
 }
 
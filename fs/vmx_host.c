@@ -15,8 +15,15 @@ static union Fsipc host_fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 host_fsipc(unsigned type, void *dstva)
 {
-	ipc_host_send(VMX_HOST_FS_ENV, type, &host_fsipcbuf, PTE_P | PTE_W | PTE_U);
-    return ipc_host_recv(dstva);
+    int r;
+
+    // Post the receive first so the host file server can reply at once.
+    while ((r = ipc_host_recv_start(dstva)) == -E_BUSY)
+        sys_yield();
+    if (r < 0)
+        return r;
+    ipc_host_send(VMX_HOST_FS_ENV, type, &host_fsipcbuf, PTE_P | PTE_W | PTE_U);
+    return ipc_host_recv_wait();
 }
 
     int
@@ -48,6 +48,7 @@ enum EnvType {
     ENV_TYPE_NS,		// Network server
     ENV_TYPE_PP_DEDUP,
     ENV_TYPE_GUEST,     // A VMM guest OS
+    ENV_TYPE_PAGER,     // Host pager for guest memory (user/vmpager.c)
 };
 
 struct Env {
@@ -58,7 +59,10 @@ struct Env {
     enum EnvType env_type;		// Indicates special system environments
     unsigned env_status;		// Status of the environment
     uint32_t env_runs;		// Number of times environment has run
-    int env_cpunum;			// The CPU that the env is running on
+    int env_cpunum;			// The CPU the env last ran on
+    struct sched_runq *env_runq;	// Run queue the env is on, or NULL
+    struct Env *env_runq_next;		// Run queue link pointers
+    struct Env *env_runq_prev;
 
     // Address space
     pml4e_t *env_pml4e;		// Kernel virtual address of top-level page dir,
@@ -21,4 +21,16 @@ enum {
 #define __EPTE_NONE	0
 #define __EPTE_FULL	(__EPTE_READ | __EPTE_WRITE | __EPTE_EXEC)
 
+// A not-present leaf entry with __EPTE_SWAPPED set records that the host
+// pager wrote the page out; the swap slot is kept in the address bits.
+// Bit 11 is ignored by the hardware.
+#define __EPTE_SWAPPED	0x800
+#define EPTE_SWAP_SLOT(e)	((uint64_t) (e) >> 12)
+#define EPTE_SWAP_ENTRY(slot)	(((uint64_t) (slot) << 12) | __EPTE_SWAPPED)
+
+// A present leaf with __EPTE_COW set maps a page shared read-only, such as
+// the zero page; a write to it gets the guest a private copy.  Bit 10 is
+// ignored by the hardware unless mode-based execute control is on.
+#define __EPTE_COW	0x400
+
 #endif
@@ -34,6 +34,7 @@ enum {
     E_VMX_ON = 19,    // Couldn't transition the cpu to VMX root mode
     E_VMCS_INIT = 20, // Couldn't init the VMCS region
     E_NO_ENT = 21,
+    E_BUSY = 22,      // Resource is in use
 
 	MAXERROR
 };
@@ -23,6 +23,7 @@
 #include <inc/malloc.h>
 #include <inc/ns.h>
 #include <inc/vmx.h>
+#include <inc/vmpager.h>
 
 #define USED(x)		(void)(x)
 
@@ -60,9 +61,28 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint64_t value, void *pg, int perm,
+		     void *rcv_pg);
 unsigned int sys_time_msec(void);
 int sys_ept_map(envid_t srcenvid, void *srcva, envid_t guest, void* guest_pa, int perm);
 envid_t sys_env_mkguest(uint64_t gphysz, uint64_t gRIP);
+int sys_env_set_cpuid_policy(envid_t guest, struct vmx_cpuid_policy *policy);
+int sys_vmtrace_ctl(envid_t guest, int op);
+int sys_vmtrace_map(envid_t guest, void *va);
+int sys_vmpager_wait(struct vmpager_req *req);
+int sys_vmpager_scan(envid_t guest, uint64_t *gpas, int n);
+int sys_vmpager_evict(envid_t guest, const uint64_t *gpas,
+		      const uint64_t *slots, int n, void *va);
+int sys_vmpager_pagein(envid_t guest, uint64_t gpa, void *va);
+int sys_vmpager_fail(envid_t guest, uint64_t gpa, bool retry);
+int sys_env_set_sched(envid_t guest, uint32_t weight, uint32_t cap);
+int sys_vmchan_wait(envid_t guest);
+int sys_vmchan_attach(envid_t guest, void *va);
+int sys_vmchan_map(envid_t guest, uint64_t gpa, void *va, int perm);
+int sys_vmshm_bind(envid_t guest, uint32_t key, int npages, int port);
+int sys_vmwss_get(envid_t guest, struct vmx_wss *wss);
+int sys_vmtext_map(envid_t guest, uint64_t key, uint64_t gpa, int npages,
+		   void *va);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -80,11 +100,16 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 #ifdef VMM_GUEST
 void	ipc_host_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_host_recv(void *pg);
+int	ipc_host_recv_start(void *pg);
+int	ipc_host_recv_poll(int32_t *value);
+int32_t ipc_host_recv_wait(void);
 #endif
 
 // fork.c
@@ -198,6 +198,14 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Guest pages only: sampling intervals since the page was last
+	// touched, kept by the working-set sampler (vmm/vmwss.c).
+	uint8_t pp_age;
+
+	// For page-table pages (including EPT pages): bit i is set if any of
+	// entries [i * PT_OCC_SPAN, (i + 1) * PT_OCC_SPAN) may be in use.
+	uint32_t pp_occ;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -20,6 +20,22 @@ enum {
 	SYS_time_msec,
 	SYS_ept_map,
 	SYS_env_mkguest,
+	SYS_vmtrace_ctl,
+	SYS_vmtrace_map,
+	SYS_env_set_cpuid_policy,
+	SYS_vmpager_wait,
+	SYS_vmpager_scan,
+	SYS_vmpager_evict,
+	SYS_vmpager_pagein,
+	SYS_env_set_sched,
+	SYS_vmchan_wait,
+	SYS_vmchan_attach,
+	SYS_vmchan_map,
+	SYS_vmshm_bind,
+	SYS_vmwss_get,
+	SYS_vmtext_map,
+	SYS_ipc_call,
+	SYS_vmpager_fail,
 	NSYSCALLS
 };
 
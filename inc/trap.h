@@ -53,6 +53,7 @@
 #define IRQ_KBD          1
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
+#define IRQ_KICK        13	// IPI that makes a CPU leave guest mode
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
 
@@ -0,0 +1,49 @@
+#ifndef JOS_INC_VMBENCH_H
+#define JOS_INC_VMBENCH_H
+
+#include <inc/types.h>
+
+// VMX microbenchmarks.  The guest kernel runs the privileged ones for
+// sys_vmbench(); the rest are timed from user space.  Every result is
+// printed as one line
+//
+//	vmbench: <where>.<name> iters=N min=C avg=C max=C
+//
+// with C in TSC cycles, so scripts can pick them out of the console log.
+
+enum {
+	VMBENCH_NULL = 0,	// Back-to-back RDTSC; the timing overhead
+	VMBENCH_CPUID,		// CPUID leaf 0
+	VMBENCH_VMCALL,		// VMX_VMCALL_NOP
+	VMBENCH_RDMSR,		// RDMSR of IA32_EFER
+	VMBENCH_IO,		// OUTB to the CMOS index port
+	VMBENCH_EPT_FAULT,	// First write to a page the host has not backed
+	NVMBENCH
+};
+
+struct vmbench_result {
+	uint64_t iters;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static inline void
+vmbench_init(struct vmbench_result *r)
+{
+	r->iters = r->total = r->max = 0;
+	r->min = ~0ULL;
+}
+
+static inline void
+vmbench_sample(struct vmbench_result *r, uint64_t cycles)
+{
+	r->iters++;
+	r->total += cycles;
+	if (cycles < r->min)
+		r->min = cycles;
+	if (cycles > r->max)
+		r->max = cycles;
+}
+
+#endif /* !JOS_INC_VMBENCH_H */
@@ -0,0 +1,97 @@
+#ifndef JOS_INC_VMCHAN_H
+#define JOS_INC_VMCHAN_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Exitless I/O channel between a guest and a host backend env.
+//
+// The guest owns one page holding a struct vmchan_ring and registers it
+// with VMX_VMCALL_CHAN_SETUP.  The backend (the guest's parent, user/vmm)
+// maps the page and polls it, so while it is awake the guest submits
+// requests by writing to memory alone.  A backend that has found nothing
+// to do for a while sets 'state' to VMCHAN_SLEEPING and blocks in
+// sys_vmchan_wait(); a guest that sees this after queueing a request rings
+// the doorbell, VMX_VMCALL_CHAN_KICK.
+//
+// Both sides publish an index only after the slot it covers is written.
+// Because the guest checks 'state' after bumping sq_tail and the backend
+// checks sq_tail after setting 'state', each side must fence between the
+// store and the load (vmchan_mb()), or a request could sit unnoticed.
+//
+// Besides the guest's disk image, the backend serves a host directory
+// (/vmm/share) 9p style: the guest opens host files by path, gets back a
+// file id and reads, writes and stats through it.  Data moves straight
+// between the host file system and the guest page named by gpa, which the
+// guest grants for the request, so nothing is copied through a bounce
+// buffer on either side.  A directory reads as its struct File entries,
+// as it does on the host.
+
+#define VMCHAN_NSLOTS		32	// Ring size; must be a power of two
+
+enum {
+	VMCHAN_OP_READ = 1,	// Read len bytes at off into guest memory
+	VMCHAN_OP_WRITE,	// Write len bytes from guest memory at off
+	// Shared directory operations.  Paths are len bytes at gpa,
+	// relative to the shared directory.
+	VMCHAN_OP_OPEN,		// Open path with O_* mode off; result is fid
+	VMCHAN_OP_CLOSE,	// Close fid
+	VMCHAN_OP_PREAD,	// Read len bytes at off of fid into gpa
+	VMCHAN_OP_PWRITE,	// Write len bytes from gpa at off of fid
+	VMCHAN_OP_STAT,		// Store fid's struct vmchan_stat at gpa
+	VMCHAN_OP_SETSIZE,	// Truncate or extend fid to off bytes
+	VMCHAN_OP_REMOVE,	// Remove path
+};
+
+#define VMCHAN_MAXFILES		64	// Open shared files per guest
+#define VMCHAN_NAMELEN		128	// Same as MAXNAMELEN
+
+enum {
+	VMCHAN_POLLING = 0,	// Backend is watching the ring
+	VMCHAN_SLEEPING,	// Backend needs a doorbell
+};
+
+struct vmchan_req {
+	uint32_t op;		// VMCHAN_OP_*
+	uint32_t len;		// Bytes; the buffer must not cross a page
+	uint64_t off;		// Byte offset in the backing disk image
+	uint64_t gpa;		// Guest physical address of the buffer
+	uint64_t id;		// Echoed in the completion
+	uint32_t fid;		// Shared file, for the file operations
+};
+
+struct vmchan_stat {
+	char name[VMCHAN_NAMELEN];
+	int64_t size;
+	uint32_t isdir;
+};
+
+struct vmchan_cpl {
+	uint64_t id;
+	int64_t result;		// Bytes transferred, or < 0 on error
+};
+
+struct vmchan_ring {
+	volatile uint32_t sq_head;	// Next request the backend takes
+	volatile uint32_t sq_tail;	// Next free request slot
+	volatile uint32_t cq_head;	// Next completion the guest takes
+	volatile uint32_t cq_tail;	// Next free completion slot
+	volatile uint32_t state;	// VMCHAN_POLLING or VMCHAN_SLEEPING
+
+	// Statistics.  The guest counts submissions and doorbells; every
+	// submission that needed no doorbell is a VM exit avoided.
+	volatile uint64_t submitted;
+	volatile uint64_t doorbells;
+	volatile uint64_t sleeps;	// Times the backend went to sleep
+
+	struct vmchan_req sq[VMCHAN_NSLOTS];
+	struct vmchan_cpl cq[VMCHAN_NSLOTS];
+} __attribute__((aligned(PGSIZE)));
+
+static __inline void
+vmchan_mb(void)
+{
+	__asm __volatile("mfence" : : : "memory");
+}
+
+#endif /* !JOS_INC_VMCHAN_H */
@@ -0,0 +1,43 @@
+#ifndef JOS_INC_VMPAGER_H
+#define JOS_INC_VMPAGER_H
+
+#include <inc/types.h>
+
+// Host-side guest paging.
+//
+// The kernel does not do file I/O, so swapping guest memory is split in two.
+// The kernel owns the EPT: it picks victims, replaces their entries with
+// swap markers (EPTE_SWAP_ENTRY in inc/ept.h) and blocks guests that touch
+// them.  A user-level pager env (user/vmpager.c) owns the swap file on the
+// host file system and moves page contents in and out of it.  The kernel
+// starts the pager at boot as an ENV_TYPE_PAGER env, and only such an env
+// may register by calling sys_vmpager_wait(), which hands it one request
+// at a time.
+
+enum {
+	VMPAGER_REQ_PAGEIN = 1,	// Read slot back and map it at gpa
+	VMPAGER_REQ_RECLAIM,	// Host memory is low; evict some pages
+};
+
+struct vmpager_req {
+	uint32_t type;		// VMPAGER_REQ_*
+	int32_t guest;		// envid_t of the guest (PAGEIN)
+	uint64_t gpa;		// Page-aligned guest physical address (PAGEIN)
+	uint64_t slot;		// Swap slot holding the page (PAGEIN)
+};
+
+// Why a guest is blocked on the pager (VmxGuestInfo.pager_wait).
+enum {
+	VMPAGER_WAIT_NONE = 0,
+	VMPAGER_WAIT_PAGEIN,	// Waiting for its swapped-out page
+	VMPAGER_WAIT_NOMEM,	// Waiting for host memory to be freed
+};
+
+// Most pages one sys_vmpager_evict() call takes.
+#define VMPAGER_EVICT_MAX	64
+
+// The kernel asks for a reclaim when an EPT fault leaves fewer than this
+// many free host pages, so the pager itself still has room to work.
+#define VMPAGER_LOW_WATER	256
+
+#endif /* !JOS_INC_VMPAGER_H */
@@ -0,0 +1,48 @@
+#ifndef JOS_INC_VMTRACE_H
+#define JOS_INC_VMTRACE_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Per-guest VM-exit trace rings.
+//
+// A guest's parent turns tracing on with sys_vmtrace_ctl(), which gives the
+// guest a ring of its own, and maps it read-only with sys_vmtrace_map().  A
+// guest runs on one CPU at a time, and that CPU is the ring's only writer,
+// so records are added without locks: the record is filled in first and
+// 'head' is bumped afterwards.  A reader copies a record and then re-reads
+// 'head'; if the writer has lapped the record in the meantime, the copy
+// must be discarded.
+
+// Records per CPU ring.  Must be a power of two.
+#define VMTRACE_NRECS		1024
+
+struct vmtrace_rec {
+	uint64_t tsc;		// TSC at VM exit
+	uint64_t rip;		// Guest RIP at VM exit
+	uint64_t qual;		// Exit qualification
+	uint64_t cycles;	// Cycles spent handling the exit
+	int32_t cpu;		// CPU the guest exited on
+	uint32_t reason;	// Basic exit reason
+	uint64_t pad[3];	// No record straddles a page
+};
+
+struct vmtrace_ring {
+	volatile uint64_t head;		// Number of records ever written
+	uint32_t nrecs;			// Capacity of recs[]
+	int32_t guest;			// envid_t of the traced guest
+	uint8_t pad[PGSIZE - 16];
+	struct vmtrace_rec recs[VMTRACE_NRECS];
+} __attribute__((aligned(PGSIZE)));
+
+// Size of a ring in bytes and pages, including the header page.
+#define VMTRACE_RING_SIZE	(sizeof(struct vmtrace_ring))
+#define VMTRACE_NPAGES		(VMTRACE_RING_SIZE / PGSIZE)
+#define VMTRACE_RECS_PER_PAGE	(PGSIZE / sizeof(struct vmtrace_rec))
+
+// Operations for sys_vmtrace_ctl().
+#define VMTRACE_OFF		0
+#define VMTRACE_ON		1
+#define VMTRACE_STATUS		2
+
+#endif /* !JOS_INC_VMTRACE_H */
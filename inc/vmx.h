@@ -1,11 +1,51 @@
 #ifndef JOS_INC_VMX_H
 #define JOS_INC_VMX_H
 
+#ifndef GUEST_MEM_SZ
 #define GUEST_MEM_SZ 16 * 1024 * 1024
+#endif
+// Largest guest sys_env_mkguest will accept (8 GB).  The guest kernel's
+// pages[] array must fit both in its UPAGES window (25 * PTSIZE) and in
+// the 256 MB its bootstrap maps; 8 GB of RAM, plus the MMIO hole below
+// 4 GB, leaves room to spare in both.
+#define GUEST_MEM_MAX ( 8ULL * 1024 * 1024 * 1024 )
+
+// Guest physical layout.  RAM above GUEST_LOWMEM_TOP is relocated to start at
+// GUEST_HIGHMEM_BASE, leaving [GUEST_LOWMEM_TOP, 4 GB) as a hole for 32-bit
+// MMIO, the way a PC BIOS lays out memory.
+#define GUEST_LOWMEM_TOP 0xC0000000ULL
+#define GUEST_HIGHMEM_BASE 0x100000000ULL
 #define MAX_MSR_COUNT ( PGSIZE / 2 ) / ( 128 / 8 )
 
+// Inter-VM shared memory.  The host binds a shared memory object to one
+// of a guest's ports (sys_vmshm_bind()); every guest bound to the same
+// object sees the same pages wherever it maps them with
+// VMX_VMCALL_SHM_MAP, and VMX_VMCALL_SHM_NOTIFY on a port signals every
+// other guest bound to its object.
+#define VMX_SHM_PORTS 4
+#define VMX_SHM_MAX_PAGES 256
+
+// Read-only guest kernel segments that host VMMs share between guests
+// with sys_vmtext_map() are at most this long.
+#define VMX_TEXT_MAX_PAGES 512
+
 #ifndef __ASSEMBLER__
 
+// Working-set estimate of a guest, refreshed every sampling interval from
+// EPT accessed bits (see vmm/vmwss.c) and read with sys_vmwss_get().
+// Page counts cover guest RAM backed by host memory.
+#define VMX_WSS_AGES 8
+struct vmx_wss {
+    uint64_t samples;		// Intervals sampled so far
+    uint64_t resident;		// Pages backed by host memory
+    uint64_t active;		// Pages touched in the last interval
+    uint64_t estimate;		// Moving average of 'active'
+    uint64_t target;		// Suggested memory size: estimate plus headroom
+    // Resident pages by whole intervals since last touched; the last
+    // bin also counts the pages idle for longer.
+    uint64_t idle[VMX_WSS_AGES];
+};
+
 struct VmxGuestInfo {
     uint64_t phys_sz;
     uintptr_t *vmcs;
@@ -19,8 +59,83 @@ struct VmxGuestInfo {
     int msr_count;
     uintptr_t *msr_host_area;
     uintptr_t *msr_guest_area;
+    // Precomputed CPUID answers (see vmx_cpuid_init()).
+    struct vmx_cpuid_table *cpuid_table;
+    // The VMCS holds host state and controls (see vmm/vmpool.c).
+    bool vmcs_ready;
+    // The host state is that of CPU vmcs_cpu.  While the guest is on a
+    // CPU its VMCS is active there, and launched after the first entry;
+    // it is cleared when the guest leaves, so any CPU can load it next.
+    bool vmcs_active;
+    bool vmcs_launched;
+    int vmcs_cpu;
+    // Host pager state (see vmm/vmpager.c).
+    int pager_wait;		// VMPAGER_WAIT_* the guest is blocked on
+    uint64_t pager_gpa;		// Faulting gpa while blocked
+    uint64_t pager_cursor;	// Where the next victim scan starts
+    // Working-set sampler state (see vmm/vmwss.c).
+    struct vmx_wss wss;
+    uint64_t wss_avg;		// 'estimate' in 1/256 pages
+    // Mailbox of the posted host IPC receive, or NULL.
+    struct vmx_ipc_mailbox *ipc_mbox;
+    // I/O channel (see vmm/vmchan.c).
+    uint64_t chan_ring;		// Guest physical address of the ring, or 0
+    void *chan_ring_kva;	// Host mapping of the (pinned) ring page
+    int32_t chan_waiter;	// Backend blocked in sys_vmchan_wait(), or 0
+    int chan_kicked;		// Doorbell rung while nobody waited
+    // Inter-VM shared memory (see vmm/vmshm.c).
+    int shm_ports[VMX_SHM_PORTS];	// Bound object + 1, or 0
+    uint32_t shm_pending;		// Ports signalled but not yet waited on
+    uint32_t shm_waiting;		// Ports the blocked guest waits on
+    // Scheduling (see kern/sched.c).
+    uint32_t sched_weight;		// Relative CPU share
+    uint32_t sched_cap;			// Percent of one CPU, or 0 for no cap
+    uint64_t sched_vruntime;		// Runtime scaled by weight
+    uint64_t sched_runtime;		// TSC cycles spent in non-root mode
+    uint64_t sched_period;		// Cap window of sched_period_runtime
+    uint64_t sched_period_runtime;	// Cycles run in that window
+    uint64_t sched_slice_end;		// TSC when the current slice ends
+    uint64_t sched_wait_since;		// TSC it was last left waiting, or 0
+    uint64_t sched_steal;		// Cycles runnable but not running
+    uint64_t sched_preempted;		// Times it lost the CPU while runnable
+    int sched_yielded;			// Let other guests go first
+    // Spinning guests (see handle_pause() in vmm/vmexits.c).
+    uint64_t pause_exits;		// PAUSE loops cut short
+    uint64_t yields;			// VMX_VMCALL_YIELD calls
+    uint64_t yield_cycles;		// Slice given up by both, in TSC cycles
+    // Steal-time page the guest registered (pinned), or NULL.
+    struct vmx_steal_time *steal_page;
+    // VM-exit trace ring (see vmm/vmtrace.c), or NULL.
+    struct vmtrace_buf *trace;
+    bool trace_on;			// Exits are being recorded
 };
 
+// Guest scheduling weights for sys_env_set_sched().  A guest of weight
+// 2 * VMX_SCHED_WEIGHT_DEFAULT gets twice the CPU of a default guest.
+#define VMX_SCHED_WEIGHT_DEFAULT	1024
+#define VMX_SCHED_WEIGHT_MAX		( 64 * VMX_SCHED_WEIGHT_DEFAULT )
+
+// Which CPUID features a guest sees.  The *_clear masks remove bits from
+// what the host CPU reports; pv_features selects the VMX_PV_* bits
+// advertised in leaf VMX_CPUID_PV_FEATURES.
+struct vmx_cpuid_policy {
+    uint32_t leaf1_ecx_clear;
+    uint32_t leaf1_edx_clear;
+    uint32_t leaf7_ebx_clear;
+    uint32_t leaf7_ecx_clear;
+    uint32_t leaf7_edx_clear;
+    uint32_t ext1_ecx_clear;
+    uint32_t ext1_edx_clear;
+    uint32_t pv_features;
+};
+
+// Hide VMX and SMX, which the guest cannot use, and advertise every
+// paravirtual feature the host implements.
+#define VMX_CPUID_POLICY_DEFAULT { \
+    .leaf1_ecx_clear = ( 1U << 5 ) | ( 1U << 6 ), \
+    .pv_features = VMX_PV_SUPPORTED, \
+}
+
 #endif
 
 #if defined(VMM_GUEST) || defined(VMM_HOST)
@@ -28,9 +143,65 @@ struct VmxGuestInfo {
 // VMCALLs
 #define VMX_VMCALL_MBMAP 0x1
 #define VMX_VMCALL_IPCSEND 0x2
-#define VMX_VMCALL_IPCRECV 0x3
+#define VMX_VMCALL_IPCRECV 0x3	// Posts a receive; completes in a vmx_ipc_mailbox
+#define VMX_VMCALL_NOP 0x4	// Does nothing; for timing the VMCALL round trip
+#define VMX_VMCALL_CHAN_SETUP 0x5	// Register a vmchan ring (rdx = gpa)
+#define VMX_VMCALL_CHAN_KICK 0x6	// Wake the sleeping vmchan backend
+#define VMX_VMCALL_SHM_INFO 0x7	// Pages of shared memory port rdx
+#define VMX_VMCALL_SHM_MAP 0x8	// Back gpa rbx with page rcx of port rdx
+#define VMX_VMCALL_SHM_NOTIFY 0x9	// Signal the peers on port rdx
+#define VMX_VMCALL_SHM_WAIT 0xA	// Take a signal on port rdx; rcx = block
+#define VMX_VMCALL_YIELD 0xB	// Give up the rest of the time slice
+#define VMX_VMCALL_STEAL_SETUP 0xC	// Register a steal-time page (rdx = gpa)
 
 #define VMX_HOST_FS_ENV 0x1
 
+// Completion record for a guest's host IPC receive.  The guest clears
+// 'done' and posts the receive with VMX_VMCALL_IPCRECV (rdx = guest
+// physical address of the page to receive into, or ~0; rbx = guest
+// physical address of this mailbox), which returns at once.  When a host
+// env sends, the host fills in the other fields and then sets 'done'.
+#ifndef __ASSEMBLER__
+struct vmx_ipc_mailbox {
+    volatile uint32_t done;
+    uint32_t value;
+    int32_t from;
+    uint32_t perm;
+};
+#endif
+
+// Steal-time page.  The guest registers a page-aligned struct
+// vmx_steal_time with VMX_VMCALL_STEAL_SETUP, and the host refreshes it
+// before every VM entry, so it is current whenever the guest reads it.
+// Steal time is time the guest was runnable but the host ran something
+// else: another guest, a host env, or nothing because of the guest's cap.
+#ifndef __ASSEMBLER__
+struct vmx_steal_time {
+    volatile uint64_t steal;		// TSC cycles stolen since setup
+    volatile uint64_t preempted;	// Times the guest lost the CPU while runnable
+    volatile uint64_t tsc_khz;		// TSC rate, or 0 if not measured yet
+};
+#endif
+
+// CPUID.1:ECX bit that real hardware leaves clear and hypervisors set.
+#define CPUID_1_ECX_HYPERVISOR (1U << 31)
+
+// Hypervisor CPUID leaves.  VMX_CPUID_SIGNATURE returns the highest
+// hypervisor leaf in eax and "JOSVMMJOSVMM" in ebx, ecx, edx.
+#define VMX_CPUID_SIGNATURE 0x40000000
+#define VMX_CPUID_PV_FEATURES 0x40000001
+#define VMX_CPUID_MAX_LEAF VMX_CPUID_PV_FEATURES
+#define VMX_CPUID_SIG_EBX 0x56534f4a	// "JOSV"
+#define VMX_CPUID_SIG_ECX 0x4f4a4d4d	// "MMJO"
+#define VMX_CPUID_SIG_EDX 0x4d4d5653	// "SVMM"
+
+// Paravirtual feature bits in VMX_CPUID_PV_FEATURES eax.  A bit is only
+// advertised once the host implements the feature (VMX_PV_SUPPORTED).
+#define VMX_PV_CLOCK 0x1		// Paravirtual clock page
+#define VMX_PV_HCALL_BATCH 0x2		// Batched hypercalls
+#define VMX_PV_YIELD 0x4		// VMX_VMCALL_YIELD
+#define VMX_PV_STEAL 0x8		// Steal-time page
+#define VMX_PV_SUPPORTED ( VMX_PV_YIELD | VMX_PV_STEAL )
+
 #endif
 #endif
@@ -280,6 +280,16 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
         *edxp = edx;
 }
 
+// cpuid for leaves whose output depends on the subleaf in ecx.
+    static __inline void
+cpuid_count(uint32_t info, uint32_t subleaf, uint32_t *eaxp, uint32_t *ebxp,
+            uint32_t *ecxp, uint32_t *edxp)
+{
+    asm volatile("cpuid"
+            : "=a" (*eaxp), "=b" (*ebxp), "=c" (*ecxp), "=d" (*edxp)
+            : "a" (info), "c" (subleaf));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr,uint32_t newval){
     uint32_t result;
@@ -292,9 +302,10 @@ xchg(volatile uint32_t *addr,uint32_t newval){
     static __inline uint64_t
 read_tsc(void)
 {
-    uint64_t tsc;
-    __asm __volatile("rdtsc" : "=A" (tsc));
-    return tsc;
+    uint32_t lo, hi;
+    // "=A" only means edx:eax in 32-bit mode; in long mode it is one register.
+    __asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
 }
 
 static __inline uint64_t
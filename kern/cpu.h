@@ -7,15 +7,15 @@
 #include <inc/mmu.h>
 #include <inc/env.h>
 
-// Disable SMP for bochs (JOS's SMP detection code breaks on bochs).
-#define NCPU  1
-
+// Maximum number of CPUs; mp_init() ignores any beyond this.
+#define NCPU  8
 
 
 // Values of status in struct Cpu
 enum {
 	CPU_UNUSED = 0,
 	CPU_STARTED,
+	CPU_HALTED,
 };
 
 // Per-CPU state
@@ -26,6 +26,10 @@ struct Cpu {
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
     bool is_vmx_root;               // Is the CPU in VMX root mode?
     uintptr_t vmxon_region;         // KVA of vmxon region.
+    // EPT of the guest this CPU is running in non-root mode, or NULL.
+    uint64_t *volatile cpu_guest_ept;
+    // ept_gen up to which this CPU's guest translations are flushed.
+    volatile uint64_t cpu_ept_gen;
 };
 
 // Initialized in mpconfig.c
@@ -45,5 +49,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
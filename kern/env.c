@@ -16,8 +16,15 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/reclaim.h>
 #include <vmm/vmx.h>
 #include <vmm/ept.h>
+#include <vmm/vmexits.h>
+#include <vmm/vmchan.h>
+#include <vmm/vmmio.h>
+#include <vmm/vmshm.h>
+#include <vmm/vmpool.h>
+#include <vmm/vmtrace.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -136,6 +143,7 @@ env_init(void)
 	    envs[i].env_link = NULL;
 	else
 	    envs[i].env_link = &envs[i+1];
+	envs[i].env_runq = NULL;
     }
 
 
@@ -219,6 +227,7 @@ env_setup_vm(struct Env *e)
 		pp->pp_ref++;
 		pdpe = (pdpe_t *) page2pa(pp);
 		e->env_pml4e[PML4(UTOP)] = (uint64_t) pdpe | PTE_P | PTE_U | PTE_W;
+		pt_mark_used(&e->env_pml4e[PML4(UTOP)]);
 	}
 
 //pdpe entry exists so read it
@@ -233,6 +242,7 @@ env_setup_vm(struct Env *e)
 		pp->pp_ref++;
 		pgdir = (pde_t*) page2pa(pp);
 		pdpe[PDPE(UTOP)] = (uint64_t) pgdir | PTE_P | PTE_W | PTE_U;
+		pt_mark_used(&pdpe[PDPE(UTOP)]);
 
 	}
 
@@ -258,64 +268,18 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 {
     int32_t generation;
     struct Env *e;
+    int r;
 
     if (!(e = env_free_list))
         return -E_NO_FREE_ENV;
 
     memset(&e->env_vmxinfo, 0, sizeof(struct VmxGuestInfo));
 
-    // allocate a page for the EPT PML4..
-    struct Page *p = NULL;
-
-    if (!(p = page_alloc(ALLOC_ZERO)))
-        return -E_NO_MEM;
-
-    memset(p, 0, sizeof(struct Page));
-    p->pp_ref       += 1;
-    e->env_pml4e    = page2kva(p);
-    e->env_cr3      = page2pa(p);
-
-    // Allocate a VMCS.
-    struct Page *q = vmx_init_vmcs();
-    if (!q) {
-        page_decref(p);
-        return -E_NO_MEM;
-    }
-    q->pp_ref += 1;
-    e->env_vmxinfo.vmcs = page2kva(q);
-
-    // Allocate a page for msr load/store area.
-    struct Page *r = NULL;
-    if (!(r = page_alloc(ALLOC_ZERO))) {
-        page_decref(p);
-        page_decref(q);
-        return -E_NO_MEM;
-    }
-    r->pp_ref += 1;
-    e->env_vmxinfo.msr_host_area = page2kva(r);
-    e->env_vmxinfo.msr_guest_area = page2kva(r) + PGSIZE / 2;
-
-    // Allocate pages for IO bitmaps.
-    struct Page *s = NULL;
-    if (!(s = page_alloc(ALLOC_ZERO))) {
-        page_decref(p);
-        page_decref(q);
-        page_decref(r);
-        return -E_NO_MEM;
-    }
-    s->pp_ref += 1;
-    e->env_vmxinfo.io_bmap_a = page2kva(s);
-
-    struct Page *t = NULL;
-    if (!(t = page_alloc(ALLOC_ZERO))) {
-        page_decref(p);
-        page_decref(q);
-        page_decref(r);
-        page_decref(s);
-        return -E_NO_MEM;
-    }
-    t->pp_ref += 1;
-    e->env_vmxinfo.io_bmap_b = page2kva(t);
+    // Take a prepared shell: EPT root, VMCS, MSR area, I/O bitmaps and
+    // CPUID table (see vmm/vmpool.c).
+    if ((r = vmpool_get(e)) < 0)
+        return r;
+    sched_guest_init(e);
 
     // Generate an env_id for this environment.
     generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -326,9 +290,10 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
     // Set the basic status variables.
     e->env_parent_id = parent_id;
     e->env_type = ENV_TYPE_GUEST;
-    e->env_status = ENV_RUNNABLE;
-
     e->env_runs = 0;
+    e->env_cpunum = cpunum();
+    // Only once it knows its CPU and class can it go on a run queue.
+    env_set_status(e, ENV_RUNNABLE);
 
     memset(&e->env_tf, 0, sizeof(e->env_tf));
 
@@ -343,25 +308,35 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 }
 
 void env_guest_free(struct Env *e) {
-    // Free the VMCS.
-    page_decref(pa2page(PADDR(e->env_vmxinfo.vmcs)));
-    // Free msr load/store area.
-    page_decref(pa2page(PADDR(e->env_vmxinfo.msr_host_area)));
-    // Free IO bitmaps page.
-    page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_a)));
-    page_decref(pa2page(PADDR(e->env_vmxinfo.io_bmap_b)));
-    
-    // Free the host pages that were allocated for the guest and 
-    // the EPT tables itself.
-    free_guest_mem(e->env_pml4e);
-
-    // Free the EPT PML4 page.
-    page_decref(pa2page(e->env_cr3));
+    // Unpin the mailbox of a pending host IPC receive.
+    vmx_ipc_cancel(e);
+    // Unpin the steal-time page.
+    vmx_steal_release(e);
+    // Drop its exit trace ring.
+    vmtrace_release(e);
+    // Unpin the I/O channel ring and let its backend notice.
+    vmchan_release(e);
+    // Remove its emulated MMIO devices.
+    vmmio_release(e);
+    // Unbind its shared memory ports.
+    vmshm_release(e);
+    // Flush the VMCS out of this CPU, the only one that may still hold it,
+    // then keep it, the MSR area, I/O bitmaps and CPUID table for a later
+    // guest, or free them.
+    vmx_vmcs_put(e);
+    vmpool_put(e);
+
+    // No CPU may keep translations through tables that are about to be
+    // reused.
+    ept_invalidate(e->env_pml4e);
+    // Queue the host pages that were allocated for the guest and
+    // the EPT tables themselves, PML4 included, for deferred freeing.
+    reclaim_enqueue(e->env_cr3, RECLAIM_EPT);
     e->env_pml4e = 0;
     e->env_cr3 = 0;
 
     // return the environment to the free list
-    e->env_status = ENV_FREE;
+    env_set_status(e, ENV_FREE);
     e->env_link = env_free_list;
     env_free_list = e;
 
@@ -399,8 +374,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
     // Set the basic status variables.
     e->env_parent_id = parent_id;
     e->env_type = ENV_TYPE_USER;
-    e->env_status = ENV_RUNNABLE;
     e->env_runs = 0;
+    // Start on the creator's CPU; an idle CPU may take it from there.
+    e->env_cpunum = cpunum();
+    env_set_status(e, ENV_RUNNABLE);
 
     // Clear out all the saved register state,
     // to prevent the register values
@@ -589,6 +566,8 @@ env_create(uint8_t *binary, enum EnvType type)
     else {
 	load_icode(env, binary);
 	env->env_type = type;
+	// Move it to the run queue of its new class, if any.
+	env_set_status(env, ENV_RUNNABLE);
 	if (env->env_type == ENV_TYPE_FS)
 	    env->env_tf.tf_eflags |= FL_IOPL_MASK;
     }
@@ -603,8 +582,6 @@ env_create(uint8_t *binary, enum EnvType type)
     void
 env_free(struct Env *e)
 {
-    pte_t *pt;
-    uint64_t pdeno, pteno;
     physaddr_t pa;
 
     // If freeing the current environment, switch to kern_pgdir
@@ -616,58 +593,31 @@ env_free(struct Env *e)
     // Note the environment's demise.
     // cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-    // Flush all mapped pages in the user portion of the address space
-    pdpe_t *env_pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
-    int pdeno_limit;
-    uint64_t pdpe_index;
-    // using 3 instead of NPDPENTRIES as we have only first three indices
-    // set for 4GB of address space.
-    for(pdpe_index=0;pdpe_index<=3;pdpe_index++){
-        if(!(env_pdpe[pdpe_index] & PTE_P))
-            continue;
-        pde_t *env_pgdir = KADDR(PTE_ADDR(env_pdpe[pdpe_index]));
-        pdeno_limit  = pdpe_index==3?PDX(UTOP):PDX(0xFFFFFFFF);
-        static_assert(UTOP % PTSIZE == 0);
-        for (pdeno = 0; pdeno < pdeno_limit; pdeno++) {
-
-            // only look at mapped page tables
-            if (!(env_pgdir[pdeno] & PTE_P))
-                continue;
-            // find the pa and va of the page table
-            pa = PTE_ADDR(env_pgdir[pdeno]);
-            pt = (pte_t*) KADDR(pa);
-
-            // unmap all PTEs in this page table
-            for (pteno = 0; pteno < PTX(~0); pteno++) {
-                if (pt[pteno] & PTE_P){
-                    page_remove(e->env_pml4e, PGADDR((uint64_t)0,pdpe_index,pdeno, pteno, 0));
-                }
-            }
-
-            // free the page table itself
-            env_pgdir[pdeno] = 0;
-            page_decref(pa2page(pa));
-        }
-        // free the page directory
-        pa = PTE_ADDR(env_pdpe[pdpe_index]);
-        env_pdpe[pdpe_index] = 0;
-        page_decref(pa2page(pa));
-    }
-    // free the page directory pointer
-    page_decref(pa2page(PTE_ADDR(e->env_pml4e[0])));
-    // free the page map level 4 (PML4)
-    e->env_pml4e[0] = 0;
+    // Hand the page tables and every page mapped below UTOP to the
+    // reclaim queue, which frees them a batch at a time.
     pa = e->env_cr3;
     e->env_pml4e = 0;
     e->env_cr3 = 0;
-    page_decref(pa2page(pa));
+    reclaim_enqueue(pa, RECLAIM_PGTABLE);
 
     // return the environment to the free list
-    e->env_status = ENV_FREE;
+    env_set_status(e, ENV_FREE);
     e->env_link = env_free_list;
     env_free_list = e;
 }
 
+//
+// Set the status of e and move it on or off its CPU's run queue to match.
+// Status changes must all come through here, or the scheduler will not
+// see them.
+//
+    void
+env_set_status(struct Env *e, unsigned status)
+{
+    e->env_status = status;
+    sched_requeue(e);
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
@@ -679,8 +629,9 @@ env_destroy(struct Env *e)
     // If e is currently running on other CPUs, we change its state to
     // ENV_DYING. A zombie environment will be freed the next time
     // it traps to the kernel.
-    if (e->env_status == ENV_RUNNING && curenv != e) {
-        e->env_status = ENV_DYING;
+    if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) &&
+        curenv != e) {
+        env_set_status(e, ENV_DYING);
         return;
     }
 
@@ -732,16 +683,17 @@ void env_run(struct Env *e)
     // LAB 3: Your code here.
     if (curenv != NULL) {
 	if (curenv->env_status == ENV_RUNNING) {
-	    curenv->env_status = ENV_RUNNABLE;
+	    env_set_status(curenv, ENV_RUNNABLE);
 	}
     }
 
     curenv = e;
-    curenv->env_status = ENV_RUNNING;
+    env_set_status(curenv, ENV_RUNNING);
     curenv->env_runs++;
 
     lcr3(curenv->env_cr3);
 
+    unlock_kernel();
     env_pop_tf(&(curenv->env_tf));
 
 
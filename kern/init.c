@@ -19,6 +19,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <vmm/vmexits.h>
 
 #if defined(TEST_EPT_MAP)
 int test_ept_map(void);
@@ -88,8 +89,13 @@ i386_init(void)
 	time_init();
        pci_init();
 
+#ifndef VMM_GUEST
+	// Guest CPUID tables are copied from this, on any CPU.
+	vmx_cpuid_host_init();
+#endif
+
 	// Acquire the big kernel lock before waking up APs
-	// Your code here:
+	lock_kernel();
 
 #ifndef VMM_GUEST
 	// Starting non-boot CPUs
@@ -109,6 +115,10 @@ i386_init(void)
 
 	 cprintf("\nAdding FILE SYSTEM");
         ENV_CREATE(fs_fs,ENV_TYPE_FS);
+#ifndef VMM_GUEST
+	// Only this env may page guest memory; see vmm/vmpager.c.
+	ENV_CREATE(user_vmpager, ENV_TYPE_PAGER);
+#endif
 
 #if defined(TEST_EPT_MAP)
 	test_ept_map();
@@ -172,11 +182,8 @@ mp_main(void)
 	// Now that we have finished some basic setup, call sched_yield()
 	// to start running processes on this CPU.  But make sure that
 	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-
-	// Remove this after you finish Exercise 4
-	for (;;);
+	lock_kernel();
+	sched_yield();
 }
 
 /*
@@ -13,6 +13,8 @@
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
 #include <kern/trap.h>
+#include <vmm/vmwss.h>
+#include <vmm/vmpool.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -28,6 +30,8 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display stack backtrace", mon_backtrace },	
+	{ "wss", "Display guest working-set estimates", mon_wss },
+	{ "vmpool", "Display or set [n] the spare guest shells", mon_vmpool },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -88,6 +92,22 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_wss(int argc, char **argv, struct Trapframe *tf)
+{
+	vmwss_dump();
+	return 0;
+}
+
+int
+mon_vmpool(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1)
+		vmpool_set_target(strtol(argv[1], NULL, 0));
+	vmpool_dump();
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
@@ -11,6 +11,8 @@
 #include <kern/multiboot.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/reclaim.h>
+#include <vmm/vmpool.h>
 
 #define BOOT_PAGE_TABLE_START 0xf0008000
 #define BOOT_PAGE_TABLE_END   0xf000e000
@@ -24,6 +26,7 @@ pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 struct Page *pages;		// Physical page state array
 static struct Page *page_free_list;	// Free list of physical pages
+size_t page_nfree;			// Number of pages on page_free_list
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -360,8 +363,16 @@ mem_init_mp(void)
     //             Known as a "guard page".
     //     Permissions: kernel RW, user NONE
     //
-    // LAB 4: Your code here:
+    // CPU 0's stack moves from bootstack to percpu_kstacks[0] too; the
+    // boot CPU only runs on KSTACKTOP once it takes its first trap.
+    uintptr_t kstacktop_i;
+    int i;
 
+    for (i = 0; i < NCPU; i++) {
+        kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+        boot_map_segment(boot_pml4e, kstacktop_i - KSTKSIZE, KSTKSIZE,
+                         PADDR(percpu_kstacks[i]), PTE_W | PTE_P);
+    }
 }
 
 // --------------------------------------------------------------
@@ -420,6 +431,7 @@ page_init(void)
 		    pages[i].pp_ref = 0;
 		    pages[i].pp_link = page_free_list;
 		    page_free_list = &pages[i];
+		    page_nfree++;
 	    }
     }
 }
@@ -440,13 +452,25 @@ page_alloc(int alloc_flags)
 {
 	struct Page *pp;
 	pp = page_free_list;
+	if (pp == NULL) {
+		// Pages held by address spaces on the reclaim queue are as
+		// good as free; release some of them now, and then the
+		// spare guest shells.
+		while (page_free_list == NULL &&
+		       (reclaim_work(RECLAIM_BATCH) || vmpool_shrink()))
+			;
+		pp = page_free_list;
+	}
 	if (pp == NULL)	return 0; // Out of memory
 	else {
 		if (alloc_flags & ALLOC_ZERO) {
 			memset(page2kva(pp), '\0', 4096);
 		}
 		page_free_list = pp->pp_link;
+		page_nfree--;
 		pp->pp_link = NULL;
+		pp->pp_occ = 0;
+		pp->pp_age = 0;
 		return pp;
 	}
 }
@@ -471,6 +495,7 @@ page_free(struct Page *pp)
 	assert(pp->pp_ref == 0);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
+	page_nfree++;
 	pp->pp_ref = 0;
 }
 
@@ -533,6 +558,7 @@ pml4e_walk(pml4e_t *pml4e, const void *va, int create)
 				page_decref(newPage); // Free allocated page for PDPE
 			else {
 				*offsetd_ptr_in_pml4t = ((uint64_t)pdpt_base) | PTE_P | PTE_U | PTE_W;
+				pt_mark_used(offsetd_ptr_in_pml4t);
 				return pte;
 			}
 		}
@@ -570,6 +596,7 @@ pdpe_walk(pdpe_t *pdpe,const void *va,int create){
                         if (pte == NULL) page_decref(newPage); // Free allocated page for PDE
                         else {
                                 *offsetd_ptr_in_pdpt = ((uint64_t)pgdir_base) | PTE_P | PTE_U | PTE_W;
+                                pt_mark_used(offsetd_ptr_in_pdpt);
                                 return pte;
                         }
                }
@@ -602,6 +629,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
                         newPage->pp_ref++;
                         page_table_base = (pte_t*)page2pa(newPage);
 			*offsetd_ptr_in_pgdir = ((uint64_t)page_table_base) | PTE_P | PTE_W | PTE_U;
+			pt_mark_used(offsetd_ptr_in_pgdir);
 
 			// Return PTE
 		        uintptr_t index_in_page_table = PTX(va);
@@ -676,6 +704,7 @@ page_insert(pml4e_t *pml4e, struct Page *pp, void *va, int perm)
 	if(*pte & PTE_P)
 		page_remove(pml4e, va);
 	*pte = ((uint64_t)page2pa(pp)) | perm | PTE_P;
+	pt_mark_used(pte);
 	return 0;
 }
 
@@ -1032,7 +1061,6 @@ check_boot_pml4e(pml4e_t *pml4e)
 
     // check kernel stack
     // (updated in lab 4 to check per-CPU kernel stacks)
-    /*
     for (n = 0; n < NCPU; n++) {
         uint64_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
         for (i = 0; i < KSTKSIZE; i += PGSIZE)
@@ -1041,7 +1069,6 @@ check_boot_pml4e(pml4e_t *pml4e)
         for (i = 0; i < KSTKGAP; i += PGSIZE)
             assert(check_va2pa(pml4e, base + i) == ~0);
     }
-    */
 
     pdpe_t *pdpe = KADDR(PTE_ADDR(boot_pml4e[1]));
     pde_t  *pgdir = KADDR(PTE_ADDR(pdpe[0]));
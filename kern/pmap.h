@@ -14,6 +14,7 @@ extern char bootstacktop[], bootstack[];
 
 extern struct Page *pages;
 extern size_t npages;
+extern size_t page_nfree;
 
 extern pml4e_t *boot_pml4e;
 
@@ -91,6 +92,20 @@ page2kva(struct Page *pp)
 	return KADDR(page2pa(pp));
 }
 
+// Entries of a page-table page covered by each bit of its pp_occ.
+#define PT_OCC_SPAN	(NPTENTRIES / 32)
+
+// Record that the page-table entry at kernel address 'entry' is in use.
+// Must be called whenever an entry is filled in; only teardown clears
+// pp_occ bits, so a clear bit means its whole span of entries is empty.
+static inline void
+pt_mark_used(void *entry)
+{
+	struct Page *pp = pa2page(PADDR(entry));
+
+	pp->pp_occ |= 1U << (PGOFF(entry) / sizeof(pte_t) / PT_OCC_SPAN);
+}
+
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
 pte_t *pml4e_walk(pml4e_t *pml4e, const void *va, int create);
@@ -0,0 +1,135 @@
+// Deferred teardown of dead address spaces.
+//
+// Freeing every page of a large env or guest at once can keep the kernel
+// busy for a long time.  Instead, env_free() and env_guest_free() detach the
+// page-table root and queue it here; the tables are then released a bounded
+// batch at a time from the timer tick and the idle path, or on demand when
+// page_alloc() runs dry.  The pp_occ bits of each table page let the walk
+// skip spans of entries that were never used.
+
+#include <inc/mmu.h>
+#include <inc/ept.h>
+#include <inc/memlayout.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/reclaim.h>
+
+#define NRECLAIM	NENV
+
+static struct reclaim_job {
+	physaddr_t root;	// Top-level (PML4) table
+	int type;		// RECLAIM_PGTABLE or RECLAIM_EPT
+} reclaim_queue[NRECLAIM];
+
+// Jobs waiting to be torn down are reclaim_queue[head .. tail), mod NRECLAIM.
+static uint32_t reclaim_head, reclaim_tail;
+
+static const int reclaim_shift[] = { PTXSHIFT, PDXSHIFT, PDPESHIFT, PML4SHIFT };
+
+static bool
+reclaim_present(struct reclaim_job *job, uint64_t entry)
+{
+	if (job->type == RECLAIM_EPT)
+		return (entry & __EPTE_FULL) != 0;
+	return (entry & PTE_P) != 0;
+}
+
+// Does entry, above the last level, map a large page rather than a table?
+static bool
+reclaim_large(struct reclaim_job *job, uint64_t entry)
+{
+	return job->type == RECLAIM_EPT && (entry & __EPTE_SZ);
+}
+
+// Release the entries of table pt, which sits at 'level' (3 for the PML4)
+// and whose first entry maps address va.  Each entry released costs one
+// unit of *budget, and a large page one unit per 4 KB page.  Returns true
+// once everything pt maps has been released, false if the budget ran out
+// first; calling again picks up where it left off, since released entries
+// are cleared.
+static bool
+reclaim_table(struct reclaim_job *job, uint64_t *pt, int level,
+	      uintptr_t va, int *budget)
+{
+	struct Page *pp = pa2page(PADDR(pt));
+	uintptr_t eva;
+	physaddr_t pa;
+	size_t n, j;
+	int span, i;
+
+	for (span = 0; span < NPTENTRIES / PT_OCC_SPAN; span++) {
+		if (!(pp->pp_occ & (1U << span)))
+			continue;
+		for (i = span * PT_OCC_SPAN; i < (span + 1) * PT_OCC_SPAN; i++) {
+			eva = va + ((uintptr_t) i << reclaim_shift[level]);
+			// Env tables share the kernel's tables above UTOP.
+			if (job->type == RECLAIM_PGTABLE && eva >= UTOP)
+				return true;
+			if (!reclaim_present(job, pt[i]))
+				continue;
+			if (*budget <= 0)
+				return false;
+			pa = PTE_ADDR(pt[i]);
+			if (level > 0 && reclaim_large(job, pt[i])) {
+				// A large EPT leaf holds a reference on each
+				// 4 KB page it maps; it is not a table.
+				n = 1UL << (9 * level);
+				pt[i] = 0;
+				for (j = 0; j < n; j++)
+					page_decref(pa2page(pa + j * PGSIZE));
+				*budget -= n;
+				continue;
+			}
+			if (level > 0 &&
+			    !reclaim_table(job, KADDR(pa), level - 1, eva, budget))
+				return false;
+			pt[i] = 0;
+			page_decref(pa2page(pa));
+			--*budget;
+		}
+		pp->pp_occ &= ~(1U << span);
+	}
+	return true;
+}
+
+// Queue the address space rooted at the PML4 page 'root' for teardown.
+// The caller must no longer be using it; the root page itself is freed
+// along with the rest.
+void
+reclaim_enqueue(physaddr_t root, int type)
+{
+	// If the queue is full, finish the oldest job to make room.
+	while (reclaim_tail - reclaim_head == NRECLAIM)
+		reclaim_work(RECLAIM_IDLE_BATCH);
+
+	reclaim_queue[reclaim_tail % NRECLAIM].root = root;
+	reclaim_queue[reclaim_tail % NRECLAIM].type = type;
+	reclaim_tail++;
+}
+
+// Release up to 'budget' page-table entries, oldest job first.
+// Returns true if there is still work queued.
+bool
+reclaim_work(int budget)
+{
+	struct reclaim_job *job;
+
+	while (reclaim_head != reclaim_tail && budget > 0) {
+		job = &reclaim_queue[reclaim_head % NRECLAIM];
+		if (!reclaim_table(job, KADDR(job->root), 3, 0, &budget))
+			break;
+		page_decref(pa2page(job->root));
+		reclaim_head++;
+	}
+	return reclaim_head != reclaim_tail;
+}
+
+// Tear down everything on the queue.
+void
+reclaim_drain(void)
+{
+	while (reclaim_work(RECLAIM_IDLE_BATCH))
+		;
+}
@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_RECLAIM_H
+#define JOS_KERN_RECLAIM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Kinds of address space the reclaim queue can tear down.
+enum {
+	RECLAIM_PGTABLE = 0,	// Env page table; only the part below UTOP
+	RECLAIM_EPT,		// Guest EPT; every entry
+};
+
+// Maximum number of page-table entries released per call to reclaim_work()
+// from the timer tick, from the idle path and from page_alloc().
+#define RECLAIM_BATCH		512
+#define RECLAIM_IDLE_BATCH	4096
+
+void reclaim_enqueue(physaddr_t root, int type);
+bool reclaim_work(int budget);
+void reclaim_drain(void);
+
+#endif /* !JOS_KERN_RECLAIM_H */
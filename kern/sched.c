@@ -1,9 +1,17 @@
 #include <inc/assert.h>
 
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/reclaim.h>
+#include <kern/sched.h>
+#include <kern/time.h>
+#include <inc/x86.h>
 #include <vmm/vmx.h>
+#include <vmm/vmwss.h>
+#include <vmm/vmpool.h>
 
 
 static int
@@ -22,99 +30,461 @@ vmxon() {
     return 0;
 }
 
-// Choose a user environment to run and run it.
-    void
-sched_yield(void)
+// Guests do not take part in the round-robin scan.  They are ordered by
+// virtual runtime: the TSC cycles each has spent in VMX non-root mode,
+// scaled by VMX_SCHED_WEIGHT_DEFAULT / weight, so a guest with twice the
+// weight gets twice the CPU.  A guest may also be capped at a percentage of
+// one CPU, enforced over windows of VSCHED_PERIOD_MS.  When both host envs
+// and guests are runnable the two classes take turns, so a busy guest
+// cannot starve the file system and network servers.
+
+// Length of a cap window.
+#define VSCHED_PERIOD_MS	100
+// A running guest keeps the CPU until its vruntime is this many cycles
+// ahead of the most deserving guest, so guests do not trade places on
+// every VM exit.
+#define VSCHED_GRANULARITY	2000000ULL
+// How far behind the others a blocked guest may fall.  Without a limit it
+// could bank runtime while asleep and then monopolize the CPU.
+#define VSCHED_WAKEUP_CREDIT	(4 * VSCHED_GRANULARITY)
+
+static uint64_t vsched_min_vruntime;	// Never decreases
+static uint64_t vsched_period;		// Current cap window
+static unsigned vsched_period_ms;	// time_msec() when it began
+static uint64_t vsched_period_tsc;	// TSC when it began
+static uint64_t vsched_period_cycles;	// TSC cycles per window, 0 if unknown
+
+// Start a new cap window if the current one is over.  The TSC rate is
+// measured against the timer as a side effect.
+static void
+vsched_roll_period(void)
 {
-    struct Env *idle;
-    int i;
+    unsigned now = time_msec();
+    uint64_t tsc;
 
+    if (now - vsched_period_ms < VSCHED_PERIOD_MS)
+        return;
+    tsc = read_tsc();
+    if (vsched_period_tsc)
+        vsched_period_cycles = (tsc - vsched_period_tsc) * VSCHED_PERIOD_MS /
+            (now - vsched_period_ms);
+    vsched_period++;
+    vsched_period_ms = now;
+    vsched_period_tsc = tsc;
+}
 
+static uint64_t
+guest_period_runtime(struct VmxGuestInfo *g)
+{
+    return g->sched_period == vsched_period ? g->sched_period_runtime : 0;
+}
 
+// Has g used up its cap for this window?
+static bool
+guest_throttled(struct VmxGuestInfo *g)
+{
+    if (g->sched_cap == 0 || vsched_period_cycles == 0)
+        return false;
+    return guest_period_runtime(g) >= vsched_period_cycles * g->sched_cap / 100;
+}
 
-    // Implement simple round-robin scheduling.
-    //
-    // Search through 'envs' for an ENV_RUNNABLE environment in
-    // circular fashion starting just after the env this CPU was
-    // last running.  Switch to the first such environment found.
-    //
-    // If no envs are runnable, but the environment previously
-    // running on this CPU is still ENV_RUNNING, it's okay to
-    // choose that environment.
-    //
-    // Never choose an environment that's currently running on
-    // another CPU (env_status == ENV_RUNNING) and never choose an
-    // idle environment (env_type == ENV_TYPE_IDLE).  If there are
-    // no runnable environments, simply drop through to the code
-    // below to switch to this CPU's idle environment.
-
-    // LAB 4: Your code here.
-    if (curenv) {
-	    for (i = ENVX(curenv->env_id)+1; i != ENVX(curenv->env_id); i = (i+1)%NENV) 
-
-	   {    
-		if (envs[i].env_type != ENV_TYPE_IDLE && 
-			#ifdef RUN_POSTPROCESS_DEDUP_ON_IDLE
-			envs[i].env_type != ENV_TYPE_PP_DEDUP &&
-			#endif
-			envs[i].env_status == ENV_RUNNABLE)
-			    break;
-	    }
-	    if (i != ENVX(curenv->env_id) || // Termination condition of circular queue
-		(i == ENVX(curenv->env_id) && envs[i].env_type != ENV_TYPE_IDLE &&
-		 envs[i].env_status == ENV_RUNNING)) // Choose only if current is in running state
-                {
-			
-	
-			if(envs[i].env_type == ENV_TYPE_GUEST)
-			{
-			
-				if(!vmxon())
-				{
-					    if (curenv != NULL) {
-							if (curenv->env_status == ENV_RUNNING) {
-	   							 curenv->env_status = ENV_RUNNABLE;
-								}
-    								}
-
-    						curenv = &envs[i];
-    						curenv->env_status = ENV_RUNNING;
-    						curenv->env_runs++;
-
-						vmx_vmrun(curenv);
-				}
-				else
-				{
-					cprintf("EPT extension not supported");
-				}
-                            
-			}
-			else
-			{
-					
-				env_run(&envs[i]);
-			}
-				
-   		}	
-	
-	}
-    // For debugging and testing purposes, if there are no
-    // runnable environments other than the idle environments,
-    // drop into the kernel monitor.
-    for (i = 0; i < NENV; i++) {
-        if (envs[i].env_type != ENV_TYPE_IDLE && envs[i].env_type != ENV_TYPE_PP_DEDUP &&
-                (envs[i].env_status == ENV_RUNNABLE ||
-                 envs[i].env_status == ENV_RUNNING)) {
+// Give a new guest default weight, no cap, and the current minimum
+// vruntime so it neither starves nor is starved by the running guests.
+void
+sched_guest_init(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+
+    g->sched_weight = VMX_SCHED_WEIGHT_DEFAULT;
+    g->sched_cap = 0;
+    g->sched_vruntime = vsched_min_vruntime;
+    g->sched_runtime = 0;
+    g->sched_period = vsched_period;
+    g->sched_period_runtime = 0;
+}
+
+// Charge guest e for 'cycles' TSC cycles spent in non-root mode.
+void
+sched_guest_account(struct Env *e, uint64_t cycles)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+
+    g->sched_runtime += cycles;
+    if (g->sched_period != vsched_period) {
+        g->sched_period = vsched_period;
+        g->sched_period_runtime = 0;
+    }
+    g->sched_period_runtime += cycles;
+    g->sched_vruntime += cycles * VMX_SCHED_WEIGHT_DEFAULT / g->sched_weight;
+}
+
+// TSC cycles guest e may run before the scheduler should look again: long
+// enough to get VSCHED_GRANULARITY ahead in vruntime, but no more than is
+// left of its cap in this window.  vmx_vmrun() arms the VMX preemption
+// timer with it.
+uint64_t
+sched_guest_slice(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    uint64_t slice, budget, used;
+
+    slice = VSCHED_GRANULARITY * g->sched_weight / VMX_SCHED_WEIGHT_DEFAULT;
+    if (g->sched_cap && vsched_period_cycles) {
+        budget = vsched_period_cycles * g->sched_cap / 100;
+        used = guest_period_runtime(g);
+        slice = MIN(slice, budget > used ? budget - used : 0);
+    }
+    return slice;
+}
+
+// Guest e is spinning, or asked to yield: end its slice and let any other
+// runnable guest go before it at the next pick.  The part of the slice it
+// gives up is counted in yield_cycles.
+void
+sched_guest_yield(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    uint64_t now = read_tsc();
+
+    if (g->sched_slice_end > now)
+        g->yield_cycles += g->sched_slice_end - now;
+    g->sched_slice_end = now;
+    g->sched_yielded = 1;
+}
+
+// TSC cycles per millisecond, or 0 until the first cap window has
+// measured it.
+uint64_t
+sched_tsc_khz(void)
+{
+    return vsched_period_cycles / VSCHED_PERIOD_MS;
+}
+
+// Steal time: the cycles a guest spends runnable but not running.  A guest
+// starts waiting when the scheduler passes it over, either taking the CPU
+// from it or finding it woken up, and stops when it is entered again.
+// Waiting while blocked does not count.
+static void
+guest_wait(struct Env *e, uint64_t now)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+
+    if (g->sched_wait_since == 0)
+        g->sched_wait_since = now;
+}
+
+// Runnable envs wait on per-CPU run queues, kept up to date by
+// env_set_status(), so picking the next env never scans the env table.
+// Host envs queue in FIFO order, which makes them take turns; guests are
+// kept sorted by vruntime, so the most deserving one is at the head.
+// An env queues on the CPU it last ran on.  A CPU that has nothing of its
+// own to run steals from CPUs that are busy with another env or halted;
+// only a CPU spinning in its idle env is sure to get to its envs soon.
+struct sched_runq {
+    struct Env *head, *tail;
+};
+
+static struct sched_runq host_runq[NCPU];
+static struct sched_runq guest_runq[NCPU];
+static int sched_nqueued;		// Envs on all run queues together
+
+static struct sched_runq *
+runq_of(struct Env *e)
+{
+    int cpu = e->env_cpunum;
+
+    if (cpu < 0 || cpu >= ncpu)
+        cpu = cpunum();
+    return e->env_type == ENV_TYPE_GUEST ? &guest_runq[cpu] : &host_runq[cpu];
+}
+
+// Put e on q before 'before', or at the tail if before is NULL.
+static void
+runq_insert(struct sched_runq *q, struct Env *e, struct Env *before)
+{
+    e->env_runq = q;
+    e->env_runq_next = before;
+    e->env_runq_prev = before ? before->env_runq_prev : q->tail;
+    if (e->env_runq_prev)
+        e->env_runq_prev->env_runq_next = e;
+    else
+        q->head = e;
+    if (before)
+        before->env_runq_prev = e;
+    else
+        q->tail = e;
+    sched_nqueued++;
+}
+
+static void
+runq_remove(struct Env *e)
+{
+    struct sched_runq *q = e->env_runq;
+
+    if (!q)
+        return;
+    if (e->env_runq_prev)
+        e->env_runq_prev->env_runq_next = e->env_runq_next;
+    else
+        q->head = e->env_runq_next;
+    if (e->env_runq_next)
+        e->env_runq_next->env_runq_prev = e->env_runq_prev;
+    else
+        q->tail = e->env_runq_prev;
+    e->env_runq = NULL;
+    e->env_runq_next = e->env_runq_prev = NULL;
+    sched_nqueued--;
+}
+
+// e's status, type or CPU changed: take it off the run queue it is on and
+// put it on the right one if it is runnable.  Idle envs never queue; each
+// CPU falls back on its own.
+void
+sched_requeue(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    struct sched_runq *q;
+    struct Env *pos;
+    uint64_t floor;
+
+    runq_remove(e);
+    if (e->env_status != ENV_RUNNABLE) {
+        if (e->env_type == ENV_TYPE_GUEST && e->env_status != ENV_RUNNING)
+            g->sched_wait_since = 0;
+        return;
+    }
+    if (e->env_type == ENV_TYPE_IDLE)
+        return;
+#ifdef RUN_POSTPROCESS_DEDUP_ON_IDLE
+    if (e->env_type == ENV_TYPE_PP_DEDUP)
+        return;
+#endif
+    q = runq_of(e);
+    if (e->env_type != ENV_TYPE_GUEST) {
+        runq_insert(q, e, NULL);
+        return;
+    }
+
+    floor = vsched_min_vruntime > VSCHED_WAKEUP_CREDIT ?
+        vsched_min_vruntime - VSCHED_WAKEUP_CREDIT : 0;
+    if (g->sched_vruntime < floor)
+        g->sched_vruntime = floor;
+    guest_wait(e, read_tsc());
+    for (pos = q->head; pos; pos = pos->env_runq_next)
+        if (pos->env_vmxinfo.sched_vruntime > g->sched_vruntime)
             break;
+    runq_insert(q, e, pos);
+}
+
+// May this CPU take envs from cpu's run queues?
+static bool
+sched_can_steal(int cpu)
+{
+    struct Env *owner = cpus[cpu].cpu_env;
+
+    if (cpu == cpunum())
+        return false;
+    return !owner || owner->env_type != ENV_TYPE_IDLE ||
+        owner->env_status != ENV_RUNNING;
+}
+
+// Return the first guest on q that is not over its cap, passing over
+// guests that just yielded.  The first of those is left in *yielder, if
+// it is still empty, to be run if no other guest can.
+static struct Env *
+guest_runq_first(struct sched_runq *q, struct Env **yielder)
+{
+    struct VmxGuestInfo *g;
+    struct Env *e;
+
+    for (e = q->head; e; e = e->env_runq_next) {
+        g = &e->env_vmxinfo;
+        if (guest_throttled(g))
+            continue;
+        if (!g->sched_yielded)
+            return e;
+        g->sched_yielded = 0;
+        if (!*yielder)
+            *yielder = e;
+    }
+    return NULL;
+}
+
+// Pick the runnable guest with the smallest vruntime that is not over its
+// cap and did not just yield from this CPU's queue, or, if steal is set,
+// from the heads of the queues of the CPUs it may steal from.
+// Returns NULL if there is none.
+static struct Env *
+guest_pick_from(bool steal, struct Env **yielder)
+{
+    struct Env *e, *best = NULL;
+    int i;
+
+    if (!steal)
+        return guest_runq_first(&guest_runq[cpunum()], yielder);
+    for (i = 0; i < ncpu; i++) {
+        if (!sched_can_steal(i))
+            continue;
+        e = guest_runq_first(&guest_runq[i], yielder);
+        if (e && (!best || e->env_vmxinfo.sched_vruntime <
+                  best->env_vmxinfo.sched_vruntime))
+            best = e;
+    }
+    return best;
+}
+
+// Pick the next guest to run, which may be the current one.  Guests that
+// just yielded are only picked if no other guest can run.
+// Returns NULL if there is none.
+static struct Env *
+guest_pick(void)
+{
+    struct Env *cur = NULL, *best, *yielder = NULL;
+
+    if (curenv && curenv->env_type == ENV_TYPE_GUEST &&
+        curenv->env_status == ENV_RUNNING &&
+        !guest_throttled(&curenv->env_vmxinfo)) {
+        cur = curenv;
+        if (cur->env_vmxinfo.sched_yielded) {
+            cur->env_vmxinfo.sched_yielded = 0;
+            yielder = cur;
+            cur = NULL;
         }
     }
+    if (!(best = guest_pick_from(false, &yielder)))
+        best = guest_pick_from(true, &yielder);
+    if (best)
+        vsched_min_vruntime = MAX(vsched_min_vruntime,
+                                  best->env_vmxinfo.sched_vruntime);
+
+    // Let the current guest finish its slice.
+    if (cur && (!best || cur->env_vmxinfo.sched_vruntime <
+                best->env_vmxinfo.sched_vruntime + VSCHED_GRANULARITY))
+        return cur;
+    return best ? best : yielder;
+}
+
+// Pick the next runnable host env: the head of this CPU's queue, or the
+// one this CPU was running if there is no other, or the head of another
+// CPU's queue.  Returns NULL if there is none.
+static struct Env *
+host_pick(void)
+{
+    struct Env *e;
+    int i, cpu;
+
+    if ((e = host_runq[cpunum()].head))
+        return e;
+    if (curenv && curenv->env_type != ENV_TYPE_IDLE &&
+        curenv->env_type != ENV_TYPE_GUEST &&
+        curenv->env_status == ENV_RUNNING)
+        return curenv;
+    for (i = 1; i < ncpu; i++) {
+        cpu = (cpunum() + i) % ncpu;
+        if (host_runq[cpu].head && sched_can_steal(cpu))
+            return host_runq[cpu].head;
+    }
+    return NULL;
+}
 
+// Nothing to run on this CPU, which is not the boot CPU: halt it until its
+// next timer interrupt, which enters the scheduler again.  Only the boot
+// CPU has an idle env.
+static void
+sched_halt(void)
+{
+    if (curenv && curenv->env_status == ENV_RUNNING)
+        env_set_status(curenv, ENV_RUNNABLE);
+    curenv = NULL;
+    lcr3(boot_cr3);
 
+    xchg(&thiscpu->cpu_status, CPU_HALTED);
+    unlock_kernel();
 
+    // Reset the stack pointer, enable interrupts and then halt.
+    asm volatile (
+        "movq $0, %%rbp\n"
+        "movq %0, %%rsp\n"
+        "pushq $0\n"
+        "pushq $0\n"
+        "sti\n"
+        "1:\n"
+        "hlt\n"
+        "jmp 1b\n"
+        : : "a" (thiscpu->cpu_ts.ts_esp0));
+}
 
+// Enter guest e.  Returns only if the guest could not be started.
+static void
+guest_run(struct Env *e)
+{
+    struct VmxGuestInfo *g = &e->env_vmxinfo;
+    uint64_t now;
 
+    if (vmxon() < 0) {
+        cprintf("EPT extension not supported");
+        return;
+    }
+    now = read_tsc();
+    if (g->sched_wait_since) {
+        g->sched_steal += now - g->sched_wait_since;
+        g->sched_wait_since = 0;
+    }
+    if (curenv && curenv->env_status == ENV_RUNNING)
+        env_set_status(curenv, ENV_RUNNABLE);
+    curenv = e;
+    env_set_status(curenv, ENV_RUNNING);
+    curenv->env_runs++;
+    curenv->env_cpunum = cpunum();
+    vmx_vmrun(curenv);
+}
 
-	if (i == NENV) {
+// Choose a user environment to run and run it.
+    void
+sched_yield(void)
+{
+    struct Env *idle, *e;
+    int i;
+
+    vsched_roll_period();
+    vmwss_tick();
+
+    // Host envs and guests take turns; either class gets the whole CPU
+    // when the other has nothing to run.
+    if (curenv && curenv->env_type == ENV_TYPE_GUEST) {
+        if (!(e = host_pick()))
+            e = guest_pick();
+    } else {
+        if (!(e = guest_pick()))
+            e = host_pick();
+    }
+
+    // A guest that loses the CPU while it could still run starts waiting.
+    if (curenv && curenv != e && curenv->env_type == ENV_TYPE_GUEST &&
+        curenv->env_status == ENV_RUNNING) {
+        guest_wait(curenv, read_tsc());
+        curenv->env_vmxinfo.sched_preempted++;
+    }
+    // Whatever runs next, another CPU may take the guest that is leaving.
+    if (curenv && curenv != e && curenv->env_type == ENV_TYPE_GUEST)
+        vmx_vmcs_put(curenv);
+
+    if (e && e->env_type == ENV_TYPE_GUEST)
+        guest_run(e);
+    else if (e)
+        env_run(e);
+
+    // For debugging and testing purposes, if there are no
+    // runnable environments other than the idle environments,
+    // drop into the kernel monitor.  Runnable ones are all on a run
+    // queue; running ones are some CPU's current env.
+    for (i = 0; i < ncpu; i++) {
+        e = cpus[i].cpu_env;
+        if (e && e->env_status == ENV_RUNNING &&
+            e->env_type != ENV_TYPE_IDLE && e->env_type != ENV_TYPE_PP_DEDUP)
+            break;
+    }
+	if (sched_nqueued == 0 && i == ncpu && thiscpu == bootcpu) {
 #ifdef POST_PROCESS_DEDUP
         // Run post processing env of dedup module
         for (i = 0; i < NENV; i++) {
@@ -126,6 +496,8 @@ sched_yield(void)
                 }
         }
 #endif
+                // Nothing left to run; finish freeing dead envs first.
+                reclaim_drain();
                 cprintf("No more runnable environments!\n");
                 while (1)
                         monitor(NULL);
@@ -133,6 +505,14 @@ sched_yield(void)
 
 
 
+        // Idle time is free time for tearing down dead address spaces.
+        reclaim_work(RECLAIM_IDLE_BATCH);
+        // And for getting guest shells ready.
+        vmpool_work();
+
+        if (thiscpu != bootcpu)
+                sched_halt();
+
 	 // Run this CPU's idle environment when nothing else is runnable.	
         idle = &envs[cpunum()];
         if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
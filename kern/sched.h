@@ -6,7 +6,18 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_requeue(struct Env *e);
+void sched_guest_init(struct Env *e);
+void sched_guest_account(struct Env *e, uint64_t cycles);
+uint64_t sched_guest_slice(struct Env *e);
+void sched_guest_yield(struct Env *e);
+uint64_t sched_tsc_khz(void);
+
 #endif	// !JOS_KERN_SCHED_H
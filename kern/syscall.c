@@ -13,6 +13,13 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <vmm/ept.h>
+#include <vmm/vmtrace.h>
+#include <vmm/vmpager.h>
+#include <vmm/vmexits.h>
+#include <vmm/vmchan.h>
+#include <vmm/vmshm.h>
+#include <vmm/vmwss.h>
+#include <vmm/vmtext.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -87,7 +94,7 @@ sys_exofork(void)
     if (err < 0)
 	return err;
     else if (!err) {
-	env->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(env, ENV_NOT_RUNNABLE);
 	memcpy(&(env->env_tf), &(curenv->env_tf), sizeof(struct Trapframe));
 
 	// Parent is going to set child's status to RUNNING at some point of
@@ -125,7 +132,12 @@ sys_env_set_status(envid_t envid, int status)
     if (err < 0)
 	return err;
     else if (err == 0) {
-	env->env_status = status;
+	// An env that is running somewhere is already as runnable as it
+	// gets; it must not also go on a run queue.
+	if (status == ENV_RUNNABLE && (env->env_status == ENV_RUNNING ||
+				       env->env_status == ENV_DYING))
+	    return 0;
+	env_set_status(env, status);
 	return 0;
     }
     panic("sys_env_set_status not implemented");
@@ -330,6 +342,25 @@ sys_page_unmap(envid_t envid, void *va)
 	panic("sys_page_unmap not implemented");
 }
 
+// A send from curenv has just woken env, which was blocked receiving:
+// switch straight to it rather than leave it to wait for its turn.  This
+// is what makes a client-server round trip cheap: the server runs as soon
+// as the request is sent, and the client as soon as the reply is, the
+// rest of the sender's time slice going to the receiver.  The sender's
+// system call returns 0 when it next runs.
+//
+// Guests neither hand off nor are handed to; a guest's sends come from its
+// VM exit path, which must return to the guest.
+    static void
+ipc_handoff(struct Env *env)
+{
+        if (!curenv || curenv->env_type == ENV_TYPE_GUEST ||
+            env->env_type == ENV_TYPE_GUEST || env->env_status != ENV_RUNNABLE)
+                return;
+        curenv->env_tf.tf_regs.reg_rax = 0;
+        env_run(env);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -380,7 +411,11 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
                 return -E_BAD_ENV;
         }
 
-        if ((env->env_status != ENV_NOT_RUNNABLE) || (env->env_ipc_recving != 1))
+        // Guests receive asynchronously (see vmx_ipc_post()) and need not
+        // be blocked.
+        if (env->env_ipc_recving != 1 ||
+            (env->env_status != ENV_NOT_RUNNABLE &&
+             !(env->env_type == ENV_TYPE_GUEST && env->env_vmxinfo.ipc_mbox)))
             return -E_IPC_NOT_RECV;
 
         if ((uint64_t)srcva < UTOP){
@@ -422,12 +457,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
                 } 
 	}
 
-        env->env_ipc_recving = 0;
-        env->env_ipc_value = value;
-        env->env_ipc_from = curenv->env_id;
-        env->env_ipc_perm = 0;
-
-        if ((uint64_t)srcva < UTOP) {
+        // Map the page before claiming the receiver, so that a failure
+        // leaves it still receiving.  A guest's mailbox in particular must
+        // be completed once it has been claimed.
+        if ((uint64_t)srcva < UTOP && (uint64_t)env->env_ipc_dstva < UTOP) {
                 pte_t *pite;
                 struct Page *pp;
 
@@ -448,17 +481,24 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		  {
 		     if (ept_page_insert(env->env_pml4e, pp, env->env_ipc_dstva, perm) < 0)
                         return -E_NO_MEM;
-
-                   cprintf("\n\n\nCASE 2,%x",env->env_ipc_dstva);
                 }
                 else
                 if (page_insert(env->env_pml4e, pp, env->env_ipc_dstva, perm) < 0)
                         return -E_NO_MEM;
+        } else
+                perm = 0;
 
-           env->env_ipc_perm = perm;
-        }
+        env->env_ipc_recving = 0;
+        env->env_ipc_value = value;
+        env->env_ipc_from = curenv->env_id;
+        env->env_ipc_perm = perm;
 
-        env->env_status = ENV_RUNNABLE;
+        if (env->env_type == ENV_TYPE_GUEST && env->env_vmxinfo.ipc_mbox)
+                vmx_ipc_complete(env);
+        else {
+                env_set_status(env, ENV_RUNNABLE);
+                ipc_handoff(env);
+        }
         return 0;
     panic("sys_ipc_try_send not implemented");
 }
@@ -496,7 +536,7 @@ sys_ipc_recv(void *dstva)
         curenv->env_ipc_perm = 0;
         curenv->env_ipc_from = 0;
         curenv->env_ipc_recving = 1; //Receiver is ready to listen
-        curenv->env_status = ENV_NOT_RUNNABLE; //Block the execution of current env.
+        env_set_status(curenv, ENV_NOT_RUNNABLE); //Block the execution of current env.
 
         sched_yield(); //Give up the cpu. Don't return, instead env_run some other env.
 
@@ -505,6 +545,47 @@ sys_ipc_recv(void *dstva)
     return 0;
 }
 
+// Send to envid like sys_ipc_try_send(), then block receiving at dstva
+// like sys_ipc_recv(), in one system call.  Because the caller is already
+// receiving when the send hands the CPU to envid, envid's reply hands it
+// straight back.
+//
+// Does not return on success; the system call returns 0 once a value has
+// been received.
+// Return < 0 on error.  Errors are those of sys_ipc_try_send(), and
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if envid is the caller, whose own receive the send would
+//		otherwise claim.
+    static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+        int r;
+
+        if ((uint64_t)dstva > UTOP || PGOFF(dstva))
+                return -E_INVAL;
+        // envid 0 names the caller too (see envid2env()).
+        if (envid == 0 || envid == curenv->env_id)
+                return -E_INVAL;
+
+        curenv->env_ipc_dstva = dstva;
+        curenv->env_ipc_perm = 0;
+        curenv->env_ipc_from = 0;
+        curenv->env_ipc_recving = 1;
+        env_set_status(curenv, ENV_NOT_RUNNABLE);
+        if ((r = sys_ipc_try_send(envid, value, srcva, perm)) < 0) {
+                curenv->env_ipc_recving = 0;
+                env_set_status(curenv, ENV_RUNNING);
+                return r;
+        }
+
+        // envid is a guest, which cannot be handed the CPU.
+        curenv->env_tf.tf_regs.reg_rax = 0;
+        sched_yield();
+
+        panic("sys_ipc_call: sched_yield returned");
+}
+
 // Return the current time.
     static int
 sys_time_msec(void)
@@ -572,7 +653,7 @@ sys_ept_map(envid_t srcenvid, void *srcva,
       {
 	  return -E_BAD_ENV;
       }
-      else if(((uint64_t)guest_pa+PGSIZE)  > dstenv->env_vmxinfo.phys_sz)
+      else if(!guest_gpa_valid(&dstenv->env_vmxinfo, (uint64_t)guest_pa))
       {
          return -E_INVAL;    
       }
@@ -595,20 +676,281 @@ sys_ept_map(envid_t srcenvid, void *srcva,
 }
 
 
+// Create a guest env with gphysz bytes of guest physical memory that will
+// start executing at gRIP.  Guest memory is only backed by host pages as the
+// guest touches it, so gphysz may be far larger than the host's free memory.
+//
+// Returns envid of the new guest, or < 0 on error.  Errors are:
+//	-E_INVAL if gphysz is not page-aligned, is 1 MB or smaller, or is
+//		larger than GUEST_MEM_MAX.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
 static envid_t
 sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
     int r;
     struct Env *e;
 
+    if (gphysz % PGSIZE || gphysz <= EXTPHYSMEM || gphysz > GUEST_MEM_MAX)
+        return -E_INVAL;
+
     if ((r = env_guest_alloc(&e, curenv->env_id)) < 0)
         return r;
    
-    e->env_status = ENV_NOT_RUNNABLE;
+    env_set_status(e, ENV_NOT_RUNNABLE);
     e->env_vmxinfo.phys_sz = gphysz;
     e->env_tf.tf_rip = gRIP;
     return e->env_id;
 }
 
+// Replace the CPUID feature policy of guest envid and rebuild its CPUID
+// table.  Only allowed before the guest first runs, since a running guest
+// may already have acted on what CPUID told it.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not a guest or has already run.
+static int
+sys_env_set_cpuid_policy(envid_t envid, struct vmx_cpuid_policy *policy)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST || e->env_runs != 0)
+        return -E_INVAL;
+    user_mem_assert(curenv, policy, sizeof(*policy), PTE_U);
+
+    vmx_cpuid_init(e->env_vmxinfo.cpuid_table, policy);
+    return 0;
+}
+
+// Turn VM-exit tracing of guest envid on or off (VMTRACE_ON, VMTRACE_OFF),
+// or query whether it is on (VMTRACE_STATUS).  The caller must be the
+// guest's parent.
+//
+// Returns the previous state (0 or 1), or < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not a guest, or op is unknown.
+//	-E_NO_MEM if there's no memory for the guest's trace ring.
+static int
+sys_vmtrace_ctl(envid_t envid, int op) {
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    return vmtrace_ctl(e, op);
+}
+
+// Map the VM-exit trace ring of guest envid read-only into the current env
+// at va, which must be page-aligned.  The ring spans VMTRACE_RING_SIZE bytes.
+// The caller must be the guest's parent.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not a guest or was never traced, or va is not
+//		page-aligned or the ring would not fit below UTOP.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_vmtrace_map(envid_t envid, void *va) {
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    return vmtrace_map(curenv, e, va);
+}
+
+// Register the current env as the host pager and fetch its next request
+// into *req (see inc/vmpager.h).  Blocks if there is none.
+//
+// Returns 1 when *req was filled in, or 0 after blocking; the caller
+// should then ask again.  Errors are:
+//	-E_BAD_ENV if the caller is not the pager started at boot, or
+//		another env is already the pager.
+static int
+sys_vmpager_wait(struct vmpager_req *req) {
+    user_mem_assert(curenv, req, sizeof(*req), PTE_U | PTE_W);
+    return vmpager_wait(req);
+}
+
+// Choose up to n pages of guest memory to evict and store their guest
+// physical addresses in gpas.  Only the pager may call this.
+//
+// Returns the number of pages chosen, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the pager or guest is not a guest.
+//	-E_INVAL if n is negative.
+static int
+sys_vmpager_scan(envid_t guest, uint64_t *gpas, int n) {
+    if (n < 0)
+        return -E_INVAL;
+    user_mem_assert(curenv, gpas, n * sizeof(uint64_t), PTE_U | PTE_W);
+    return vmpager_scan(guest, gpas, n);
+}
+
+// Unmap the pages at gpas[0 .. n) from guest, mark each as held in swap
+// slot slots[i], and map them read-only at va, va + PGSIZE, ... in the
+// caller so they can be written out.  Only the pager may call this.
+//
+// Returns the number of pages evicted, which is less than n if one of them
+// could not be, or < 0 if none was.  Errors are:
+//	-E_BAD_ENV if the caller is not the pager or guest is not a guest.
+//	-E_INVAL if n is not in 1..VMPAGER_EVICT_MAX, gpas[0] is not a
+//		resident page of guest RAM above 1 MB, the page is shared, or
+//		va is not page-aligned or the n pages at va reach UTOP.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_vmpager_evict(envid_t guest, const uint64_t *gpas, const uint64_t *slots,
+        int n, void *va) {
+    if (n <= 0 || n > VMPAGER_EVICT_MAX)
+        return -E_INVAL;
+    user_mem_assert(curenv, gpas, n * sizeof(uint64_t), PTE_U);
+    user_mem_assert(curenv, slots, n * sizeof(uint64_t), PTE_U);
+    return vmpager_evict(guest, gpas, slots, n, va);
+}
+
+// Map the caller's page at va back into guest at the swapped-out gpa and
+// let the guest run again.  Only the pager may call this.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the pager or guest is not a guest.
+//	-E_INVAL if gpa is not swapped out or no page is mapped at va.
+//	-E_NO_MEM if there's no memory to allocate an EPT page.
+static int
+sys_vmpager_pagein(envid_t guest, uint64_t gpa, void *va) {
+    return vmpager_pagein(guest, gpa, va);
+}
+
+// Tell the kernel the page-in of gpa for guest failed.  If retry is set
+// the guest runs again and faults anew; otherwise it is destroyed.  Only
+// the pager may call this.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller is not the pager or guest is not a guest.
+//	-E_INVAL if guest is not waiting for gpa.
+static int
+sys_vmpager_fail(envid_t guest, uint64_t gpa, bool retry) {
+    return vmpager_fail(guest, gpa, retry);
+}
+
+// Set the scheduling weight of guest envid, and cap it at 'cap' percent
+// of one CPU (0 for no cap).  The default weight is
+// VMX_SCHED_WEIGHT_DEFAULT.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if envid is not a guest, weight is 0 or above
+//		VMX_SCHED_WEIGHT_MAX, or cap is above 100.
+static int
+sys_env_set_sched(envid_t envid, uint32_t weight, uint32_t cap)
+{
+    struct Env *e;
+    int r;
+
+    if ((r = envid2env(envid, &e, 1)) < 0)
+        return r;
+    if (e->env_type != ENV_TYPE_GUEST)
+        return -E_INVAL;
+    if (weight == 0 || weight > VMX_SCHED_WEIGHT_MAX || cap > 100)
+        return -E_INVAL;
+
+    e->env_vmxinfo.sched_weight = weight;
+    e->env_vmxinfo.sched_cap = cap;
+    return 0;
+}
+
+// Block until guest rings its I/O channel doorbell (see inc/vmchan.h),
+// or return at once if it has since the last call.  Only the guest's
+// parent may wait.
+//
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest.
+static int
+sys_vmchan_wait(envid_t guest) {
+    return vmchan_wait(guest);
+}
+
+// Map guest's I/O channel ring read/write at va.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, or va is not page-aligned or
+//		>= UTOP.
+//	-E_NO_ENT if the guest has not registered a ring yet.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_vmchan_attach(envid_t guest, void *va) {
+    return vmchan_attach(guest, va);
+}
+
+// Map the page of guest memory at gpa at va with perm (PTE_P | PTE_U,
+// optionally PTE_W), so a backend can do I/O on the guest's buffers.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, gpa is not page-aligned guest
+//		RAM, va is not page-aligned or >= UTOP, or perm is bad.
+//	-E_NO_ENT if the page is not resident.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_vmchan_map(envid_t guest, uint64_t gpa, void *va, int perm) {
+    return vmchan_map(guest, gpa, va, perm);
+}
+
+// Bind the inter-VM shared memory object named key, npages pages long,
+// to port of guest (see inc/vmx.h).  The first bind of a key creates the
+// object; it is freed when the last guest bound to it exits.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, port or npages is out of range,
+//		or key names an object of another size.
+//	-E_BUSY if the port is already bound.
+//	-E_NO_MEM if there's no memory or no free object or bind slot.
+static int
+sys_vmshm_bind(envid_t guest, uint32_t key, int npages, int port) {
+    return vmshm_bind(guest, key, npages, port);
+}
+
+// Store the working-set estimate of guest, as of the last sampling
+// interval, in *wss (see inc/vmx.h).  Any env may ask about any guest.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not a guest.
+//	-E_NOT_SUPP if the CPU has no EPT accessed bits to sample.
+static int
+sys_vmwss_get(envid_t guest, struct vmx_wss *wss) {
+    user_mem_assert(curenv, wss, sizeof(*wss), PTE_U | PTE_W);
+    return vmwss_get(guest, wss);
+}
+
+// Map the read-only kernel segment named key, whose npages pages the
+// caller has read in at va, at gpa in guest, sharing one copy of its pages
+// with every other guest that maps the same segment.  Writes by the guest
+// copy the page first.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if guest doesn't exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, npages is out of range, gpa is not
+//		page-aligned guest RAM, va is not page-aligned and mapped, or
+//		key names a segment with other contents.
+//	-E_NO_MEM if there's no memory or no free segment slot.
+static int
+sys_vmtext_map(envid_t guest, uint64_t key, uint64_t gpa, int npages,
+	       void *va) {
+    return vmtext_map(guest, key, gpa, npages, va);
+}
+
 
 // Dispatches to the correct kernel function, passing the arguments.
     int64_t
@@ -647,6 +989,8 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 	return sys_ipc_try_send(a1, a2, (void*)a3, a4);
    case SYS_ipc_recv:
 	return sys_ipc_recv((void*)a1);
+    case SYS_ipc_call:
+	return sys_ipc_call(a1, a2, (void*)a3, a4, (void*)a5);
     case SYS_env_set_trapframe:
 	return sys_env_set_trapframe(a1, (struct Trapframe*)a2);
     case SYS_time_msec:
@@ -655,6 +999,37 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 	    return sys_ept_map(a1, (void*) a2, a3, (void*) a4, a5);
     case SYS_env_mkguest:
             return sys_env_mkguest(a1, a2);
+    case SYS_env_set_cpuid_policy:
+            return sys_env_set_cpuid_policy(a1, (struct vmx_cpuid_policy*) a2);
+    case SYS_vmtrace_ctl:
+            return sys_vmtrace_ctl(a1, a2);
+    case SYS_vmtrace_map:
+            return sys_vmtrace_map(a1, (void*) a2);
+    case SYS_vmpager_wait:
+            return sys_vmpager_wait((struct vmpager_req*) a1);
+    case SYS_vmpager_scan:
+            return sys_vmpager_scan(a1, (uint64_t*) a2, a3);
+    case SYS_vmpager_evict:
+            return sys_vmpager_evict(a1, (const uint64_t*) a2,
+                    (const uint64_t*) a3, a4, (void*) a5);
+    case SYS_vmpager_pagein:
+            return sys_vmpager_pagein(a1, a2, (void*) a3);
+    case SYS_vmpager_fail:
+            return sys_vmpager_fail(a1, a2, a3);
+    case SYS_env_set_sched:
+            return sys_env_set_sched(a1, a2, a3);
+    case SYS_vmchan_wait:
+            return sys_vmchan_wait(a1);
+    case SYS_vmchan_attach:
+            return sys_vmchan_attach(a1, (void*) a2);
+    case SYS_vmchan_map:
+            return sys_vmchan_map(a1, a2, (void*) a3, a4);
+    case SYS_vmshm_bind:
+            return sys_vmshm_bind(a1, a2, a3, a4);
+    case SYS_vmwss_get:
+            return sys_vmwss_get(a1, (struct vmx_wss*) a2);
+    case SYS_vmtext_map:
+            return sys_vmtext_map(a1, a2, a3, a4, (void*) a5);
 
         default:
             return -E_NO_SYS;
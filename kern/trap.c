@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/reclaim.h>
 #include <inc/string.h>
 
 extern uintptr_t gdtdesc_64;
@@ -233,7 +234,9 @@ print_regs(struct PushRegs *regs)
 	cprintf("  rax  0x%08x\n", regs->reg_rax);
 }
 
-static void
+// Also entered from vmexit() with a guest's trapframe, for an external
+// interrupt that arrived while the guest was running.
+void
 trap_dispatch(struct Trapframe *tf)
 {
 	// Handle processor exceptions.
@@ -271,9 +274,13 @@ trap_dispatch(struct Trapframe *tf)
 	
 		// Add time tick increment to clock interrupts.
 		// Be careful! In multiprocessors, clock interrupts are
-		// triggered on every CPU. 								WHY HAS HE LEFT THIS CRYPTIC COMMENT? WHEN IT TRAPS WE ALREADY HAVE LOCK.
+		// triggered on every CPU; only the boot CPU's count.
 		// LAB 6: Your code here.
-		time_tick();
+		if (thiscpu == bootcpu)
+			time_tick();
+
+		// Chip away at address spaces waiting to be freed.
+		reclaim_work(RECLAIM_BATCH);
 		
 		sched_yield();
 		return;
@@ -285,6 +292,13 @@ trap_dispatch(struct Trapframe *tf)
 	// LAB 6: Your code here.
 
 
+	// Another CPU changed EPT entries and needed this one out of guest
+	// mode (see ept_invalidate()).  Leaving it was all there was to do.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KICK) {
+		lapic_eoi();
+		return;
+	}
+
 	// Handle keyboard and serial interrupts.
 	// LAB 7: Your code here.
 	if (tf->tf_trapno == T_IRQ1) {
@@ -320,6 +334,11 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Re-acquire the big kernel lock if we were halted in
+	// sched_yield()
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		lock_kernel();
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -330,7 +349,7 @@ trap(struct Trapframe *tf)
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
 		// LAB 4: Your code here.
-		//lock_kernel();
+		lock_kernel();
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
@@ -32,8 +32,8 @@ fsipc(unsigned type, void *dstva)
 	}
 	//cprintf("Before ipc_send");
 	
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			NULL, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -82,23 +82,144 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	}
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env', then
+// receive a value like ipc_recv(), in one system call.  The kernel hands
+// the CPU straight to 'to_env', and back when it replies, so a round trip
+// to a server does not wait on the scheduler.  Like ipc_send(), keeps
+// trying while 'to_env' is not receiving.
+// Returns the value received, or the error, as ipc_recv() does.
+    int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+         envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+        int r;
+
+        if (pg == NULL)
+                pg = (void *) UTOP;
+        if (rcv_pg == NULL)
+                rcv_pg = (void *) UTOP;
+
+        while ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) ==
+               -E_IPC_NOT_RECV)
+                sys_yield();
+        if (r < 0) {
+                if (from_env_store)
+                        *from_env_store = 0;
+                if (perm_store)
+                        *perm_store = 0;
+                return r;
+        }
+        if (from_env_store)
+                *from_env_store = thisenv->env_ipc_from;
+        if (perm_store)
+                *perm_store = thisenv->env_ipc_perm;
+        return thisenv->env_ipc_value;
+}
+
 #ifdef VMM_GUEST
 
-// Access to host IPC interface through VMCALL.
-// Should behave similarly to ipc_recv, except replacing the system call with a vmcall.
+// Host IPC.  Messages from host envs arrive asynchronously: a receive is
+// posted with VMX_VMCALL_IPCRECV and returns at once, and the host later
+// fills in host_mbox and sets its 'done' flag.  Until then the guest is
+// free to run other environments.
+static struct vmx_ipc_mailbox host_mbox;
+
+// Return the guest physical address backing va, which must be mapped.
+static uint64_t
+guest_pa(const void *va)
+{
+    return PTE_ADDR(vpt[VPN(va)]) + PGOFF(va);
+}
+
+// Post a receive for the next message from a host env, without waiting.
+// If 'pg' is nonnull, a page sent by the host will be mapped there.
+// Use ipc_host_recv_poll() or ipc_host_recv_wait() to collect the message.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BUSY if another receive is already outstanding in this guest.
+int
+ipc_host_recv_start(void *pg)
+{
+    uint64_t dst = ~0ULL;
+    int r;
+
+    if (pg != NULL) {
+        if (!((vpml4e[VPML4E(pg)] & PTE_P) && (vpde[VPDPE(pg)] & PTE_P) &&
+              (vpd[VPD(pg)] & PTE_P) && (vpt[VPN(pg)] & PTE_P)))
+            if ((r = sys_page_alloc(0, pg, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+                return r;
+        dst = guest_pa(pg);
+    }
+
+    // Writing the mailbox also makes sure its page is present.
+    host_mbox.done = 0;
+    asm volatile("vmcall"
+                 : "=a" (r)
+                 : "a" (VMX_VMCALL_IPCRECV), "d" (dst),
+                   "b" (guest_pa(&host_mbox))
+                 : "cc", "memory");
+    return r;
+}
+
+// Check whether the receive posted by ipc_host_recv_start() has completed.
+// Returns 1 and stores the message value in *value if it has, 0 if not.
+int
+ipc_host_recv_poll(int32_t *value)
+{
+    if (!host_mbox.done)
+        return 0;
+    if (value)
+        *value = host_mbox.value;
+    return 1;
+}
+
+// Wait for the receive posted by ipc_host_recv_start(), letting other
+// environments run meanwhile, and return the value sent.
 int32_t
-ipc_host_recv(void *pg) {
-    // LAB 8: Your code here.
-    panic("ipc_recv not implemented in VM guest");
+ipc_host_recv_wait(void)
+{
+    int32_t value;
+
+    while (!ipc_host_recv_poll(&value))
+        sys_yield();
+    return value;
 }
 
-// Access to host IPC interface through VMCALL.
-// Should behave similarly to ipc_send, except replacing the system call with a vmcall.
+// Receive a value from a host env and return it, like ipc_recv().
+// Callers expecting a reply to ipc_host_send() should rather post the
+// receive first, so the host env does not have to wait for it.
+int32_t
+ipc_host_recv(void *pg)
+{
+    int r;
+
+    while ((r = ipc_host_recv_start(pg)) == -E_BUSY)
+        sys_yield();
+    if (r < 0)
+        return r;
+    return ipc_host_recv_wait();
+}
+
+// Send a value (and optionally a page) to a host env through VMCALL, like
+// ipc_send().  VMX_HOST_FS_ENV names the host file server.
 void
 ipc_host_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
-    // LAB 8: Your code here.
-    panic("ipc_send not implemented in VM guest");
+    uint64_t src = pg ? guest_pa(pg) : ~0ULL;
+    int r;
+
+    while (1) {
+        asm volatile("vmcall"
+                     : "=a" (r)
+                     : "a" (VMX_VMCALL_IPCSEND), "d" (to_env), "c" (val),
+                       "b" (src), "D" (perm)
+                     : "cc", "memory");
+        if (r == 0)
+            break;
+        if (r != -E_IPC_NOT_RECV)
+            panic("ipc_host_send: %e", r);
+        sys_yield();
+    }
 }
 
 #endif
@@ -25,8 +25,8 @@ nsipc(unsigned type)
     if (debug)
         cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-    ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-    return ipc_recv(NULL, NULL, NULL);
+    return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U,
+                    NULL, NULL, NULL);
 }
 
     int
@@ -117,6 +117,13 @@ sys_ipc_recv(void *dstva)
     return syscall(SYS_ipc_recv, 1, (uint64_t)dstva, 0, 0, 0, 0);
 }
 
+    int
+sys_ipc_call(envid_t envid, uint64_t value, void *srcva, int perm, void *dstva)
+{
+    return syscall(SYS_ipc_call, 0, envid, value, (uint64_t) srcva, perm,
+                   (uint64_t) dstva);
+}
+
     unsigned int
 sys_time_msec(void)
 {
@@ -137,3 +144,101 @@ sys_env_mkguest(uint64_t gphysz, uint64_t gRIP) {
 	return (envid_t) syscall(SYS_env_mkguest, 0, gphysz, gRIP, 0, 0, 0);
 }
 
+
+int
+sys_env_set_cpuid_policy(envid_t guest, struct vmx_cpuid_policy *policy)
+{
+	return syscall(SYS_env_set_cpuid_policy, 0, guest, (uint64_t) policy, 0, 0, 0);
+}
+
+int
+sys_vmtrace_ctl(envid_t guest, int op)
+{
+	return syscall(SYS_vmtrace_ctl, 0, guest, op, 0, 0, 0);
+}
+
+int
+sys_vmtrace_map(envid_t guest, void *va)
+{
+	return syscall(SYS_vmtrace_map, 0, guest, (uint64_t) va, 0, 0, 0);
+}
+
+// Block until the kernel has a paging request; see inc/vmpager.h.
+int
+sys_vmpager_wait(struct vmpager_req *req)
+{
+	int r;
+
+	// The kernel returns 0 each time it wakes us; ask again.
+	while ((r = syscall(SYS_vmpager_wait, 0, (uint64_t) req, 0, 0, 0, 0)) == 0)
+		;
+	return r;
+}
+
+int
+sys_vmpager_scan(envid_t guest, uint64_t *gpas, int n)
+{
+	return syscall(SYS_vmpager_scan, 0, guest, (uint64_t) gpas, n, 0, 0);
+}
+
+int
+sys_vmpager_evict(envid_t guest, const uint64_t *gpas, const uint64_t *slots,
+		  int n, void *va)
+{
+	return syscall(SYS_vmpager_evict, 0, guest, (uint64_t) gpas,
+		       (uint64_t) slots, n, (uint64_t) va);
+}
+
+int
+sys_vmpager_pagein(envid_t guest, uint64_t gpa, void *va)
+{
+	return syscall(SYS_vmpager_pagein, 0, guest, gpa, (uint64_t) va, 0, 0);
+}
+
+int
+sys_vmpager_fail(envid_t guest, uint64_t gpa, bool retry)
+{
+	return syscall(SYS_vmpager_fail, 0, guest, gpa, retry, 0, 0);
+}
+
+int
+sys_env_set_sched(envid_t guest, uint32_t weight, uint32_t cap)
+{
+	return syscall(SYS_env_set_sched, 0, guest, weight, cap, 0, 0);
+}
+
+int
+sys_vmchan_wait(envid_t guest)
+{
+	return syscall(SYS_vmchan_wait, 0, guest, 0, 0, 0, 0);
+}
+
+int
+sys_vmchan_attach(envid_t guest, void *va)
+{
+	return syscall(SYS_vmchan_attach, 0, guest, (uint64_t) va, 0, 0, 0);
+}
+
+int
+sys_vmchan_map(envid_t guest, uint64_t gpa, void *va, int perm)
+{
+	return syscall(SYS_vmchan_map, 0, guest, gpa, (uint64_t) va, perm, 0);
+}
+
+int
+sys_vmshm_bind(envid_t guest, uint32_t key, int npages, int port)
+{
+	return syscall(SYS_vmshm_bind, 0, guest, key, npages, port, 0);
+}
+
+int
+sys_vmwss_get(envid_t guest, struct vmx_wss *wss)
+{
+	return syscall(SYS_vmwss_get, 0, guest, (uint64_t) wss, 0, 0, 0);
+}
+
+int
+sys_vmtext_map(envid_t guest, uint64_t key, uint64_t gpa, int npages, void *va)
+{
+	return syscall(SYS_vmtext_map, 0, guest, key, gpa, npages, (uint64_t) va);
+}
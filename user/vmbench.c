@@ -0,0 +1,79 @@
+// Host side of the VMX microbenchmarks.
+//
+// usage: vmbench [iterations]
+//
+// Times a host system call and a host IPC round trip to the file server,
+// as native baselines for the guest numbers, then boots a guest with
+// /bin/vmm and waits for it.  The guest runs vmm/guest/user/vmbench when
+// its kernel is built with "make prep-vmbench" (or when vmbench is typed
+// at the guest shell).  Results are "vmbench:" lines as described in
+// inc/vmbench.h.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+#include <inc/vmbench.h>
+
+#define DEFAULT_ITERS	10000
+
+static union Fsipc ipcbuf __attribute__((aligned(PGSIZE)));
+
+static void
+report(const char *name, struct vmbench_result *r)
+{
+	cprintf("vmbench: host.%s iters=%ld min=%ld avg=%ld max=%ld\n",
+		name, r->iters, r->min, r->total / r->iters, r->max);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct vmbench_result r;
+	int iters = DEFAULT_ITERS;
+	uint64_t t0, t1;
+	envid_t fsenv, guest;
+	int i;
+
+	binaryname = "vmbench";
+
+	if (argc > 1 && (iters = strtol(argv[1], NULL, 0)) <= 0) {
+		cprintf("usage: vmbench [iterations]\n");
+		exit();
+	}
+
+	cprintf("vmbench: start\n");
+
+	vmbench_init(&r);
+	for (i = 0; i < iters; i++) {
+		t0 = read_tsc();
+		t1 = read_tsc();
+		vmbench_sample(&r, t1 - t0);
+	}
+	report("null", &r);
+
+	vmbench_init(&r);
+	for (i = 0; i < iters; i++) {
+		t0 = read_tsc();
+		sys_getenvid();
+		t1 = read_tsc();
+		vmbench_sample(&r, t1 - t0);
+	}
+	report("syscall", &r);
+
+	// Same request the guest sends: rejected at once by the server.
+	fsenv = ipc_find_env(ENV_TYPE_FS);
+	vmbench_init(&r);
+	for (i = 0; i < iters; i++) {
+		ipcbuf.flush.req_fileid = ~0U;
+		t0 = read_tsc();
+		ipc_send(fsenv, FSREQ_FLUSH, &ipcbuf, PTE_P | PTE_W | PTE_U);
+		ipc_recv(NULL, NULL, NULL);
+		t1 = read_tsc();
+		vmbench_sample(&r, t1 - t0);
+	}
+	report("ipc", &r);
+
+	if ((guest = spawnl("/bin/vmm", "vmm", (char *) 0)) < 0)
+		panic("spawn vmm: %e", guest);
+	wait(guest);
+	cprintf("vmbench: done\n");
+}
@@ -2,9 +2,31 @@
 #include <inc/vmx.h>
 #include <inc/elf.h>
 #include <inc/ept.h>
+#include <inc/vmchan.h>
+#include <inc/vmtrace.h>
 
 #define GUEST_KERN "/vmm/kernel"
 #define GUEST_BOOT "/vmm/boot"
+// The guest's disk and the directory it may share, served over the I/O
+// channel.
+#define GUEST_DISK "/vmm/fs.img"
+#define GUEST_SHARE "/vmm/share"
+
+// Where the channel ring and the guest buffer being served are mapped.
+#define CHAN_RING ((struct vmchan_ring *) 0xD0000000)
+#define CHAN_BUF ((void *) 0xD0001000)
+// Bounds on how many empty polls the backend makes before it sleeps.
+#define CHAN_IDLE_MIN 16
+#define CHAN_IDLE_MAX 4096
+
+// Default size of a shared memory object given without one.
+#define SHM_DEFAULT_PAGES 16
+
+// Where a read-only kernel segment is read in before it is shared.
+#define TEXT_STAGE ((char *) 0xD0100000)
+
+// Where the guest's exit trace ring is mapped, shared with /bin/vmtrace.
+#define TRACEVA ((char *) 0xD8000000)
 
 #define JOS_ENTRY 0x7000
 
@@ -51,14 +73,60 @@ map_in_guest( envid_t guest, uintptr_t gpa, size_t memsz,
 
 } 
 
+// 64-bit FNV-1a hash of len bytes at buf, continuing from h.
+static uint64_t
+fnv1a(uint64_t h, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    while (len-- > 0)
+        h = (h ^ *p++) * 0x100000001B3ULL;
+    return h;
+}
+
+// Like map_in_guest, for a read-only segment starting on a page boundary:
+// map it from the kernel's cache of shared segments, so that guests
+// running the same kernel share one copy of it.  The cache is keyed by a
+// hash of the contents.
+//
+// Return 0 on success, <0 on failure.
+static int
+share_in_guest( envid_t guest, uintptr_t gpa, size_t memsz,
+        int fd, size_t filesz, off_t fileoffset ) {
+    int npages = ROUNDUP(memsz, PGSIZE) / PGSIZE;
+    uint64_t key = 0xCBF29CE484222325ULL;
+    char *va;
+    int i, r = 0;
+
+    if (npages > VMX_TEXT_MAX_PAGES)
+        return -E_INVAL;
+    for (i = 0; i < npages && r >= 0; i++) {
+        va = TEXT_STAGE + i * PGSIZE;
+        if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+            break;
+        if (i * PGSIZE < filesz &&
+            ((r = seek(fd, fileoffset + i * PGSIZE)) < 0 ||
+             (r = readn(fd, va, MIN(PGSIZE, filesz - i * PGSIZE))) < 0))
+            break;
+        key = fnv1a(key, va, PGSIZE);
+    }
+    if (r >= 0)
+        r = sys_vmtext_map(guest, key, gpa, npages, TEXT_STAGE);
+    for (i = 0; i < npages; i++)
+        sys_page_unmap(0, TEXT_STAGE + i * PGSIZE);
+    return r;
+}
+
 // Read the ELF headers of kernel file specified by fname,
 // mapping all valid segments into guest physical memory as appropriate.
 //
 // Return 0 on success, <0 on error
 //
 // Hint: compare with ELF parsing in env.c, and use map_in_guest for each segment.
+//
+// If share is set, read-only segments are shared with other guests (see
+// share_in_guest), falling back to a private copy if that fails.
 static int
-copy_guest_kern_gpa( envid_t guest, char* fname ) {
+copy_guest_kern_gpa( envid_t guest, char* fname, bool share ) {
 
 	int fd;
     	if ((fd = open( GUEST_KERN, O_RDONLY)) < 0 ) {
@@ -97,7 +165,13 @@ copy_guest_kern_gpa( envid_t guest, char* fname ) {
 		}
   		cprintf("%x\n\n",ph->p_pa+ph->p_offset);
 
-          int ret = map_in_guest(guest, ph->p_pa , ph->p_memsz, fd, ph->p_filesz, ph->p_offset);
+          int ret = -1;
+          if (share && !(ph->p_flags & ELF_PROG_FLAG_WRITE) &&
+              PGOFF(ph->p_pa) == 0)
+              ret = share_in_guest(guest, ph->p_pa, ph->p_memsz, fd,
+                                   ph->p_filesz, ph->p_offset);
+          if (ret < 0)
+              ret = map_in_guest(guest, ph->p_pa , ph->p_memsz, fd, ph->p_filesz, ph->p_offset);
 
              if(ret < 0)
 			return ret;
@@ -107,21 +181,359 @@ copy_guest_kern_gpa( envid_t guest, char* fname ) {
   return 0;
 }
 
+static bool
+guest_alive(envid_t guest) {
+    const volatile struct Env *e = &envs[ENVX(guest)];
+
+    return e->env_id == guest && e->env_status != ENV_FREE;
+}
+
+// Host fd + 1 of each of the guest's open shared files, or 0.
+static int chan_files[VMCHAN_MAXFILES];
+
+// Move len bytes between buf and offset off of fd.
+static int64_t
+chan_rw(int fd, bool is_read, uint64_t off, char *buf, size_t len) {
+    size_t done;
+    int r;
+
+    if ((r = seek(fd, off)) < 0)
+        return r;
+    if (is_read)
+        return readn(fd, buf, len);
+    for (done = 0; done < len; done += r)
+        if ((r = write(fd, buf + done, len - done)) <= 0)
+            return done ? done : r;
+    return done;
+}
+
+// Turn the len-byte guest path at buf into a host path under GUEST_SHARE.
+// The path may not climb out of the shared directory.
+static int
+chan_path(const char *buf, size_t len, char *path) {
+    char name[MAXPATHLEN];
+    const char *p;
+
+    if (len == 0 || len > MAXPATHLEN || buf[len - 1] != '\0')
+        return -E_BAD_PATH;
+    strcpy(name, buf);
+    for (p = name; *p; p++)
+        if (p[0] == '.' && p[1] == '.' && (p == name || p[-1] == '/') &&
+            (p[2] == '/' || p[2] == '\0'))
+            return -E_BAD_PATH;
+    if (strlen(GUEST_SHARE) + 1 + strlen(name) >= MAXPATHLEN)
+        return -E_BAD_PATH;
+    strcpy(path, GUEST_SHARE);
+    if (name[0] != '/')
+        strcat(path, "/");
+    strcat(path, name);
+    return 0;
+}
+
+static int64_t
+chan_open(struct vmchan_req *req, const char *buf) {
+    char path[MAXPATHLEN];
+    int fid, fd, r;
+
+    for (fid = 0; fid < VMCHAN_MAXFILES; fid++)
+        if (!chan_files[fid])
+            break;
+    if (fid == VMCHAN_MAXFILES)
+        return -E_MAX_OPEN;
+    if ((r = chan_path(buf, req->len, path)) < 0)
+        return r;
+    if ((fd = open(path, req->off)) < 0)
+        return fd;
+    chan_files[fid] = fd + 1;
+    return fid;
+}
+
+static int64_t
+chan_stat(int fd, struct vmchan_stat *vst) {
+    struct Stat st;
+    int r;
+
+    if ((r = fstat(fd, &st)) < 0)
+        return r;
+    strncpy(vst->name, st.st_name, VMCHAN_NAMELEN);
+    vst->name[VMCHAN_NAMELEN - 1] = '\0';
+    vst->size = st.st_size;
+    vst->isdir = st.st_isdir;
+    return 0;
+}
+
+// Carry out one channel request, against the disk image disk or the
+// guest's shared files.  Requests that carry data name a guest page the
+// guest grants for the request; it is mapped at CHAN_BUF and the host file
+// system reads or writes it in place.
+// Returns the request's result: bytes transferred, a fid, 0, or < 0.
+static int64_t
+chan_do(envid_t guest, int disk, struct vmchan_req *req) {
+    size_t pgoff = PGOFF(req->gpa);
+    int perm = PTE_P | PTE_U, fd = disk;
+    char *buf = (char *) CHAN_BUF + pgoff;
+    int64_t r;
+
+    switch (req->op) {
+    case VMCHAN_OP_READ:
+    case VMCHAN_OP_WRITE:
+    case VMCHAN_OP_OPEN:
+    case VMCHAN_OP_REMOVE:
+        break;
+    case VMCHAN_OP_CLOSE:
+    case VMCHAN_OP_PREAD:
+    case VMCHAN_OP_PWRITE:
+    case VMCHAN_OP_STAT:
+    case VMCHAN_OP_SETSIZE:
+        if (req->fid >= VMCHAN_MAXFILES || !chan_files[req->fid])
+            return -E_INVAL;
+        fd = chan_files[req->fid] - 1;
+        break;
+    default:
+        return -E_INVAL;
+    }
+
+    if (req->op == VMCHAN_OP_CLOSE) {
+        chan_files[req->fid] = 0;
+        return close(fd);
+    }
+    if (req->op == VMCHAN_OP_SETSIZE)
+        return ftruncate(fd, req->off);
+
+    if (req->op == VMCHAN_OP_STAT && req->len < sizeof(struct vmchan_stat))
+        return -E_INVAL;
+    if (req->len == 0 || pgoff + req->len > PGSIZE)
+        return -E_INVAL;
+    if (req->op == VMCHAN_OP_READ || req->op == VMCHAN_OP_PREAD ||
+        req->op == VMCHAN_OP_STAT)
+        perm |= PTE_W;
+    if ((r = sys_vmchan_map(guest, ROUNDDOWN(req->gpa, PGSIZE),
+                            CHAN_BUF, perm)) < 0)
+        return r;
+
+    switch (req->op) {
+    case VMCHAN_OP_READ:
+    case VMCHAN_OP_PREAD:
+        r = chan_rw(fd, true, req->off, buf, req->len);
+        break;
+    case VMCHAN_OP_WRITE:
+    case VMCHAN_OP_PWRITE:
+        r = chan_rw(fd, false, req->off, buf, req->len);
+        break;
+    case VMCHAN_OP_OPEN:
+        r = chan_open(req, buf);
+        break;
+    case VMCHAN_OP_REMOVE: {
+        char path[MAXPATHLEN];
+
+        if ((r = chan_path(buf, req->len, path)) == 0)
+            r = remove(path);
+        break;
+    }
+    case VMCHAN_OP_STAT:
+        r = chan_stat(fd, (struct vmchan_stat *) buf);
+        break;
+    }
+    sys_page_unmap(0, CHAN_BUF);
+    return r;
+}
+
+// Serve guest's I/O channel (see inc/vmchan.h) until the guest exits.
+//
+// While requests keep coming the backend polls the ring, yielding the CPU
+// between polls, so the guest never has to exit to notify it.  After
+// idle_limit empty polls in a row it sleeps until the doorbell rings.
+// idle_limit adapts: it doubles when a request shows up late in an idle
+// stretch, since sleeping then would have cost an exit, and halves each
+// time the backend does fall asleep.
+static void
+chan_serve(envid_t guest) {
+    struct vmchan_ring *ring = CHAN_RING;
+    int idle = 0, idle_limit = CHAN_IDLE_MIN;
+    struct vmchan_req req;
+    struct vmchan_cpl *cpl;
+    int fd, r, i;
+
+    // The guest registers its ring once it has booted, if at all.
+    while ((r = sys_vmchan_attach(guest, ring)) == -E_NO_ENT)
+        if (sys_vmchan_wait(guest) < 0)
+            return;
+    if (r < 0)
+        return;
+    if ((fd = open(GUEST_DISK, O_RDWR)) < 0) {
+        cprintf("vmm: open %s: %e\n", GUEST_DISK, fd);
+        return;
+    }
+
+    while (guest_alive(guest)) {
+        if (ring->sq_head != ring->sq_tail &&
+            ring->cq_tail - ring->cq_head < VMCHAN_NSLOTS) {
+            req = ring->sq[ring->sq_head & (VMCHAN_NSLOTS - 1)];
+            ring->sq_head++;
+            cpl = &ring->cq[ring->cq_tail & (VMCHAN_NSLOTS - 1)];
+            cpl->id = req.id;
+            cpl->result = chan_do(guest, fd, &req);
+            vmchan_mb();
+            ring->cq_tail++;
+
+            if (idle > idle_limit / 2)
+                idle_limit = MIN(idle_limit * 2, CHAN_IDLE_MAX);
+            idle = 0;
+            continue;
+        }
+        if (++idle < idle_limit) {
+            sys_yield();
+            continue;
+        }
+
+        // Announce that we are going to sleep, then look once more: the
+        // guest may have queued a request before it saw the announcement.
+        ring->state = VMCHAN_SLEEPING;
+        vmchan_mb();
+        if (ring->sq_head == ring->sq_tail) {
+            ring->sleeps++;
+            idle_limit = MAX(idle_limit / 2, CHAN_IDLE_MIN);
+            if (sys_vmchan_wait(guest) < 0)
+                break;
+        }
+        ring->state = VMCHAN_POLLING;
+        idle = 0;
+    }
+
+    cprintf("vmchan: %lld requests, %lld doorbells, %lld exits avoided, "
+            "%lld backend sleeps\n",
+            (long long) ring->submitted, (long long) ring->doorbells,
+            (long long) (ring->submitted - ring->doorbells),
+            (long long) ring->sleeps);
+    close(fd);
+    for (i = 0; i < VMCHAN_MAXFILES; i++)
+        if (chan_files[i]) {
+            close(chan_files[i] - 1);
+            chan_files[i] = 0;
+        }
+    sys_page_unmap(0, ring);
+}
+
+// Turn on exit tracing of the guest and map its trace ring at TRACEVA,
+// shared so that /bin/vmtrace inherits it.
+static int
+trace_guest(envid_t guest) {
+    int i, r;
+
+    if ((r = sys_vmtrace_ctl(guest, VMTRACE_ON)) < 0
+        || (r = sys_vmtrace_map(guest, TRACEVA)) < 0)
+        return r;
+    for (i = 0; i < VMTRACE_NPAGES; i++)
+        if ((r = sys_page_map(0, TRACEVA + i * PGSIZE, 0, TRACEVA + i * PGSIZE,
+                              PTE_P|PTE_U|PTE_SHARE)) < 0)
+            return r;
+    return 0;
+}
+
+// Summarize the guest's exits from the ring at TRACEVA.
+static void
+trace_summary(void) {
+    int r;
+
+    if ((r = spawnl("/bin/vmtrace", "vmtrace", "summary", NULL)) < 0) {
+        cprintf("spawn vmtrace: %e\n", r);
+        return;
+    }
+    wait(r);
+}
+
+static void
+usage(void) {
+    cprintf("usage: vmm [-t] [-x] [-s key[:pages]]... "
+            "[memory size in MB, at most %d [weight [cap]]]\n",
+            (int) (GUEST_MEM_MAX / (1024 * 1024)));
+    exit();
+}
+
+// Usage: vmm [-t] [-x] [-s key[:pages]]... [guest memory size in MB [weight [cap]]]
+//
+// The guest's memory is populated lazily by the kernel, so large sizes only
+// cost what the guest actually touches.  'weight' sets the guest's CPU share
+// relative to other guests (default VMX_SCHED_WEIGHT_DEFAULT), and 'cap'
+// limits it to that percentage of one CPU.
+//
+// Each -s binds the shared memory object named 'key' (SHM_DEFAULT_PAGES
+// pages unless given) to the guest's next port, starting at 0.  Guests
+// started with the same key share the object (see inc/vmx.h).
+//
+// With -t, the read-only segments of the guest kernel (its text and
+// read-only data) are shared with the other guests started with -t that
+// run the same kernel, rather than copied for each.
+//
+// With -x, the guest's VM exits are traced, and a summary of them is
+// printed by /bin/vmtrace once the guest has exited.
 void
 umain(int argc, char **argv) {
-    int ret;
+    int ret, i, nshm = 0;
+    bool share_text = false, trace = false;
     envid_t guest;
+    uint64_t memsz = GUEST_MEM_SZ;
+    uint32_t weight = VMX_SCHED_WEIGHT_DEFAULT, cap = 0;
+    uint32_t shm_key[VMX_SHM_PORTS];
+    int shm_pages[VMX_SHM_PORTS];
+    struct Argstate args;
+    char *end;
+
+    argstart(&argc, argv, &args);
+    while ((ret = argnext(&args)) >= 0) {
+        if (ret == 't') {
+            share_text = true;
+            continue;
+        }
+        if (ret == 'x') {
+            trace = true;
+            continue;
+        }
+        if (ret != 's' || nshm == VMX_SHM_PORTS || !argvalue(&args))
+            usage();
+        shm_key[nshm] = strtol(args.argvalue, &end, 0);
+        shm_pages[nshm] = *end == ':' ? strtol(end + 1, NULL, 0)
+                                      : SHM_DEFAULT_PAGES;
+        nshm++;
+    }
 
+    if (argc > 1) {
+        memsz = (uint64_t) strtol(argv[1], NULL, 0) * 1024 * 1024;
+        if (memsz == 0 || memsz > GUEST_MEM_MAX)
+            usage();
+    }
+    if (argc > 2)
+        weight = strtol(argv[2], NULL, 0);
+    if (argc > 3)
+        cap = strtol(argv[3], NULL, 0);
 
-    if ((ret = sys_env_mkguest( GUEST_MEM_SZ, JOS_ENTRY )) < 0) {
+    if ((ret = sys_env_mkguest( memsz, JOS_ENTRY )) < 0) {
         cprintf("Error creating a guest OS env: %e\n", ret );
         exit();
     }
     guest = ret;
 
+    if ((ret = sys_env_set_sched( guest, weight, cap )) < 0) {
+        cprintf("Error setting guest weight %d cap %d: %e\n",
+                weight, cap, ret );
+        exit();
+    }
+
+    for (i = 0; i < nshm; i++)
+        if ((ret = sys_vmshm_bind(guest, shm_key[i], shm_pages[i], i)) < 0) {
+            cprintf("Error binding shared memory %d (%d pages): %e\n",
+                    shm_key[i], shm_pages[i], ret);
+            exit();
+        }
+
+
+    if (trace && (ret = trace_guest(guest)) < 0) {
+        cprintf("Error tracing the guest: %e\n", ret);
+        exit();
+    }
 
     // Copy the guest kernel code into guest phys mem.
-    if((ret = copy_guest_kern_gpa(guest, GUEST_KERN)) < 0) {
+    if((ret = copy_guest_kern_gpa(guest, GUEST_KERN, share_text)) < 0) {
 	cprintf("Error copying page into the guest - %d.\n", ret);
         exit();
     }
@@ -141,9 +553,12 @@ umain(int argc, char **argv) {
     }
 
 
-    // Mark the guest as runnable.
+    // Mark the guest as runnable, and serve its I/O channel until it exits.
     sys_env_set_status(guest, ENV_RUNNABLE);
+    chan_serve(guest);
     wait(guest);
+    if (trace)
+        trace_summary();
 
 }
 
@@ -0,0 +1,254 @@
+// Host pager: lets guests use more memory than the host has by keeping
+// cold guest pages in swap files on the host file system.
+//
+// The kernel starts it at boot as the one ENV_TYPE_PAGER env; no other env
+// may page guest memory.  It must stay running while any guest has pages
+// in swap.  A file cannot grow past MAXFILESIZE (about 4 MB), so swap is
+// spread over NSWAPFILES files, /vmm/swap0 and up, shared by all guests.
+// Free space on the disk may run out before they are full.  Once swap is
+// full, a reclaim evicts nothing, and the kernel fails the guests that are
+// waiting for memory rather than let them fault forever.  The kernel picks
+// the victims, using EPT accessed bits where the CPU has them, and asks us
+// to read pages back when a guest touches them (see inc/vmpager.h).
+
+#include <inc/lib.h>
+
+#define SWAPFILE	"/vmm/swap%d"
+#define NSWAPFILES	16
+// One page per slot; a file cannot grow past MAXFILESIZE.
+#define FILESLOTS	(MAXFILESIZE / PGSIZE)
+#define NSLOTS		(NSWAPFILES * FILESLOTS)
+// Most pages evicted per reclaim request, all in one sys_vmpager_evict().
+#define BATCH		VMPAGER_EVICT_MAX
+// Where the pages being moved are mapped in our address space.
+#define BUFVA		((void *) 0xD0000000)
+
+static int swapfd[NSWAPFILES];
+static bool swap_full;			// The last reclaim ran out of swap
+static envid_t slot_owner[NSLOTS];	// Guest using each slot, or 0
+static int slot_hint;			// Where to look for a free slot
+static int next_guest;			// Where the next reclaim starts
+static uint64_t victims[BATCH];
+static uint64_t slots[BATCH];
+
+static bool
+guest_alive(envid_t guest)
+{
+	const volatile struct Env *e = &envs[ENVX(guest)];
+
+	return e->env_id == guest && e->env_status != ENV_FREE;
+}
+
+// Free the slots of guests that have exited.  The kernel drops a dead
+// guest's swap markers without telling us.
+static void
+slot_collect(void)
+{
+	int i;
+
+	for (i = 0; i < NSLOTS; i++)
+		if (slot_owner[i] && !guest_alive(slot_owner[i]))
+			slot_owner[i] = 0;
+}
+
+static int
+slot_alloc(envid_t guest)
+{
+	int i, s, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < NSLOTS; i++) {
+			s = (slot_hint + i) % NSLOTS;
+			if (slot_owner[s] == 0) {
+				slot_owner[s] = guest;
+				slot_hint = s + 1;
+				return s;
+			}
+		}
+		slot_collect();
+	}
+	return -E_NO_DISK;
+}
+
+static int
+swap_write(int slot, const void *buf)
+{
+	size_t done;
+	int r;
+
+	if ((r = seek(swapfd[slot / FILESLOTS],
+		      (slot % FILESLOTS) * PGSIZE)) < 0)
+		return r;
+	for (done = 0; done < PGSIZE; done += r)
+		if ((r = write(swapfd[slot / FILESLOTS],
+			       (const char *) buf + done,
+			       PGSIZE - done)) <= 0)
+			return r < 0 ? r : -E_NO_DISK;
+	return 0;
+}
+
+static int
+swap_read(int slot, void *buf)
+{
+	int r;
+
+	if ((r = seek(swapfd[slot / FILESLOTS],
+		      (slot % FILESLOTS) * PGSIZE)) < 0)
+		return r;
+	if ((r = readn(swapfd[slot / FILESLOTS], buf, PGSIZE)) < 0)
+		return r;
+	return r == PGSIZE ? 0 : -E_EOF;
+}
+
+// Write the first n pages in victims[] of guest to free slots, taking them
+// from the guest in one call.  Returns the number of pages written out, or
+// < 0 if none could be.
+static int
+evict(envid_t guest, int n)
+{
+	char *va;
+	int i, m, r, done;
+
+	for (m = 0; m < n; m++) {
+		if ((r = slot_alloc(guest)) < 0)
+			break;
+		slots[m] = r;
+	}
+	if (m == 0)
+		return r;
+	r = sys_vmpager_evict(guest, victims, slots, m, BUFVA);
+	// Slots of pages the kernel did not take are free again.
+	for (i = r < 0 ? 0 : r; i < m; i++)
+		slot_owner[slots[i]] = 0;
+	if (r < 0)
+		return r;
+
+	for (done = 0, i = 0; i < r; i++) {
+		va = (char *) BUFVA + i * PGSIZE;
+		if (swap_write(slots[i], va) < 0) {
+			// Hand the page straight back rather than lose it.
+			sys_vmpager_pagein(guest, victims[i], va);
+			slot_owner[slots[i]] = 0;
+		} else
+			done++;
+		sys_page_unmap(0, va);
+	}
+	return done > 0 ? done : -E_NO_DISK;
+}
+
+// Does guest hold more memory than its working-set estimate suggests it
+// needs?  Without an estimate every guest counts as over.
+static bool
+over_target(envid_t guest)
+{
+	struct vmx_wss wss;
+
+	if (sys_vmwss_get(guest, &wss) < 0 || wss.samples == 0)
+		return true;
+	return wss.resident > wss.target;
+}
+
+// Evict up to BATCH cold pages, starting with the guest after the one
+// the previous reclaim ended on so that no guest takes all the pressure.
+// Guests resident beyond their working-set target are taken from first;
+// the others only if that does not fill the batch.
+// Returns the number of pages evicted.
+static int
+reclaim(void)
+{
+	int i, n, pass, done = 0;
+	envid_t guest;
+
+	for (pass = 0; pass < 2 && done < BATCH; pass++) {
+		for (i = 0; i < NENV && done < BATCH; i++) {
+			const volatile struct Env *e =
+				&envs[(next_guest + i) % NENV];
+
+			if (e->env_type != ENV_TYPE_GUEST ||
+			    e->env_status == ENV_FREE)
+				continue;
+			guest = e->env_id;
+			if (pass == 0 && !over_target(guest))
+				continue;
+			if ((n = sys_vmpager_scan(guest, victims,
+						  BATCH - done)) <= 0)
+				continue;
+			if ((n = evict(guest, n)) > 0)
+				done += n;
+		}
+	}
+	next_guest = (next_guest + i) % NENV;
+	return done;
+}
+
+static void
+page_in(struct vmpager_req *req)
+{
+	int r;
+
+	if (!guest_alive(req->guest))
+		return;
+	if (req->slot >= NSLOTS || slot_owner[req->slot] != req->guest) {
+		cprintf("vmpager: bad slot %ld for guest %08x\n",
+			req->slot, req->guest);
+		sys_vmpager_fail(req->guest, req->gpa, false);
+		return;
+	}
+	if ((r = sys_page_alloc(0, BUFVA, PTE_P | PTE_U | PTE_W)) < 0) {
+		// Out of host memory ourselves: make some room first.
+		reclaim();
+		if ((r = sys_page_alloc(0, BUFVA, PTE_P | PTE_U | PTE_W)) < 0) {
+			cprintf("vmpager: no memory to page in: %e\n", r);
+			// The guest faults again and asks anew.
+			sys_vmpager_fail(req->guest, req->gpa, true);
+			return;
+		}
+	}
+	if ((r = swap_read(req->slot, BUFVA)) < 0) {
+		cprintf("vmpager: reading slot %ld: %e\n", req->slot, r);
+		sys_vmpager_fail(req->guest, req->gpa, false);
+	} else if ((r = sys_vmpager_pagein(req->guest, req->gpa, BUFVA)) < 0) {
+		cprintf("vmpager: page in %lx: %e\n", req->gpa, r);
+		sys_vmpager_fail(req->guest, req->gpa, r == -E_NO_MEM);
+	} else {
+		slot_owner[req->slot] = 0;
+	}
+	sys_page_unmap(0, BUFVA);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct vmpager_req req;
+	char path[MAXNAMELEN];
+	int i, r;
+
+	binaryname = "vmpager";
+	for (i = 0; i < NSWAPFILES; i++) {
+		snprintf(path, sizeof(path), SWAPFILE, i);
+		if ((swapfd[i] = open(path, O_RDWR | O_CREAT)) < 0)
+			panic("open %s: %e", path, swapfd[i]);
+	}
+
+	for (;;) {
+		if ((r = sys_vmpager_wait(&req)) < 0)
+			panic("sys_vmpager_wait: %e", r);
+		switch (req.type) {
+		case VMPAGER_REQ_PAGEIN:
+			page_in(&req);
+			break;
+		case VMPAGER_REQ_RECLAIM:
+			// Say so once when swap fills up; the kernel then
+			// fails guests that are out of memory.
+			if (reclaim() > 0)
+				swap_full = false;
+			else if (!swap_full) {
+				cprintf("vmpager: cannot evict; swap or disk is full\n");
+				swap_full = true;
+			}
+			break;
+		default:
+			cprintf("vmpager: unknown request %d\n", req.type);
+		}
+	}
+}
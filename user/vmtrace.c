@@ -0,0 +1,165 @@
+// Dump or summarize a guest's VM-exit trace ring.
+//
+// usage: vmtrace [dump [n] | summary]
+//
+// Only a guest's parent may map its ring, so vmtrace reads the ring that
+// vmm -x shares with it at TRACEVA rather than mapping one itself.
+//
+// 'dump' prints the last n records (all of them by default), one per line.  'summary' prints, per exit reason, the number of exits and
+// the total and average cycles spent handling them.  Both skip records that
+// were overwritten while being read.
+
+#include <inc/lib.h>
+#include <inc/vmtrace.h>
+
+// Where vmm maps the ring; see user/vmm.c.
+#define TRACEVA		0xD8000000
+
+#define NREASONS	64
+
+static const char * const reason_names[NREASONS] = {
+	[0x00] = "exception",
+	[0x01] = "extint",
+	[0x02] = "triplefault",
+	[0x07] = "intwindow",
+	[0x0A] = "cpuid",
+	[0x0C] = "hlt",
+	[0x0E] = "invlpg",
+	[0x10] = "rdtsc",
+	[0x12] = "vmcall",
+	[0x1C] = "movcr",
+	[0x1E] = "io",
+	[0x1F] = "rdmsr",
+	[0x20] = "wrmsr",
+	[0x21] = "entfail",
+	[0x28] = "pause",
+	[0x30] = "eptviolation",
+	[0x31] = "eptmisconfig",
+	[0x34] = "preempt",
+};
+
+static struct vmtrace_ring *ring = (struct vmtrace_ring *) TRACEVA;
+
+static const char *
+reason_name(uint32_t reason)
+{
+	if (reason < NREASONS && reason_names[reason])
+		return reason_names[reason];
+	return "other";
+}
+
+static bool
+ring_mapped(void)
+{
+	uintptr_t va;
+
+	for (va = TRACEVA; va < TRACEVA + VMTRACE_RING_SIZE; va += PGSIZE)
+		if (!(vpml4e[VPML4E(va)] & PTE_P) || !(vpde[VPDPE(va)] & PTE_P)
+		    || !(vpd[VPD(va)] & PTE_P) || !(vpt[VPN(va)] & PTE_P))
+			return false;
+	return true;
+}
+
+// Copy record 'seq' of the ring into rec.  Returns 0 if the copy is good and
+// -E_INVAL if the writer lapped it before we were done.  The writer may be
+// filling in record 'head' at any time, which reuses the slot of record
+// head - VMTRACE_NRECS.
+static int
+read_rec(uint64_t seq, struct vmtrace_rec *rec)
+{
+	*rec = ring->recs[seq & (VMTRACE_NRECS - 1)];
+	asm volatile("" ::: "memory");
+	if (ring->head - seq >= VMTRACE_NRECS)
+		return -E_INVAL;
+	return 0;
+}
+
+// First record of the ring that is still worth reading, given at most n
+// wanted.  The oldest slot may be being overwritten, so at most
+// VMTRACE_NRECS - 1 records are readable.
+static uint64_t
+first_seq(uint64_t head, uint64_t n)
+{
+	if (n > VMTRACE_NRECS - 1)
+		n = VMTRACE_NRECS - 1;
+	return head > n ? head - n : 0;
+}
+
+static void
+dump(uint64_t n)
+{
+	struct vmtrace_rec rec;
+	uint64_t seq, head;
+
+	cprintf("guest %08x\n", ring->guest);
+	head = ring->head;
+	for (seq = first_seq(head, n); seq < head; seq++) {
+		if (read_rec(seq, &rec) < 0)
+			continue;
+		cprintf("seq %ld tsc %016lx cpu %d "
+			"reason %s(0x%x) rip %016lx qual %lx cycles %ld\n",
+			seq, rec.tsc, rec.cpu,
+			reason_name(rec.reason), rec.reason,
+			rec.rip, rec.qual, rec.cycles);
+	}
+}
+
+static void
+summary(void)
+{
+	static uint64_t count[NREASONS + 1], cycles[NREASONS + 1];
+	struct vmtrace_rec rec;
+	uint64_t seq, head, total = 0, lost;
+	int i;
+
+	head = ring->head;
+	lost = first_seq(head, VMTRACE_NRECS);
+	for (seq = lost; seq < head; seq++) {
+		if (read_rec(seq, &rec) < 0) {
+			lost++;
+			continue;
+		}
+		i = rec.reason < NREASONS ? rec.reason : NREASONS;
+		count[i]++;
+		cycles[i] += rec.cycles;
+		total++;
+	}
+
+	cprintf("guest %08x\n", ring->guest);
+	cprintf("%-14s %10s %14s %10s\n", "reason", "exits", "cycles", "avg");
+	for (i = 0; i <= NREASONS; i++) {
+		if (!count[i])
+			continue;
+		cprintf("%-14s %10ld %14ld %10ld\n",
+			i < NREASONS ? reason_name(i) : "other",
+			count[i], cycles[i], cycles[i] / count[i]);
+	}
+	cprintf("total %ld exits, %ld overwritten\n", total, lost);
+}
+
+static void
+usage(void)
+{
+	cprintf("usage: vmtrace [dump [n] | summary]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	binaryname = "vmtrace";
+
+	if (argc > 2 && strcmp(argv[1], "dump") != 0)
+		usage();
+	if (!ring_mapped()) {
+		cprintf("vmtrace: no trace ring; run the guest with vmm -x\n");
+		exit();
+	}
+
+	if (argc > 1 && strcmp(argv[1], "dump") == 0)
+		dump(argc > 2 ? strtol(argv[2], NULL, 0) : VMTRACE_NRECS);
+	else if (argc == 1 || strcmp(argv[1], "summary") == 0)
+		summary();
+	else
+		usage();
+}
@@ -6,6 +6,9 @@
 #include <kern/pmap.h>
 #include <inc/string.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
 
 
 // Return the physical address of an ept entry
@@ -96,6 +99,7 @@ epml4e_walk(epte_t *pml4e, const void *va, int create)
 				page_decref(newPage); // Free allocated page for PDPE
 			else {
 				*offsetd_ptr_in_pml4t = ((uint64_t)pdpt_base) | __EPTE_FULL;
+				pt_mark_used(offsetd_ptr_in_pml4t);
 				return pte;
 			}
 		}
@@ -127,11 +131,12 @@ epdpe_walk(pdpe_t *pdpe,const void *va,int create){
 
                         newPage->pp_ref++;
                         pgdir_base = (pde_t*)page2pa(newPage);
-                        epte_t *pte = pgdir_walk(page2kva(newPage), va, create);
+                        epte_t *pte = epgdir_walk(page2kva(newPage), va, create);
 
                         if (pte == NULL) page_decref(newPage); // Free allocated page for PDE
                         else {
                                 *offsetd_ptr_in_pdpt = ((uint64_t)pgdir_base) | __EPTE_FULL;
+                                pt_mark_used(offsetd_ptr_in_pdpt);
                                 return pte;
                         }
                }
@@ -164,6 +169,7 @@ epgdir_walk(pde_t *pgdir, const void *va, int create)
                         newPage->pp_ref++;
                         page_table_base = (epte_t*)page2pa(newPage);
 			*offsetd_ptr_in_pgdir = ((uint64_t)page_table_base) | __EPTE_FULL;
+			pt_mark_used(offsetd_ptr_in_pgdir);
 
 			// Return PTE
 		        uintptr_t index_in_page_table = PTX(va);
@@ -196,35 +202,6 @@ void ept_gpa2hva(epte_t* eptrt, void *gpa, void **hva) {
     }
 }
 
-static void free_ept_level(epte_t* eptrt, int level) {
-    epte_t* dir = eptrt;
-    int i;
-
-    for(i=0; i<NPTENTRIES; ++i) {
-        if(level != 0) {
-            if(epte_present(dir[i])) {
-                physaddr_t pa = epte_addr(dir[i]);
-                free_ept_level((epte_t*) KADDR(pa), level-1);
-                // free the table.
-                page_decref(pa2page(pa));
-            }
-        } else {
-            // Last level, free the guest physical page.
-            if(epte_present(dir[i])) {
-                physaddr_t pa = epte_addr(dir[i]);
-                page_decref(pa2page(pa));
-            }
-        }
-    }
-    return;
-}
-
-// Free the EPT table entries and the EPT tables.
-// NOTE: Does not deallocate EPT PML4 page.
-void free_guest_mem(epte_t* eptrt) {
-    free_ept_level(eptrt, EPT_LEVELS - 1);
-}
-
 // Add Page pp to a guest's EPT at guest physical address gpa
 //  with permission perm.  eptrt is the EPT root.
 // 
@@ -240,6 +217,73 @@ int ept_page_insert(epte_t* eptrt, struct Page* pp, void* gpa, int perm) {
 
 }
 
+// The page of zeros that backs guest RAM a guest has read but not yet
+// written.  It is shared read-only by every guest and never freed: it holds
+// one reference of its own besides those of the EPT leaves mapping it.
+static struct Page *zero_page;
+
+// Map the zero page at gpa, read-only and copy-on-write, if nothing is
+// mapped there yet.
+//
+// Returns 0 on success, or
+//	-E_INVAL if gpa is already mapped.
+//	-E_NO_MEM if the zero page or a page table could not be allocated,
+//		or the zero page's reference count is saturated; the caller
+//		should back gpa with a private page instead.
+int ept_map_zero(epte_t *eptrt, uint64_t gpa) {
+    int r;
+
+    if(!zero_page) {
+        if(!(zero_page = page_alloc(ALLOC_ZERO)))
+            return -E_NO_MEM;
+        zero_page->pp_ref++;
+    }
+    if(zero_page->pp_ref == (uint16_t) ~0)
+        return -E_NO_MEM;
+    r = ept_map_hva2gpa(eptrt, page2kva(zero_page),
+            (void *) ROUNDDOWN(gpa, PGSIZE),
+            __EPTE_READ | __EPTE_EXEC | __EPTE_COW, 0);
+    if(r < 0)
+        return r;
+    zero_page->pp_ref++;
+    return 0;
+}
+
+// Give gpa a private, writable page if it maps a copy-on-write one.  The
+// zero page is replaced by a fresh zeroed page, any other shared page by a
+// copy; the last mapping of a page simply becomes writable.  Host code
+// about to write into guest memory must call this first.
+//
+// Returns 0 on success, including when gpa is not copy-on-write, or
+//	-E_NO_MEM if no page is free for the copy.
+int ept_cow(epte_t *eptrt, uint64_t gpa) {
+    epte_t *epte = epml4e_walk(eptrt, (void *) gpa, 0);
+    struct Page *old, *pp;
+    int perm;
+
+    if(!epte || !epte_present(*epte) || !(*epte & __EPTE_COW))
+        return 0;
+    old = pa2page(epte_addr(*epte));
+    perm = (*epte & __EPTE_FULL) | __EPTE_WRITE;
+    if(old != zero_page && old->pp_ref == 1) {
+        // A stale read-only translation only causes one more fault,
+        // which finds the entry writable.
+        *epte = (*epte & ~(epte_t) __EPTE_COW) | __EPTE_WRITE;
+        return 0;
+    }
+
+    if(!(pp = page_alloc(old == zero_page ? ALLOC_ZERO : 0)))
+        return -E_NO_MEM;
+    if(old != zero_page)
+        memcpy(page2kva(pp), page2kva(old), PGSIZE);
+    if(ept_page_insert(eptrt, pp, (void *) ROUNDDOWN(gpa, PGSIZE), perm) < 0) {
+        page_free(pp);
+        return -E_NO_MEM;
+    }
+    page_decref(old);
+    return 0;
+}
+
 // Map host virtual address hva to guest physical address gpa,
 // with permissions perm.  eptrt is a pointer to the extended
 // page table root.
@@ -257,7 +301,7 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
     epte_t* pte;
     epte_t* phys;
 
-    int ptr = PADDR(hva);
+    physaddr_t ptr = PADDR(hva);
 
     struct Page *pp = pa2page(ptr);
     
@@ -265,12 +309,20 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
              return -E_INVAL;
 
   int ret = ept_lookup_gpa(eptrt, gpa, 1, &pte);
+  if (ret < 0)
+	return ret;
 
   if(overwrite == 0 && *pte != 0)
 	return -E_INVAL;
  else if (overwrite  != 0 || *pte == 0)
 {
+	epte_t old = *pte;
+
 	*pte = PTE_ADDR(ptr)| PTE_P |  perm | __EPTE_IPAT | __EPTE_TYPE(EPTE_TYPE_WB);
+	pt_mark_used(pte);
+	// Replacing a present mapping leaves the old one in the TLB.
+	if (epte_present(old) && (old & ~(epte_t) (__EPTE_A | __EPTE_D)) != *pte)
+		ept_invalidate(eptrt);
 }
  else
 	cprintf("Not ENTERING!");
@@ -278,6 +330,281 @@ int ept_map_hva2gpa(epte_t* eptrt, void* hva, void* gpa, int perm,
     return 0;
 }
 
+// Does the CPU set accessed and dirty bits in EPT entries?
+bool ept_ad_supported(void) {
+    static int ad = -1;
+
+    if(ad < 0)
+        ad = BIT(read_msr(IA32_VMX_EPT_VPID_CAP), 21);
+    return ad;
+}
+
+// The EPT pointer for the tables rooted at eptrt: a 4-level walk, and
+// write-back paging structures and accessed/dirty tracking where the CPU
+// supports them.  Without write-back the walk is uncached.
+uint64_t ept_eptp(epte_t *eptrt) {
+    static int wb = -1;
+    uint64_t eptp = PADDR(eptrt) | ((EPT_LEVELS - 1) << 3);
+
+    if(wb < 0)
+        wb = BIT(read_msr(IA32_VMX_EPT_VPID_CAP), 14);
+    if(wb)
+        eptp |= VMX_EPTP_MT_WB;
+    if(ept_ad_supported())
+        eptp |= VMX_EPTP_AD;
+    return eptp;
+}
+
+// Bumped each time some EPT entry loses permissions.  A CPU whose
+// cpu_ept_gen is behind flushes all of its guest translations before it
+// next enters a guest (see ept_guest_enter()).
+static volatile uint64_t ept_gen;
+
+static void ept_flush(uint64_t type, epte_t *eptrt) {
+    struct {
+        uint64_t eptp;
+        uint64_t rsvd;
+    } desc = { eptrt ? ept_eptp(eptrt) : 0, 0 };
+
+    asm volatile("invept %0, %1" : : "m" (desc), "r" (type) : "cc", "memory");
+}
+
+// Flush the TLB entries derived from the EPT rooted at eptrt, on every CPU.
+// This is needed after an entry loses permissions or its accessed bit is
+// cleared; filling a not-present entry needs no flush.
+//
+// This CPU flushes at once and the others before they next enter a guest.
+// A CPU running on eptrt right now is kicked out of guest mode, and waited
+// for, so that the guest cannot go on using the old entry.
+void ept_invalidate(epte_t *eptrt) {
+    uint64_t cap, type, gen;
+    struct Cpu *c;
+
+    gen = __sync_add_and_fetch(&ept_gen, 1);
+    // Outside VMX operation no guest translations can be cached.
+    if(thiscpu->is_vmx_root) {
+        cap = read_msr(IA32_VMX_EPT_VPID_CAP);
+        type = BIT(cap, 25) ? VMX_INVEPT_SINGLE : VMX_INVEPT_ALL;
+        ept_flush(type, eptrt);
+        if(thiscpu->cpu_ept_gen == gen - 1)
+            thiscpu->cpu_ept_gen = gen;
+    }
+
+    for(c = cpus; c < cpus + ncpu; c++) {
+        if(c == thiscpu || c->cpu_guest_ept != eptrt)
+            continue;
+        lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_KICK);
+        while(c->cpu_guest_ept == eptrt && c->cpu_ept_gen < gen)
+            asm volatile("pause");
+    }
+}
+
+// This CPU is about to enter a guest on eptrt.  Catch up with the EPT
+// changes other CPUs made since it last flushed.  Interrupts are off.
+void ept_guest_enter(epte_t *eptrt) {
+    uint64_t gen;
+
+    thiscpu->cpu_guest_ept = eptrt;
+    // Publish eptrt before reading ept_gen; ept_invalidate() bumps ept_gen
+    // before it looks at cpu_guest_ept.
+    __sync_synchronize();
+    gen = ept_gen;
+    if(thiscpu->cpu_ept_gen != gen) {
+        ept_flush(VMX_INVEPT_ALL, NULL);
+        thiscpu->cpu_ept_gen = gen;
+    }
+}
+
+// This CPU has left guest mode.
+void ept_guest_exit(void) {
+    thiscpu->cpu_guest_ept = NULL;
+}
+
+static int ept_walk_level(epte_t *table, int level, uint64_t base,
+        uint64_t start, uint64_t end, ept_walk_fn fn, void *arg) {
+    uint64_t span = 1ULL << (12 + 9 * level);
+    uint64_t gpa;
+    int i, r;
+
+    i = start > base ? (start - base) / span : 0;
+    for(; i < NPTENTRIES; i++) {
+        gpa = base + i * span;
+        if(gpa >= end)
+            break;
+        if(table[i] == 0)
+            continue;
+        if(level == 0 || (table[i] & __EPTE_SZ)) {
+            if((r = fn(&table[i], gpa, arg)) != 0)
+                return r;
+        } else if(epte_present(table[i])) {
+            r = ept_walk_level((epte_t *) epte_page_vaddr(table[i]),
+                    level - 1, gpa, start, end, fn, arg);
+            if(r != 0)
+                return r;
+        }
+    }
+    return 0;
+}
+
+// Call fn on every non-empty leaf entry (including swap markers and large
+// pages) mapping a gpa in [start, end), in address order.  Missing tables
+// are skipped without being allocated.  The walk stops early if fn
+// returns non-zero, and that value is returned; otherwise returns 0.
+int ept_walk_range(epte_t *eptrt, uint64_t start, uint64_t end,
+        ept_walk_fn fn, void *arg) {
+    if(start >= end)
+        return 0;
+    return ept_walk_level(eptrt, EPT_LEVELS - 1, 0, start, end, fn, arg);
+}
+
+// Replace the large-page leaf *epte, which maps 'level' worth of guest
+// physical memory, with a table of 512 leaves one level down that map the
+// same memory with the same flags.
+//
+// Returns 0 on success, -E_NO_MEM if no page is free for the table.
+static int ept_split_large(epte_t *epte, int level) {
+    uint64_t subspan = 1ULL << (12 + 9 * (level - 1));
+    epte_t *table, flags;
+    struct Page *pp;
+    int i;
+
+    if(!(pp = page_alloc(ALLOC_ZERO)))
+        return -E_NO_MEM;
+    pp->pp_ref++;
+    table = page2kva(pp);
+
+    flags = epte_flags(*epte);
+    if(level - 1 == 0)
+        flags &= ~__EPTE_SZ;
+    for(i = 0; i < NPTENTRIES; i++) {
+        table[i] = (epte_addr(*epte) + i * subspan) | flags;
+        pt_mark_used(&table[i]);
+    }
+    *epte = page2pa(pp) | __EPTE_FULL;
+    return 0;
+}
+
+struct ept_update {
+    int unmap;      // Clear the leaves rather than change permissions
+    int perm;       // New __EPTE_FULL bits, if !unmap
+    int flush;      // Some cached translation is now stale
+};
+
+// Drop the reference a leaf holds on each 4 KB page it maps.
+static void ept_leaf_release(epte_t epte, int level) {
+    uint64_t n = 1ULL << (9 * level), i;
+
+    for(i = 0; i < n; i++)
+        page_decref(pa2page(epte_addr(epte) + i * PGSIZE));
+}
+
+static int ept_update_level(epte_t *table, int level, uint64_t base,
+        uint64_t start, uint64_t end, struct ept_update *u) {
+    uint64_t span = 1ULL << (12 + 9 * level);
+    uint64_t gpa;
+    epte_t old;
+    int i, r;
+
+    i = start > base ? (start - base) / span : 0;
+    for(; i < NPTENTRIES; i++) {
+        gpa = base + i * span;
+        if(gpa >= end)
+            break;
+        old = table[i];
+        if(old == 0)
+            continue;
+
+        if(level > 0 && !(old & __EPTE_SZ)) {
+            if(!epte_present(old))
+                continue;
+            r = ept_update_level((epte_t *) epte_page_vaddr(old), level - 1,
+                    gpa, start, end, u);
+            if(r < 0)
+                return r;
+            continue;
+        }
+
+        // A leaf.  Split large pages that the range only partly covers.
+        if(level > 0 && (gpa < start || gpa + span > end)) {
+            if((r = ept_split_large(&table[i], level)) < 0)
+                return r;
+            r = ept_update_level((epte_t *) epte_page_vaddr(table[i]),
+                    level - 1, gpa, start, end, u);
+            if(r < 0)
+                return r;
+            continue;
+        }
+
+        if(!epte_present(old)) {
+            // A swap marker: the page and its slot belong to the pager,
+            // which alone can free the slot.  Leave it for the pager to
+            // read back, or for guest teardown.
+            continue;
+        }
+        if(u->unmap) {
+            table[i] = 0;
+            ept_leaf_release(old, level);
+            u->flush = 1;
+        } else {
+            table[i] = (old & ~(epte_t) __EPTE_FULL) | u->perm;
+            // Shared pages stay read-only; a write still copies them.
+            if(old & __EPTE_COW)
+                table[i] &= ~(epte_t) __EPTE_WRITE;
+            if(old & ~table[i] & __EPTE_FULL)
+                u->flush = 1;
+        }
+    }
+    return 0;
+}
+
+static int ept_update_range(epte_t *eptrt, uint64_t start, uint64_t end,
+        struct ept_update *u) {
+    int r;
+
+    if(start % PGSIZE || end % PGSIZE)
+        return -E_INVAL;
+    if(start >= end)
+        return 0;
+    r = ept_update_level(eptrt, EPT_LEVELS - 1, 0, start, end, u);
+    // Flush even after a failure, for the leaves already changed.
+    if(u->flush)
+        ept_invalidate(eptrt);
+    return r;
+}
+
+// Set the permissions of every present leaf mapping [start, end) to perm
+// (a combination of __EPTE_READ, __EPTE_WRITE and __EPTE_EXEC), splitting
+// large pages that straddle the ends of the range.  Missing and swapped
+// out pages are left alone.  One INVEPT covers the whole range, and only
+// if some permission was removed.
+//
+// Returns 0 on success, or
+//	-E_INVAL if start or end is not page-aligned.
+//	-E_NO_MEM if a large page could not be split; leaves before the
+//		failure have been changed.
+int ept_protect_range(epte_t *eptrt, uint64_t start, uint64_t end, int perm) {
+    struct ept_update u = { 0, perm & __EPTE_FULL, 0 };
+
+    return ept_update_range(eptrt, start, end, &u);
+}
+
+// Remove every leaf mapping [start, end) and drop the page references they
+// held.  Swap markers (__EPTE_SWAPPED) are left in place, since only the
+// pager can release their slots.  Large pages that straddle the ends of
+// the range are split first.  Intermediate tables are kept.  One INVEPT
+// covers the whole range.  A large leaf holds a reference on each 4 KB
+// page it maps.
+//
+// Returns 0 on success, or
+//	-E_INVAL if start or end is not page-aligned.
+//	-E_NO_MEM if a large page could not be split; leaves before the
+//		failure have been removed.
+int ept_unmap_range(epte_t *eptrt, uint64_t start, uint64_t end) {
+    struct ept_update u = { 1, 0, 0 };
+
+    return ept_update_range(eptrt, start, end, &u);
+}
+
 int ept_alloc_static(epte_t *eptrt, struct VmxGuestInfo *ginfo) {
     physaddr_t i;
     
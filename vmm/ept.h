@@ -10,9 +10,23 @@ typedef uint64_t epte_t;
 
 int ept_map_hva2gpa( epte_t* eptrt, void* hva, void* gpa, int perm, int overwrite );
 int ept_alloc_static(epte_t *eptrt, struct VmxGuestInfo *ginfo);
-void free_guest_mem(epte_t* eptrt);
 void ept_gpa2hva(epte_t* eptrt, void *gpa, void **hva);
 int ept_page_insert(epte_t* eptrt, struct Page* pp, void* gpa, int perm);
+int ept_map_zero(epte_t *eptrt, uint64_t gpa);
+int ept_cow(epte_t *eptrt, uint64_t gpa);
+
+typedef int (*ept_walk_fn)(epte_t *epte, uint64_t gpa, void *arg);
+int ept_walk_range(epte_t *eptrt, uint64_t start, uint64_t end,
+        ept_walk_fn fn, void *arg);
+
+int ept_protect_range(epte_t *eptrt, uint64_t start, uint64_t end, int perm);
+int ept_unmap_range(epte_t *eptrt, uint64_t start, uint64_t end);
+
+bool ept_ad_supported(void);
+uint64_t ept_eptp(epte_t *eptrt);
+void ept_invalidate(epte_t *eptrt);
+void ept_guest_enter(epte_t *eptrt);
+void ept_guest_exit(void);
 
 epte_t * epml4e_walk(epte_t *pml4e, const void *va, int create);
 epte_t * epdpe_walk(pdpe_t *pdpe,const void *va,int create);
@@ -22,6 +36,15 @@ epte_t * epgdir_walk(pde_t *pgdir, const void *va, int create);
 
 #define EPT_LEVELS 4
 
+// EPTP bits 2:0: memory type of the EPT paging structures.
+#define VMX_EPTP_MT_WB	0x6
+// EPTP bit 6: set the accessed/dirty bits in EPT entries.
+#define VMX_EPTP_AD	0x40
+
+// INVEPT types.
+#define VMX_INVEPT_SINGLE	1
+#define VMX_INVEPT_ALL		2
+
 #define VMX_EPT_FAULT_READ	0x01
 #define VMX_EPT_FAULT_WRITE	0x02
 #define VMX_EPT_FAULT_INS	0x04
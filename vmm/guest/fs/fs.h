@@ -51,5 +51,17 @@ void fs_test(void);
 int host_read(uint32_t secno, void *dst, size_t nsecs);
 int host_write(uint32_t secno, const void *src, size_t nsecs);
 void host_ipc_init();
+
+// Files of the host's shared directory, which the file server shows
+// under HOST_SHARE_PREFIX.
+#define HOST_SHARE_PREFIX "/host"
+struct vmchan_stat;
+int host_file_open(const char *path, int mode);
+int host_file_close(int fid);
+int host_file_read(int fid, void *buf, size_t n, off_t off);
+int host_file_write(int fid, const void *buf, size_t n, off_t off);
+int host_file_stat(int fid, struct vmchan_stat *st);
+int host_file_set_size(int fid, off_t size);
+int host_file_remove(const char *path);
 #endif
 
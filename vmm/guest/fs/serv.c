@@ -7,6 +7,9 @@
 #include <inc/string.h>
 
 #include "fs.h"
+#ifdef VMM_GUEST
+#include <inc/vmchan.h>
+#endif
 
 
 #define debug 0
@@ -28,12 +31,17 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// In a guest, files under HOST_SHARE_PREFIX live in the host's shared
+// directory instead.  Their OpenFile has no struct File but the id of
+// the file on the host.
 
 struct OpenFile {
     uint32_t o_fileid;	// file id
     struct File *o_file;	// mapped descriptor for open file
     int o_mode;		// open mode
     struct Fd *o_fd;	// Fd page
+    int o_host;		// host file id + 1, or 0
 };
 
 // Max number of open files in the file system at once
@@ -74,6 +82,12 @@ openfile_alloc(struct OpenFile **o)
                     return r;
                 /* fall through */
             case 1:
+#ifdef VMM_GUEST
+                // Its last user is gone; let the host close it too.
+                if (opentab[i].o_host)
+                    host_file_close(opentab[i].o_host - 1);
+#endif
+                opentab[i].o_host = 0;
                 opentab[i].o_fileid += MAXOPEN;
                 *o = &opentab[i];
                 memset(opentab[i].o_fd, 0, PGSIZE);
@@ -96,6 +110,21 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
     return 0;
 }
 
+#ifdef VMM_GUEST
+// If path names a file in the host's shared directory, return its path
+// there, else NULL.
+static const char *
+host_share_path(const char *path)
+{
+    size_t n = strlen(HOST_SHARE_PREFIX);
+
+    if (strncmp(path, HOST_SHARE_PREFIX, n) != 0 ||
+        (path[n] != '/' && path[n] != '\0'))
+        return NULL;
+    return path[n] ? path + n : "/";
+}
+#endif
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -104,6 +133,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
         void **pg_store, int *perm_store)
 {
     char path[MAXPATHLEN];
+    const char *hpath;
     struct File *f;
     int fileid;
     int r;
@@ -124,6 +154,17 @@ serve_open(envid_t envid, struct Fsreq_open *req,
     }
     fileid = r;
 
+#ifdef VMM_GUEST
+    if ((hpath = host_share_path(path)) != NULL) {
+        // The host handles O_CREAT and O_TRUNC itself.
+        if ((r = host_file_open(hpath, req->req_omode)) < 0)
+            return r;
+        o->o_host = r + 1;
+        f = NULL;
+        goto opened;
+    }
+#endif
+
     // Open the file
     if (req->req_omode & O_CREAT) {
         if ((r = file_create(path, &f)) < 0) {
@@ -151,6 +192,7 @@ try_open:
         }
     }
 
+opened:
     // Save the file pointer
     o->o_file = f;
 
@@ -190,6 +232,10 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
     // Second, call the relevant file system function (from fs/fs.c).
     // On failure, return the error code to the client.
+#ifdef VMM_GUEST
+    if (o->o_host)
+        return host_file_set_size(o->o_host - 1, req->req_size);
+#endif
     return file_set_size(o->o_file, req->req_size);
 }
 
@@ -223,7 +269,15 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if(req->req_n > PGSIZE)
 		req->req_n = PGSIZE;
 	
-	if ((r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+#ifdef VMM_GUEST
+	// The host reads straight into the page the client sent.
+	if (o->o_host)
+		r = host_file_read(o->o_host - 1, ret->ret_buf, req->req_n,
+				   o->o_fd->fd_offset);
+	else
+#endif
+	r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset);
+	if (r < 0)
 		return r;
 	
 	o->o_fd->fd_offset += r;
@@ -252,7 +306,14 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if(req->req_n > PGSIZE)
 		req->req_n = PGSIZE;
 	
-	if ((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0)
+#ifdef VMM_GUEST
+	if (o->o_host)
+		r = host_file_write(o->o_host - 1, req->req_buf, req->req_n,
+				    o->o_fd->fd_offset);
+	else
+#endif
+	r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset);
+	if (r < 0)
 		return r;
 	
 	o->o_fd->fd_offset += r;
@@ -279,6 +340,18 @@ serve_stat(envid_t envid, union Fsipc *ipc)
     if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return r;
 
+#ifdef VMM_GUEST
+    if (o->o_host) {
+        struct vmchan_stat st;
+
+        if ((r = host_file_stat(o->o_host - 1, &st)) < 0)
+            return r;
+        strcpy(ret->ret_name, st.name);
+        ret->ret_size = st.size;
+        ret->ret_isdir = st.isdir;
+        return 0;
+    }
+#endif
     strcpy(ret->ret_name, o->o_file->f_name);
     ret->ret_size = o->o_file->f_size;
     ret->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
@@ -297,6 +370,9 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
     if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
         return r;
+    // The host file system writes back its own files.
+    if (o->o_host)
+        return 0;
     file_flush(o->o_file);
     return 0;
 }
@@ -306,6 +382,7 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 serve_remove(envid_t envid, struct Fsreq_remove *req)
 {
     char path[MAXPATHLEN];
+    const char *hpath;
     int r;
 
     if (debug)
@@ -318,6 +395,10 @@ serve_remove(envid_t envid, struct Fsreq_remove *req)
     memmove(path, req->req_path, MAXPATHLEN);
     path[MAXPATHLEN-1] = 0;
 
+#ifdef VMM_GUEST
+    if ((hpath = host_share_path(path)) != NULL)
+        return host_file_remove(hpath);
+#endif
     // Delete the specified file
     return file_remove(path);
 }
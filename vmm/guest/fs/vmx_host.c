@@ -6,17 +6,210 @@
 #include  <inc/vmx.h>
 #include <inc/fs.h>
 #include <inc/lib.h>
+#include <inc/vmchan.h>
 
 #define HOST_FS_FILE "/vmm/fs.img"
 
+// Yields spent waiting for a completion before ringing the doorbell
+// anyway.  Host interrupts do not cause exits, so on a single CPU the
+// polling backend only runs when this vCPU exits for some other reason.
+#define HOST_CHAN_SPIN 64
+
 static struct Fd *host_fd;
 static union Fsipc host_fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// The exitless I/O channel to the host (see inc/vmchan.h), used instead
+// of file server IPC when the host sets it up.
+static struct vmchan_ring host_chan;
+static int host_chan_state;	// 0 = untried, 1 = up, -1 = unavailable
+static uint64_t host_chan_ids;
+
+static void
+host_chan_init(void)
+{
+    int r;
+
+    memset(&host_chan, 0, sizeof(host_chan));
+    asm volatile("vmcall"
+                 : "=a" (r)
+                 : "a" (VMX_VMCALL_CHAN_SETUP),
+                   "d" (PTE_ADDR(vpt[VPN(&host_chan)]))
+                 : "cc", "memory");
+    host_chan_state = r == 0 ? 1 : -1;
+}
+
+static void
+host_chan_kick(void)
+{
+    int r;
+
+    host_chan.doorbells++;
+    asm volatile("vmcall"
+                 : "=a" (r)
+                 : "a" (VMX_VMCALL_CHAN_KICK)
+                 : "cc", "memory");
+}
+
+static bool
+host_chan_up(void)
+{
+    if (host_chan_state == 0)
+        host_chan_init();
+    return host_chan_state > 0;
+}
+
+// Submit one request over the channel and wait for its completion.  va
+// is the buffer the request grants the host, which must not cross a page.
+// Returns the request's result: for transfers the number of bytes
+// transferred, or < 0 on error.
+static int64_t
+host_chan_io(uint32_t op, uint32_t fid, uint64_t off, void *va, uint32_t len)
+{
+    struct vmchan_req *req;
+    struct vmchan_cpl cpl;
+    int spins = 0;
+
+    req = &host_chan.sq[host_chan.sq_tail & (VMCHAN_NSLOTS - 1)];
+    req->op = op;
+    req->len = len;
+    req->off = off;
+    req->gpa = PTE_ADDR(vpt[VPN(va)]) + PGOFF(va);
+    req->id = ++host_chan_ids;
+    req->fid = fid;
+    vmchan_mb();
+    host_chan.sq_tail++;
+    host_chan.submitted++;
+
+    // Only a sleeping backend needs the doorbell.
+    vmchan_mb();
+    if (host_chan.state != VMCHAN_POLLING)
+        host_chan_kick();
+
+    while (host_chan.cq_head == host_chan.cq_tail) {
+        if (++spins % HOST_CHAN_SPIN == 0)
+            host_chan_kick();
+        sys_yield();
+    }
+    cpl = host_chan.cq[host_chan.cq_head & (VMCHAN_NSLOTS - 1)];
+    host_chan.cq_head++;
+    return cpl.result;
+}
+
+// Read or write nsecs sectors at sector secno over the channel, a page at
+// a time.
+static int
+host_chan_rw(uint32_t op, uint32_t secno, void *buf, size_t nsecs)
+{
+    uint64_t off = (uint64_t) secno * SECTSIZE;
+    size_t len = nsecs * SECTSIZE, n;
+    int64_t r;
+
+    while (len > 0) {
+        n = MIN(len, PGSIZE - PGOFF(buf));
+        if ((r = host_chan_io(op, 0, off, buf, n)) < 0)
+            return r;
+        if (r != n)
+            return -E_EOF;
+        off += n;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// The host's shared directory, reached over the channel only.  The file
+// server is single-threaded, so one page serves for paths and stat
+// results.
+static char host_xfer[PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Open path, relative to the shared directory, with O_* mode.
+// Returns a host file id, or < 0 on error.
+    int
+host_file_open(const char *path, int mode)
+{
+    size_t len = strlen(path) + 1;
+
+    if (!host_chan_up())
+        return -E_NOT_SUPP;
+    if (len > MAXPATHLEN)
+        return -E_BAD_PATH;
+    memmove(host_xfer, path, len);
+    return host_chan_io(VMCHAN_OP_OPEN, 0, mode, host_xfer, len);
+}
+
+    int
+host_file_close(int fid)
+{
+    return host_chan_io(VMCHAN_OP_CLOSE, fid, 0, host_xfer, 0);
+}
+
+// Read at most n bytes at off of fid straight into buf, which the host
+// fills in place.  Stops at the end of buf's page.
+// Returns the number of bytes read, or < 0 on error.
+    int
+host_file_read(int fid, void *buf, size_t n, off_t off)
+{
+    n = MIN(n, PGSIZE - PGOFF(buf));
+    if (n == 0)
+        return 0;
+    return host_chan_io(VMCHAN_OP_PREAD, fid, off, buf, n);
+}
+
+// Write at most n bytes from buf at off of fid.  Stops at the end of
+// buf's page.
+// Returns the number of bytes written, or < 0 on error.
+    int
+host_file_write(int fid, const void *buf, size_t n, off_t off)
+{
+    n = MIN(n, PGSIZE - PGOFF(buf));
+    if (n == 0)
+        return 0;
+    return host_chan_io(VMCHAN_OP_PWRITE, fid, off, (void *) buf, n);
+}
+
+    int
+host_file_stat(int fid, struct vmchan_stat *st)
+{
+    int r;
+
+    if ((r = host_chan_io(VMCHAN_OP_STAT, fid, 0, host_xfer,
+                          sizeof(*st))) < 0)
+        return r;
+    memmove(st, host_xfer, sizeof(*st));
+    return 0;
+}
+
+    int
+host_file_set_size(int fid, off_t size)
+{
+    return host_chan_io(VMCHAN_OP_SETSIZE, fid, size, host_xfer, 0);
+}
+
+    int
+host_file_remove(const char *path)
+{
+    size_t len = strlen(path) + 1;
+
+    if (!host_chan_up())
+        return -E_NOT_SUPP;
+    if (len > MAXPATHLEN)
+        return -E_BAD_PATH;
+    memmove(host_xfer, path, len);
+    return host_chan_io(VMCHAN_OP_REMOVE, 0, 0, host_xfer, len);
+}
+
 static int
 host_fsipc(unsigned type, void *dstva)
 {
+    int r;
+
+    // Post the receive first so the host file server can reply at once.
+    while ((r = ipc_host_recv_start(dstva)) == -E_BUSY)
+        sys_yield();
+    if (r < 0)
+        return r;
     ipc_host_send(VMX_HOST_FS_ENV, type, &host_fsipcbuf, PTE_P | PTE_W | PTE_U);
-    return ipc_host_recv(dstva);
+    return ipc_host_recv_wait();
 }
 
     int
@@ -24,6 +217,9 @@ host_read(uint32_t secno, void *dst, size_t nsecs)
 {
     int r, read = 0;
 
+    if (host_chan_up())
+        return host_chan_rw(VMCHAN_OP_READ, secno, dst, nsecs);
+
     if(host_fd->fd_file.id == 0) {
         host_ipc_init();
     }
@@ -48,6 +244,9 @@ host_read(uint32_t secno, void *dst, size_t nsecs)
 host_write(uint32_t secno, const void *src, size_t nsecs)
 {
     int r, written = 0;
+
+    if (host_chan_up())
+        return host_chan_rw(VMCHAN_OP_WRITE, secno, (void *) src, nsecs);
     
     if(host_fd->fd_file.id == 0) {
         host_ipc_init();
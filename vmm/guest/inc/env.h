@@ -56,6 +56,7 @@ struct Env {
     unsigned env_status;		// Status of the environment
     uint32_t env_runs;		// Number of times environment has run
     int env_cpunum;			// The CPU that the env is running on
+    bool env_tick_kept;		// Kept the CPU over a stolen tick
 
     // Address space
     pml4e_t *env_pml4e;		// Kernel virtual address of top-level page dir,
@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/vmbench.h>
 
 #define USED(x)		(void)(x)
 
@@ -60,6 +61,10 @@ int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
 unsigned int sys_time_msec(void);
+int	sys_vmbench(int op, int iters, struct vmbench_result *res);
+int	sys_vmshm_attach(int port, void *va, int perm);
+int	sys_vmshm_notify(int port);
+int	sys_vmshm_wait(int port, bool block);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -82,6 +87,9 @@ envid_t	ipc_find_env(enum EnvType type);
 #ifdef VMM_GUEST
 void	ipc_host_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_host_recv(void *pg);
+int	ipc_host_recv_start(void *pg);
+int	ipc_host_recv_poll(int32_t *value);
+int32_t ipc_host_recv_wait(void);
 #endif
 
 // fork.c
@@ -18,6 +18,10 @@ enum {
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
 	SYS_time_msec,
+	SYS_vmbench,
+	SYS_vmshm_attach,
+	SYS_vmshm_notify,
+	SYS_vmshm_wait,
 	NSYSCALLS
 };
 
@@ -292,9 +292,10 @@ xchg(volatile uint32_t *addr,uint32_t newval){
     static __inline uint64_t
 read_tsc(void)
 {
-    uint64_t tsc;
-    __asm __volatile("rdtsc" : "=A" (tsc));
-    return tsc;
+    uint32_t lo, hi;
+    // "=A" only means edx:eax in 32-bit mode; in long mode it is one register.
+    __asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
 }
 
 static __inline uint64_t
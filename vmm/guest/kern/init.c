@@ -19,6 +19,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/pv.h>
 
 
 uint64_t end_debug;
@@ -45,6 +46,10 @@ i386_init(void)
 
 	cprintf("6828 decimal is %o octal!\n", 6828);
 
+#ifdef VMM_GUEST
+	pv_init();
+#endif
+
 #ifndef VMM_GUEST
     extern char end[];
     end_debug = read_section_headers((0x10000+KERNBASE), (uintptr_t)end); 
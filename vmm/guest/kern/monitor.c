@@ -13,6 +13,7 @@
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
 #include <kern/trap.h>
+#include <kern/time.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -55,6 +56,8 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024); 
+	cprintf("Uptime %u ms, %u ms of it stolen by the hypervisor\n",
+		time_msec(), time_steal_msec());
 	return 0;
 }
 
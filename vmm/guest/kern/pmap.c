@@ -19,6 +19,16 @@
 size_t npages;			// Amount of physical memory (in pages)
 static size_t npages_basemem;	// Amount of base memory (in pages)
 
+// Usable extended memory regions from the e820 map, set by multiboot_read().
+// A large guest's RAM continues above 4 GB after a hole, so not every page
+// in [EXTPHYSMEM, npages * PGSIZE) is backed by memory.
+#define MAX_EXTMEM_REGIONS 8
+static struct {
+    physaddr_t start;
+    physaddr_t end;
+} extmem_regions[MAX_EXTMEM_REGIONS];
+static int nextmem_regions;
+
 // These variables are set in mem_init()
 pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
@@ -109,8 +119,16 @@ multiboot_read(multiboot_info_t* mbinfo, size_t* basemem, size_t* extmem) {
             if(mmap->type == MB_TYPE_USABLE || mmap->type == MB_TYPE_ACPI_RECLM) {
                 if(mmap->base_addr_low < 0x100000 && mmap->base_addr_high == 0)
                     *basemem += APPEND_HILO(mmap->length_high, mmap->length_low);
-                else
+                else {
                     *extmem += APPEND_HILO(mmap->length_high, mmap->length_low);
+                    if(nextmem_regions < MAX_EXTMEM_REGIONS) {
+                        uint64_t addr = APPEND_HILO(mmap->base_addr_high, mmap->base_addr_low);
+                        extmem_regions[nextmem_regions].start = addr;
+                        extmem_regions[nextmem_regions].end = addr +
+                            APPEND_HILO(mmap->length_high, mmap->length_low);
+                        nextmem_regions++;
+                    }
+                }
             }
         }
     }
@@ -145,8 +163,15 @@ i386_detect_memory(void)
     npages_extmem = extmem / PGSIZE;
 
     // Calculate the number of physical pages available in both base
-    // and extended memory.
-    if (npages_extmem)
+    // and extended memory.  With an e820 map, extended memory may have
+    // holes, so size the page array by the end of the highest region.
+    if (nextmem_regions) {
+        physaddr_t top = 0;
+        int i;
+        for (i = 0; i < nextmem_regions; i++)
+            top = MAX(top, extmem_regions[i].end);
+        npages = top / PGSIZE;
+    } else if (npages_extmem)
         npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
     else
         npages = npages_basemem;
@@ -393,6 +418,21 @@ mem_init_mp(void)
 // allocator functions below to allocate and deallocate physical
 // memory via the page_free_list.
 //
+// Is the extended memory page at pa backed by RAM according to the e820 map?
+// Without a map, all of extended memory is assumed usable.
+static bool
+extmem_usable(physaddr_t pa)
+{
+    int i;
+
+    if (!nextmem_regions)
+        return true;
+    for (i = 0; i < nextmem_regions; i++)
+        if (pa >= extmem_regions[i].start && pa < extmem_regions[i].end)
+            return true;
+    return false;
+}
+
     void
 page_init(void)
 {
@@ -423,6 +463,7 @@ page_init(void)
     size_t i;
     for (i = 0; i < npages; i++) {
 	    if (i == 0 ||	// Mark physical page 0 as in use.
+		(i >= EXTPHYSMEM / PGSIZE && !extmem_usable(page2pa(&pages[i]))) || // e820 hole
 		(i >= npages_basemem && i < npages_basemem + 96) ||	// IO hole (IOPHYSMEM, EXTPHYSMEM)
 		((int*)page2kva(&pages[i]) >= (int*)BOOT_PAGE_TABLE_START &&
 		 (int*)page2kva(&pages[i]) < (int*)BOOT_PAGE_TABLE_END) || // Memory used for initial boot page table
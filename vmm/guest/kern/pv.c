@@ -0,0 +1,73 @@
+// Detect the JOS hypervisor and the paravirtual features it offers.
+
+#include <inc/x86.h>
+#include <inc/vmx.h>
+#include <inc/stdio.h>
+
+#include <kern/pmap.h>
+#include <kern/pv.h>
+
+uint32_t pv_features;
+
+// Kept up to date by the hypervisor (VMX_PV_STEAL).
+static struct vmx_steal_time steal_time __attribute__((aligned(PGSIZE)));
+static bool steal_on;
+
+static void
+pv_steal_init(void)
+{
+	int64_t r;
+
+	asm volatile("vmcall" : "=a" (r)
+		     : "a" (VMX_VMCALL_STEAL_SETUP), "d" (PADDR(&steal_time))
+		     : "memory");
+	if (r < 0)
+		cprintf("pv: no steal time: %e\n", (int) r);
+	else
+		steal_on = true;
+}
+
+void
+pv_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (!(ecx & CPUID_1_ECX_HYPERVISOR))
+		return;
+
+	cpuid(VMX_CPUID_SIGNATURE, &eax, &ebx, &ecx, &edx);
+	if (ebx != VMX_CPUID_SIG_EBX || ecx != VMX_CPUID_SIG_ECX ||
+	    edx != VMX_CPUID_SIG_EDX || eax < VMX_CPUID_PV_FEATURES)
+		return;
+
+	cpuid(VMX_CPUID_PV_FEATURES, &pv_features, NULL, NULL, NULL);
+	cprintf("JOS hypervisor detected, pv features %x\n", pv_features);
+	if (pv_features & VMX_PV_STEAL)
+		pv_steal_init();
+}
+
+// Store the TSC cycles the hypervisor has kept us waiting while we could
+// have run in *steal, and its TSC rate in kHz (0 if it does not know yet)
+// in *tsc_khz.  Returns false, storing nothing, without steal time.
+bool
+pv_steal_clock(uint64_t *steal, uint64_t *tsc_khz)
+{
+	if (!steal_on)
+		return false;
+	*steal = steal_time.steal;
+	*tsc_khz = steal_time.tsc_khz;
+	return true;
+}
+
+// Give the rest of our time slice back to the hypervisor, if it lets us;
+// otherwise just return.
+void
+pv_yield(void)
+{
+	uint64_t rax;
+
+	if (pv_features & VMX_PV_YIELD)
+		asm volatile("vmcall" : "=a" (rax) : "a" (VMX_VMCALL_YIELD)
+			     : "memory");
+}
@@ -0,0 +1,17 @@
+#ifndef JOS_KERN_PV_H
+#define JOS_KERN_PV_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// VMX_PV_* features the JOS hypervisor offers us; 0 on bare metal or
+// under another hypervisor.
+extern uint32_t pv_features;
+
+void pv_init(void);
+void pv_yield(void);
+bool pv_steal_clock(uint64_t *steal, uint64_t *tsc_khz);
+
+#endif /* JOS_KERN_PV_H */
@@ -3,6 +3,7 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/pv.h>
 
 // Choose a user environment to run and run it.
     void
@@ -11,6 +12,10 @@ sched_yield(void)
     struct Env *idle;
     int i;
 
+    // Whoever runs next, curenv has given up the CPU at least once.
+    if (curenv)
+        curenv->env_tick_kept = 0;
+
     // Implement simple round-robin scheduling.
     //
     // Search through 'envs' for an ENV_RUNNABLE environment in
@@ -63,6 +68,8 @@ sched_yield(void)
     }
 
     // Run this CPU's idle environment when nothing else is runnable.
+    // Under the JOS hypervisor, let other guests have the CPU first.
+    pv_yield();
     idle = &envs[cpunum()];
     if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
         panic("CPU %d: No idle environment!", cpunum());
@@ -12,6 +12,9 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/kclock.h>
+#include <inc/vmx.h>
+#include <inc/vmbench.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -456,6 +459,173 @@ sys_time_msec(void)
     panic("sys_time_msec not implemented");
 }
 
+// Time 'iters' iterations of the VM-exit primitive 'op' (a VMBENCH_*
+// constant) with RDTSC and store the result in *res.  These run here
+// because RDMSR and port I/O are privileged.
+//
+// For VMBENCH_EPT_FAULT every iteration writes to a different page.  The
+// pages are taken from the end of the free list, which the allocator
+// reaches last, so the host has almost certainly not backed them yet;
+// pages below PTSIZE are skipped since boot-time checks scribble on them.
+// Fewer than 'iters' samples are taken if there are not enough such pages.
+//
+// Returns 0 on success, -E_INVAL if op is unknown or iters is not positive.
+    static int
+sys_vmbench(int op, int iters, struct vmbench_result *res)
+{
+    struct vmbench_result r;
+    struct Page *pp, *held = NULL;
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t t0, t1;
+    int i;
+
+    if (op < 0 || op >= NVMBENCH || iters <= 0)
+        return -E_INVAL;
+    user_mem_assert(curenv, res, sizeof(*res), PTE_U | PTE_W);
+
+    // Grab every free page; the last ones taken are the coldest.
+    if (op == VMBENCH_EPT_FAULT)
+        while ((pp = page_alloc(0)) != NULL) {
+            pp->pp_link = held;
+            held = pp;
+        }
+
+    vmbench_init(&r);
+    pp = held;
+    for (i = 0; i < iters; i++) {
+        switch (op) {
+        case VMBENCH_NULL:
+            t0 = read_tsc();
+            t1 = read_tsc();
+            break;
+        case VMBENCH_CPUID:
+            t0 = read_tsc();
+            cpuid(0, &eax, &ebx, &ecx, &edx);
+            t1 = read_tsc();
+            break;
+        case VMBENCH_VMCALL:
+            t0 = read_tsc();
+            asm volatile("vmcall" : "=a" (eax) : "a" (VMX_VMCALL_NOP)
+                         : "cc", "memory");
+            t1 = read_tsc();
+            break;
+        case VMBENCH_RDMSR:
+            t0 = read_tsc();
+            read_msr(EFER_MSR);
+            t1 = read_tsc();
+            break;
+        case VMBENCH_IO:
+            t0 = read_tsc();
+            outb(IO_RTC, NVRAM_BASELO);
+            t1 = read_tsc();
+            break;
+        case VMBENCH_EPT_FAULT:
+            while (pp && page2pa(pp) < PTSIZE)
+                pp = pp->pp_link;
+            if (!pp)
+                goto out;
+            t0 = read_tsc();
+            *(volatile char *) page2kva(pp) = 0;
+            t1 = read_tsc();
+            pp = pp->pp_link;
+            break;
+        }
+        vmbench_sample(&r, t1 - t0);
+    }
+
+out:
+    while ((pp = held) != NULL) {
+        held = pp->pp_link;
+        page_free(pp);
+    }
+    *res = r;
+    return 0;
+}
+
+// Guest pages given to the host's shared memory objects (see inc/vmx.h).
+// The host backs them with the object's pages, so the kernel keeps them
+// for good rather than let them return to the free list.
+static struct Page *vmshm_pages[VMX_SHM_PORTS][VMX_SHM_MAX_PAGES];
+
+    static int64_t
+vmshm_vmcall(int op, uint64_t port, uint64_t a1, uint64_t a2)
+{
+    int64_t r;
+
+    asm volatile("vmcall"
+                 : "=a" (r)
+                 : "a" (op), "d" (port), "c" (a1), "b" (a2)
+                 : "cc", "memory");
+    return r;
+}
+
+// Map the host shared memory object bound to port at va in the current
+// environment with perm, which is checked as for sys_page_alloc.  The
+// first attach of a port hands the host the guest pages to back with the
+// object.
+//
+// Returns the size of the object in pages, or < 0 on error.  Errors are:
+//	-E_INVAL if port is out of range, va is not page-aligned, the object
+//		does not fit below UTOP at va, or perm is inappropriate.
+//	-E_NO_ENT if the host bound nothing to port.
+//	-E_NO_MEM if there's no memory for a page or a page table.
+    static int
+sys_vmshm_attach(int port, void *va, int perm)
+{
+    int64_t npages, i, r;
+    struct Page *pp;
+
+    if (port < 0 || port >= VMX_SHM_PORTS)
+        return -E_INVAL;
+    if ((uint64_t) va % PGSIZE != 0 || (uint64_t) va >= UTOP)
+        return -E_INVAL;
+    if ((perm & (PTE_U|PTE_P)) != (PTE_U|PTE_P) ||
+        perm & ~(PTE_P|PTE_U|PTE_AVAIL|PTE_W))
+        return -E_INVAL;
+    if ((npages = vmshm_vmcall(VMX_VMCALL_SHM_INFO, port, 0, 0)) < 0)
+        return npages;
+    if (npages > (UTOP - (uint64_t) va) / PGSIZE)
+        return -E_INVAL;
+
+    for (i = 0; i < npages; i++) {
+        if (!(pp = vmshm_pages[port][i])) {
+            if (!(pp = page_alloc(0)))
+                return -E_NO_MEM;
+            if ((r = vmshm_vmcall(VMX_VMCALL_SHM_MAP, port, i,
+                                  page2pa(pp))) < 0) {
+                page_free(pp);
+                return r;
+            }
+            pp->pp_ref++;
+            vmshm_pages[port][i] = pp;
+        }
+        if ((r = page_insert(curenv->env_pml4e, pp,
+                             (char *) va + i * PGSIZE, perm)) < 0)
+            return r;
+    }
+    return npages;
+}
+
+// Signal the other guests sharing the object on port.
+// Returns the number of guest ports signalled, or -E_NO_ENT if the host
+// bound nothing to port.
+    static int
+sys_vmshm_notify(int port)
+{
+    return vmshm_vmcall(VMX_VMCALL_SHM_NOTIFY, port, 0, 0);
+}
+
+// Take a signal from the guests sharing the object on port.  With block
+// set, the whole guest stops until one arrives, so only a guest with
+// nothing else to run should block.
+// Returns 1 if a signal was taken, 0 if none was pending and block is
+// clear, or -E_NO_ENT if the host bound nothing to port.
+    static int
+sys_vmshm_wait(int port, bool block)
+{
+    return vmshm_vmcall(VMX_VMCALL_SHM_WAIT, port, block, 0);
+}
+
 
 // Dispatches to the correct kernel function, passing the arguments.
     int64_t
@@ -497,6 +667,14 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 			return sys_ipc_try_send((envid_t) a1, (uint32_t) a2, (void *) a3, (unsigned) a4);
 		case SYS_time_msec:
 			return sys_time_msec();
+		case SYS_vmbench:
+			return sys_vmbench((int) a1, (int) a2, (struct vmbench_result *) a3);
+		case SYS_vmshm_attach:
+			return sys_vmshm_attach((int) a1, (void *) a2, (int) a3);
+		case SYS_vmshm_notify:
+			return sys_vmshm_notify((int) a1);
+		case SYS_vmshm_wait:
+			return sys_vmshm_wait((int) a1, (bool) a2);
 
 		default:
 			return -E_INVAL;
@@ -1,8 +1,15 @@
 #include <kern/time.h>
+#include <kern/pv.h>
 #include <inc/assert.h>
 
 static unsigned int ticks;
 
+// Time the hypervisor ran something else while we were runnable, in ms:
+// in all, and in the interval that ended with the last tick.
+static unsigned int steal_ms;
+static unsigned int tick_steal_ms;
+static uint64_t steal_last;	// Steal clock accounted for, in TSC cycles
+
 void
 time_init(void)
 {
@@ -14,9 +21,18 @@ time_init(void)
 void
 time_tick(void)
 {
+	uint64_t steal, khz;
+
 	ticks++;
 	if (ticks * 10 < ticks)
 		panic("time_tick: time overflowed");
+
+	tick_steal_ms = 0;
+	if (pv_steal_clock(&steal, &khz) && khz) {
+		tick_steal_ms = (steal - steal_last) / khz;
+		steal_ms += tick_steal_ms;
+		steal_last += (uint64_t) tick_steal_ms * khz;
+	}
 }
 
 unsigned int
@@ -24,3 +40,18 @@ time_msec(void)
 {
 	return ticks * 10;
 }
+
+// Milliseconds stolen by the hypervisor since boot.
+unsigned int
+time_steal_msec(void)
+{
+	return steal_ms;
+}
+
+// Was most of the last tick stolen?  The env that was running then has
+// hardly run at all.
+bool
+time_tick_stolen(void)
+{
+	return tick_steal_ms * 2 >= 10;
+}
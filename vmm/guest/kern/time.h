@@ -4,8 +4,12 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
+unsigned int time_steal_msec(void);
+bool time_tick_stolen(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -274,7 +274,17 @@ trap_dispatch(struct Trapframe *tf)
 		// triggered on every CPU. 								WHY HAS HE LEFT THIS CRYPTIC COMMENT? WHEN IT TRAPS WE ALREADY HAVE LOCK.
 		// LAB 6: Your code here.
 		time_tick();
-		
+
+		// Under the JOS hypervisor, an env that lost most of its
+		// tick to other guests keeps the CPU for another one, but
+		// only one in a row, or a busy host would starve the rest.
+		if (time_tick_stolen() && curenv &&
+		    curenv->env_type != ENV_TYPE_IDLE &&
+		    curenv->env_status == ENV_RUNNING &&
+		    !curenv->env_tick_kept) {
+			curenv->env_tick_kept = 1;
+			return;
+		}
 		sched_yield();
 		return;
 	}
@@ -88,103 +88,113 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 
 #ifdef VMM_GUEST
 
-// Access to host IPC interface through VMCALL.
-// Should behave similarly to ipc_recv, except replacing the system call with a vmcall.
-int32_t
-ipc_host_recv(void *pg) {
-    // LAB 4: Your code here.
-    //If pg is NULL, then set pg to something that sys_ipc_rev can decode
-        if (pg == NULL)
-                pg=(void*)UTOP;
-
-        //Try receiving value
-                int num = VMX_VMCALL_IPCRECV;
-        int r;
-
-
-      pte_t pte = 0;
+// Host IPC.  Messages from host envs arrive asynchronously: a receive is
+// posted with VMX_VMCALL_IPCRECV and returns at once, and the host later
+// fills in host_mbox and sets its 'done' flag.  Until then the guest is
+// free to run other environments.
+static struct vmx_ipc_mailbox host_mbox;
+
+// Return the guest physical address backing va, which must be mapped.
+static uint64_t
+guest_pa(const void *va)
+{
+    return PTE_ADDR(vpt[VPN(va)]) + PGOFF(va);
+}
 
-       uint64_t addr = 0;
+// Post a receive for the next message from a host env, without waiting.
+// If 'pg' is nonnull, a page sent by the host will be mapped there.
+// Use ipc_host_recv_poll() or ipc_host_recv_wait() to collect the message.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BUSY if another receive is already outstanding in this guest.
+int
+ipc_host_recv_start(void *pg)
+{
+    uint64_t dst = ~0ULL;
+    int r;
 
-        if((vpml4e[VPML4E(pg)] & PTE_P) && (vpde[VPDPE(pg)] & PTE_P)
-                        && (vpd[VPD(pg)] & PTE_P) && (vpt[VPN(pg)] & PTE_P))
-       {}
-	else
-        {
-           if((r = sys_page_alloc(0, pg , PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		return r;
+    if (pg != NULL) {
+        if (!((vpml4e[VPML4E(pg)] & PTE_P) && (vpde[VPDPE(pg)] & PTE_P) &&
+              (vpd[VPD(pg)] & PTE_P) && (vpt[VPN(pg)] & PTE_P)))
+            if ((r = sys_page_alloc(0, pg, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+                return r;
+        dst = guest_pa(pg);
+    }
 
-	 }
+    // Writing the mailbox also makes sure its page is present.
+    host_mbox.done = 0;
+    asm volatile("vmcall"
+                 : "=a" (r)
+                 : "a" (VMX_VMCALL_IPCRECV), "d" (dst),
+                   "b" (guest_pa(&host_mbox))
+                 : "cc", "memory");
+    return r;
+}
 
-          pte = (vpt[((uint64_t) pg/ PGSIZE)]);     
-          addr = PTE_ADDR(pte);
+// Check whether the receive posted by ipc_host_recv_start() has completed.
+// Returns 1 and stores the message value in *value if it has, 0 if not.
+int
+ipc_host_recv_poll(int32_t *value)
+{
+    if (!host_mbox.done)
+        return 0;
+    if (value)
+        *value = host_mbox.value;
+    return 1;
+}
 
-         int a1 = (uint64_t) addr ;
+// Wait for the receive posted by ipc_host_recv_start() and return the
+// value sent.  Each time round, the whole guest gives its time slice back
+// to the hypervisor, so the sending host env gets to run.
+int32_t
+ipc_host_recv_wait(void)
+{
+    int32_t value;
+    uint64_t r;
+
+    while (!ipc_host_recv_poll(&value))
+        asm volatile("vmcall"
+                     : "=a" (r)
+                     : "a" (VMX_VMCALL_YIELD)
+                     : "cc", "memory");
+    return value;
+}
 
-        
-        asm volatile("vmcall \n\t"
-                     : "=a"(r)
-                     :"a"(num),
-                     "d"(a1)
-            : "cc", "memory");
+// Receive a value from a host env and return it, like ipc_recv().
+// Callers expecting a reply to ipc_host_send() should rather post the
+// receive first, so the host env does not have to wait for it.
+int32_t
+ipc_host_recv(void *pg)
+{
+    int r;
 
-  
-     return r;
+    while ((r = ipc_host_recv_start(pg)) == -E_BUSY)
+        sys_yield();
+    if (r < 0)
+        return r;
+    return ipc_host_recv_wait();
 }
 
-// Access to host IPC interface through VMCALL.
-// Should behave similarly to ipc_send, except replacing the system call with a vmcall.
+// Send a value (and optionally a page) to a host env through VMCALL, like
+// ipc_send().  VMX_HOST_FS_ENV names the host file server.
 void
 ipc_host_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
-    // LAB 8: Your code here.
-    if (pg == NULL)
-        pg=(void*)UTOP;
-
-     //volatile struct Env *env;
-
-   // env = &envs[ENVX(to_env)];
-
-    pte_t pte = (vpt[((uint64_t) pg/ PGSIZE)]);       
-    uint64_t addr = PTE_ADDR(pte );
-
+    uint64_t src = pg ? guest_pa(pg) : ~0ULL;
+    int r;
 
     while (1) {
-        int num = VMX_VMCALL_IPCSEND;
-        int r;
-        int a1 = (uint64_t) to_env;
-        int a2 = (uint64_t) val;
-        int a3 = (uint64_t) addr;
-        int a4 = (uint64_t) perm;
-        
-        asm volatile("vmcall \n\t"
-                     : "=a"(r)
-                     :"a"(num),
-                     "d"(a1),
-                     "c"(a2),
-                     "b"(a3),
-                     "D" (a4)
-            : "cc", "memory");
-
+        asm volatile("vmcall"
+                     : "=a" (r)
+                     : "a" (VMX_VMCALL_IPCSEND), "d" (to_env), "c" (val),
+                       "b" (src), "D" (perm)
+                     : "cc", "memory");
         if (r == 0)
-	  {
-	     	// env->env_ipc_recving = 0;
-              // env->env_ipc_value = val;
-               //env->env_ipc_from = ipc_find_env(ENV_TYPE_FS);
-               //env->env_ipc_perm = perm;
-
-		//int r = sys_ipc_try_send(to_env, val, pg, perm);
-
-               break;
-         }
-        if (r < 0 && r != -E_IPC_NOT_RECV)
-            panic("error in vmcall_ipc_try_send %e\n", r);
-        else if (r == -E_IPC_NOT_RECV){
-            sys_yield();
-        }
+            break;
+        if (r != -E_IPC_NOT_RECV)
+            panic("ipc_host_send: %e", r);
+        sys_yield();
     }
-
-    //panic("ipc_send not implemented in VM guest");
 }
 
 #endif
@@ -123,3 +123,27 @@ sys_time_msec(void)
     return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+
+    int
+sys_vmbench(int op, int iters, struct vmbench_result *res)
+{
+    return syscall(SYS_vmbench, 0, op, iters, (uint64_t) res, 0, 0);
+}
+
+    int
+sys_vmshm_attach(int port, void *va, int perm)
+{
+    return syscall(SYS_vmshm_attach, 0, port, (uint64_t) va, perm, 0, 0);
+}
+
+    int
+sys_vmshm_notify(int port)
+{
+    return syscall(SYS_vmshm_notify, 0, port, 0, 0, 0, 0);
+}
+
+    int
+sys_vmshm_wait(int port, bool block)
+{
+    return syscall(SYS_vmshm_wait, 0, port, block, 0, 0, 0);
+}
@@ -0,0 +1,79 @@
+// VMX microbenchmarks, run inside a guest.
+//
+// usage: vmbench [iterations]
+//
+// Times the VM exits the hypervisor handles most often, plus a round trip
+// to the host file server, and prints one "vmbench:" line per primitive
+// (see inc/vmbench.h).  Subtract guest.null from the other numbers to get
+// the cost of the primitive itself.
+
+#include <inc/lib.h>
+#include <inc/vmx.h>
+#include <inc/x86.h>
+
+#define DEFAULT_ITERS	10000
+
+static const char * const names[NVMBENCH] = {
+	[VMBENCH_NULL] = "null",
+	[VMBENCH_CPUID] = "cpuid",
+	[VMBENCH_VMCALL] = "vmcall",
+	[VMBENCH_RDMSR] = "rdmsr",
+	[VMBENCH_IO] = "io",
+	[VMBENCH_EPT_FAULT] = "eptfault",
+};
+
+static union Fsipc ipcbuf __attribute__((aligned(PGSIZE)));
+
+static void
+report(const char *name, struct vmbench_result *r)
+{
+	if (r->iters == 0) {
+		cprintf("vmbench: guest.%s iters=0\n", name);
+		return;
+	}
+	cprintf("vmbench: guest.%s iters=%ld min=%ld avg=%ld max=%ld\n",
+		name, r->iters, r->min, r->total / r->iters, r->max);
+}
+
+// A request the host file server rejects straight away, so the round trip
+// is all IPC and VM-exit cost.
+static void
+bench_hostipc(int iters, struct vmbench_result *r)
+{
+	uint64_t t0, t1;
+	int i;
+
+	vmbench_init(r);
+	for (i = 0; i < iters; i++) {
+		ipcbuf.flush.req_fileid = ~0U;
+		t0 = read_tsc();
+		ipc_host_send(VMX_HOST_FS_ENV, FSREQ_FLUSH, &ipcbuf,
+			      PTE_P | PTE_W | PTE_U);
+		ipc_host_recv(NULL);
+		t1 = read_tsc();
+		vmbench_sample(r, t1 - t0);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct vmbench_result r;
+	int iters = DEFAULT_ITERS;
+	int op, err;
+
+	binaryname = "vmbench";
+
+	if (argc > 1 && (iters = strtol(argv[1], NULL, 0)) <= 0) {
+		cprintf("usage: vmbench [iterations]\n");
+		exit();
+	}
+
+	for (op = 0; op < NVMBENCH; op++) {
+		if ((err = sys_vmbench(op, iters, &r)) < 0)
+			panic("sys_vmbench %s: %e", names[op], err);
+		report(names[op], &r);
+	}
+	bench_hostipc(iters, &r);
+	report("hostipc", &r);
+}
@@ -0,0 +1,168 @@
+
+#include <vmm/vmchan.h>
+
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <vmm/ept.h>
+
+// Kernel side of the exitless I/O channel; see inc/vmchan.h.  The kernel
+// only introduces the two parties: it records the guest's ring, lets the
+// backend map the ring and the guest's buffers, and carries the doorbell.
+
+// Look up a guest on behalf of its backend, which must be its parent.
+static int
+chan_guest( envid_t guest, struct Env **ge ) {
+    int r;
+
+    if( ( r = envid2env( guest, ge, 1 ) ) < 0 )
+        return r;
+    if( (*ge)->env_type != ENV_TYPE_GUEST )
+        return -E_INVAL;
+    return 0;
+}
+
+// Register the page at gpa as guest e's channel ring.  The page stays
+// pinned, out of the pager's reach, until the guest is freed.
+//
+// Returns 0 on success, or
+//	-E_BUSY if e already has a ring.
+//	-E_INVAL if gpa is not a resident, page-aligned page of guest RAM.
+//	-E_NO_MEM if the page was shared and could not be copied.
+int
+vmchan_setup( struct Env *e, uint64_t gpa ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    void *hva;
+
+    if( ginfo->chan_ring )
+        return -E_BUSY;
+    if( gpa == 0 || gpa % PGSIZE || !guest_gpa_is_ram( ginfo, gpa ) )
+        return -E_INVAL;
+    // The backend writes completions into the ring.
+    if( ept_cow( e->env_pml4e, gpa ) < 0 )
+        return -E_NO_MEM;
+    ept_gpa2hva( e->env_pml4e, (void *) gpa, &hva );
+    if( !hva )
+        return -E_INVAL;
+
+    pa2page( PADDR( hva ) )->pp_ref++;
+    ginfo->chan_ring = gpa;
+    ginfo->chan_ring_kva = hva;
+    // The backend may be waiting for the ring to appear.
+    vmchan_kick( e );
+    return 0;
+}
+
+// Ring guest e's doorbell: wake its backend, or remember the kick if the
+// backend is not waiting yet.
+void
+vmchan_kick( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct Env *w;
+
+    if( ginfo->chan_waiter &&
+        envid2env( ginfo->chan_waiter, &w, 0 ) == 0 &&
+        w->env_status == ENV_NOT_RUNNABLE ) {
+        ginfo->chan_waiter = 0;
+        env_set_status( w, ENV_RUNNABLE );
+        return;
+    }
+    ginfo->chan_waiter = 0;
+    ginfo->chan_kicked = 1;
+}
+
+// Guest e is going away: unpin its ring and wake its backend, whose next
+// vmchan_wait() then fails.
+void
+vmchan_release( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+
+    if( ginfo->chan_ring_kva )
+        page_decref( pa2page( PADDR( ginfo->chan_ring_kva ) ) );
+    ginfo->chan_ring = 0;
+    ginfo->chan_ring_kva = NULL;
+    vmchan_kick( e );
+}
+
+// Block until guest rings its doorbell.  Returns at once if it already
+// has since the last call.
+//
+// Returns 0 when woken, or
+//	-E_BAD_ENV if guest does not exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest.
+int
+vmchan_wait( envid_t guest ) {
+    struct Env *ge;
+    int r;
+
+    if( ( r = chan_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( ge->env_vmxinfo.chan_kicked ) {
+        ge->env_vmxinfo.chan_kicked = 0;
+        return 0;
+    }
+    ge->env_vmxinfo.chan_waiter = curenv->env_id;
+    env_set_status( curenv, ENV_NOT_RUNNABLE );
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    sched_yield();
+}
+
+// Map guest's channel ring read/write at va in the caller.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if guest does not exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, or va is not page-aligned or
+//		is above UTOP.
+//	-E_NO_ENT if the guest has not set up a ring yet.
+//	-E_NO_MEM if a page table could not be allocated.
+int
+vmchan_attach( envid_t guest, void *va ) {
+    struct Env *ge;
+    int r;
+
+    if( ( r = chan_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( (uintptr_t) va % PGSIZE || (uintptr_t) va >= UTOP )
+        return -E_INVAL;
+    if( !ge->env_vmxinfo.chan_ring )
+        return -E_NO_ENT;
+    return page_insert( curenv->env_pml4e,
+                        pa2page( PADDR( ge->env_vmxinfo.chan_ring_kva ) ),
+                        va, PTE_P | PTE_U | PTE_W );
+}
+
+// Map the guest page at gpa at va in the caller with perm, which may
+// contain PTE_P, PTE_U and PTE_W.  The mapping holds a reference, so the
+// pager leaves the page alone until the caller unmaps it.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if guest does not exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, gpa is not a page of guest RAM,
+//		va is not page-aligned or is above UTOP, or perm is bad.
+//	-E_NO_ENT if the page is not resident.
+//	-E_NO_MEM if a page table could not be allocated, or perm has PTE_W
+//		and the page was shared and could not be copied.
+int
+vmchan_map( envid_t guest, uint64_t gpa, void *va, int perm ) {
+    struct Env *ge;
+    void *hva;
+    int r;
+
+    if( ( r = chan_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( gpa % PGSIZE || !guest_gpa_is_ram( &ge->env_vmxinfo, gpa ) )
+        return -E_INVAL;
+    if( (uintptr_t) va % PGSIZE || (uintptr_t) va >= UTOP )
+        return -E_INVAL;
+    if( ( perm & ( PTE_P | PTE_U ) ) != ( PTE_P | PTE_U ) ||
+        ( perm & ~( PTE_P | PTE_U | PTE_W ) ) )
+        return -E_INVAL;
+
+    if( ( perm & PTE_W ) && ept_cow( ge->env_pml4e, gpa ) < 0 )
+        return -E_NO_MEM;
+    ept_gpa2hva( ge->env_pml4e, (void *) gpa, &hva );
+    if( !hva )
+        return -E_NO_ENT;
+    return page_insert( curenv->env_pml4e, pa2page( PADDR( hva ) ), va, perm );
+}
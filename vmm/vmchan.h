@@ -0,0 +1,19 @@
+#ifndef JOS_VMM_VMCHAN_H
+#define JOS_VMM_VMCHAN_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/vmchan.h>
+#include <kern/env.h>
+
+int vmchan_setup( struct Env *e, uint64_t gpa );
+void vmchan_kick( struct Env *e );
+void vmchan_release( struct Env *e );
+
+int vmchan_wait( envid_t guest );
+int vmchan_attach( envid_t guest, void *va );
+int vmchan_map( envid_t guest, uint64_t gpa, void *va, int perm );
+
+#endif /* !JOS_VMM_VMCHAN_H */
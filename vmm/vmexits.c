@@ -3,6 +3,10 @@
 #include <inc/error.h>
 #include <vmm/vmexits.h>
 #include <vmm/ept.h>
+#include <vmm/vmpager.h>
+#include <vmm/vmchan.h>
+#include <vmm/vmmio.h>
+#include <vmm/vmshm.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
 #include <kern/pmap.h>
@@ -12,7 +16,11 @@
 #include <inc/string.h>
 #include <kern/syscall.h>
 #include <kern/env.h>
+#include <kern/trap.h>
+#include <kern/sched.h>
 
+// Low mem, the ISA hole, mem below 3 GB, the 32-bit hole and high mem.
+#define E820_MAX_ENTRIES 5
 
 bool
 find_msr_in_region(uint32_t msr_idx, uintptr_t *area, int area_sz, struct vmx_msr_entry **msr_entry) {
@@ -27,18 +35,47 @@ find_msr_in_region(uint32_t msr_idx, uintptr_t *area, int area_sz, struct vmx_ms
     return false;
 }
 
+// The guest's EFER: in its VMCS field if the CPU switches EFER through
+// the entry and exit controls, else in the guest MSR area.
+static uint64_t
+guest_efer(struct VmxGuestInfo *ginfo) {
+    struct vmx_msr_entry *entry;
+    bool r;
+
+    if(vmx_efer_ctls_supported())
+        return vmcs_read64(VMCS_64BIT_GUEST_IA32_EFER);
+    r = find_msr_in_region(EFER_MSR, ginfo->msr_guest_area, ginfo->msr_count, &entry);
+    assert(r);
+    return entry->msr_value;
+}
+
+static void
+guest_set_efer(struct VmxGuestInfo *ginfo, uint64_t val) {
+    struct vmx_msr_entry *entry;
+    bool r;
+
+    if(vmx_efer_ctls_supported()) {
+        // LMA is read-only to the guest.  The entry checks want it to
+        // match the IA-32e mode control, which exits keep up to date.
+        val &= ~(1ULL << EFER_LMA);
+        if(vmcs_read32(VMCS_32BIT_CONTROL_VMENTRY_CONTROLS) & VMCS_VMENTRY_x64_GUEST)
+            val |= 1ULL << EFER_LMA;
+        vmcs_write64(VMCS_64BIT_GUEST_IA32_EFER, val);
+        return;
+    }
+    r = find_msr_in_region(EFER_MSR, ginfo->msr_guest_area, ginfo->msr_count, &entry);
+    assert(r);
+    entry->msr_value = val;
+}
+
 bool
 handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
     uint64_t msr = tf->tf_regs.reg_rcx;
     if(msr == EFER_MSR) {
         // TODO: setup msr_bitmap to ignore EFER_MSR
-        uint64_t val;
-        struct vmx_msr_entry *entry;
-        bool r = find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-        assert(r);
-        val = entry->msr_value;
+        uint64_t val = guest_efer(ginfo);
 
-        tf->tf_regs.reg_rdx = val << 32;
+        tf->tf_regs.reg_rdx = val >> 32;
         tf->tf_regs.reg_rax = val & 0xFFFFFFFF;
 
         tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
@@ -52,25 +89,16 @@ bool
 handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
     uint64_t msr = tf->tf_regs.reg_rcx;
     if(msr == EFER_MSR) {
+        uint64_t cur_val = guest_efer(ginfo);
+        uint64_t new_val = (tf->tf_regs.reg_rdx << 32)|(tf->tf_regs.reg_rax & 0xFFFFFFFF);
 
-        uint64_t cur_val, new_val;
-        struct vmx_msr_entry *entry;
-        bool r = 
-            find_msr_in_region(msr, ginfo->msr_guest_area, ginfo->msr_count, &entry);
-        assert(r);
-        cur_val = entry->msr_value;
-
-        new_val = (tf->tf_regs.reg_rdx << 32)|tf->tf_regs.reg_rax;
         if(BIT(cur_val, EFER_LME) == 0 && BIT(new_val, EFER_LME) == 1) {
             // Long mode enable.
             uint32_t entry_ctls = vmcs_read32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS );
-            entry_ctls |= VMCS_VMENTRY_x64_GUEST;
             vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS, 
-                    entry_ctls );
-
+                    entry_ctls | VMCS_VMENTRY_x64_GUEST );
         }
-
-        entry->msr_value = new_val;
+        guest_set_efer(ginfo, new_val);
         tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
         return true;
     }
@@ -78,37 +106,101 @@ handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
     return false;
 }
 
+// The guest touched gpa, a page of its RAM with no host page mapped for
+// the access; write is set for a store.  Back the page, or block the guest
+// until the pager can.
+// Returns false if the page cannot be backed.
 bool
-handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo) {
-    uint64_t gpa = vmcs_read64(VMCS_64BIT_GUEST_PHYSICAL_ADDR);
+guest_ram_fault(uint64_t *eptrt, uint64_t gpa, bool write) {
+    // Guest RAM is backed lazily: a host page (and any missing EPT
+    // levels) is only allocated on first touch, so a large, sparse
+    // guest costs just the memory it uses.  Until the guest writes a
+    // page, the shared zero page stands in for it.  Pages the host
+    // pager wrote out are read back in before the guest runs again.
+    epte_t *epte = epml4e_walk(eptrt, (void *)gpa, 0);
     int r;
-    if(gpa < 0xA0000 || (gpa >= 0x100000 && gpa < ginfo->phys_sz)) {
-        // Allocate a new page to the guest.
-        struct Page *p = page_alloc(0);
-      
-       
-  
-      if(!p)
-            return false;
-        p->pp_ref += 1;
-        r = ept_map_hva2gpa(eptrt, 
-                page2kva(p), (void *)ROUNDDOWN(gpa, PGSIZE), __EPTE_FULL, 0);
+    if(epte && (*epte & __EPTE_SWAPPED))
+        return vmpager_fault(curenv, gpa, epte);
+    if(epte && (*epte & __EPTE_COW) && write) {
+        if(ept_cow(eptrt, gpa) < 0)
+            return vmpager_nomem(curenv, gpa);
+        vmpager_check_memory();
+        return true;
+    }
+    if(!write && ept_map_zero(eptrt, gpa) == 0)
+        return true;
 
-        
-        assert(r >= 0);
-   
-    //  cprintf("EPT violation for gpa:%x mapped KVA:%x\n", gpa, page2kva(p));
-        
+    struct Page *p = page_alloc(ALLOC_ZERO);
+    if(!p)
+        return vmpager_nomem(curenv, gpa);
+    p->pp_ref += 1;
+    r = ept_map_hva2gpa(eptrt, 
+            page2kva(p), (void *)ROUNDDOWN(gpa, PGSIZE), __EPTE_FULL, 0);
+    if(r < 0) {
+        page_decref(p);
+        return false;
+    }
+    vmpager_check_memory();
 
-        return true;
+//  cprintf("EPT violation for gpa:%x mapped KVA:%x\n", gpa, page2kva(p));
+
+    return true;
+}
+
+bool
+handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo) {
+    uint64_t gpa = vmcs_read64(VMCS_64BIT_GUEST_PHYSICAL_ADDR);
+    uint64_t qual = vmcs_read64(VMCS_VMEXIT_QUALIFICATION);
+    int r;
+    if(guest_gpa_is_ram(ginfo, gpa)) {
+        return guest_ram_fault(eptrt, gpa, qual & VMX_EPT_FAULT_WRITE);
     } else if (gpa >= CGA_BUF && gpa < CGA_BUF + PGSIZE) {
         // FIXME: This give direct access to VGA MMIO region.
         r = ept_map_hva2gpa(eptrt, 
                 (void *)(KERNBASE + CGA_BUF), (void *)CGA_BUF, __EPTE_FULL, 0);
         assert(r >= 0);
+        // Like any EPT leaf, this one holds a page reference, which
+        // ept_unmap_range() and guest teardown drop again.
+        pa2page(CGA_BUF)->pp_ref++;
         return true;
     } 
-    return false;
+    // Anything else is emulated MMIO, if a device model claimed it.
+    return vmmio_fault(curenv, gpa);
+}
+
+// A host interrupt arrived while the guest ran.  The exit acknowledged it,
+// so dispatch its vector through the host trap path as if it had come in
+// while a host env ran: a timer tick counts time and reschedules without
+// returning here.
+bool
+handle_extint(struct Trapframe *tf) {
+    uint32_t info = vmcs_read32(VMCS_32BIT_VMEXIT_INTERRUPTION_INFO);
+
+    if(!BIT(info, 31))
+        return true;
+    tf->tf_trapno = info & 0xFF;
+    trap_dispatch(tf);
+    return true;
+}
+
+// The guest has been spinning in a PAUSE loop for longer than the PLE
+// window, most likely on a lock held by a vCPU or env that is not running.
+// Spinning on would only burn the rest of its slice: give the CPU to
+// someone else instead.
+bool
+handle_pause(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
+    ginfo->pause_exits++;
+    sched_guest_yield(curenv);
+    tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+    return true;
+}
+
+// The CMOS extended memory size is a 16-bit count of KB above 1 MB; like a
+// real BIOS, report at most 0xFFFF and leave the rest to the e820 map.
+static uint32_t
+nvram_extmem_kb(struct VmxGuestInfo *ginfo) {
+    uint64_t kb = (guest_lowmem_end(ginfo) - EXTPHYSMEM) / 1024;
+    return MIN(kb, 0xFFFF);
 }
 
 bool
@@ -120,6 +212,10 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
     bool is_in = BIT(qualification, 3);
     bool handled = false;
 
+    // Other ports belong to device models, which also take string I/O.
+    if(port_number != IO_RTC && port_number != IO_RTC + 1)
+        return vmmio_pio(curenv, qualification);
+
     // handle reading physical memory from the CMOS.
     if(port_number == IO_RTC) {
         if(!is_in) {
@@ -135,10 +231,10 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
                 tf->tf_regs.reg_rax = (640 >> 8) & 0xFF;
                 handled = true;
             } else if (port_iortc == NVRAM_EXTLO) {
-                tf->tf_regs.reg_rax = ((ginfo->phys_sz / 1024) - 1024) & 0xFF;
+                tf->tf_regs.reg_rax = nvram_extmem_kb(ginfo) & 0xFF;
                 handled = true;
             } else if (port_iortc == NVRAM_EXTHI) {
-                tf->tf_regs.reg_rax = (((ginfo->phys_sz / 1024) - 1024) >> 8) & 0xFF;
+                tf->tf_regs.reg_rax = (nvram_extmem_kb(ginfo) >> 8) & 0xFF;
                 handled = true;
             }
         }
@@ -154,27 +250,183 @@ handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo) {
     }
 }
 
-// Emulate a cpuid instruction.
-// It is sufficient to issue the cpuid instruction here and collect the return value.
-// You can store the output of the instruction in Trapframe tf,
-//  but you should hide the presence of vmx from the guest if processor features are requested.
+// CPUID.1:ECX.OSXSAVE mirrors the guest's CR4, so it can't be precomputed.
+#define CPUID_1_ECX_OSXSAVE ( 1U << 27 )
+
+// Leaves whose output depends on the subleaf in ecx, and how many subleaves
+// of each are worth asking the host about.
+static const uint32_t cpuid_indexed_leaves[] = {
+    0x4, 0x7, 0xB, 0xD, 0xF, 0x10, 0x12, 0x14, 0x17, 0x18, 0x1F
+};
+#define CPUID_NINDEXED ( sizeof(cpuid_indexed_leaves) / sizeof(cpuid_indexed_leaves[0]) )
+#define CPUID_MAX_SUBLEAF 64
+
+// Leaves that enumerate topology levels.  Past the last level they return
+// the subleaf in ecx[7:0], level type 0 in ecx[15:8] and the x2APIC ID in
+// edx, rather than zeros.
+#define CPUID_IS_TOPOLOGY( function ) ( ( function ) == 0xB || ( function ) == 0x1F )
+#define CPUID_TOPOLOGY_LEVEL_TYPE( ecx ) ( ( ( ecx ) >> 8 ) & 0xff )
+
+// Return the index of the first entry of t that sorts at or after
+// (function, index).  Entries are sorted by function, then by index; a
+// VMX_CPUID_ANY_INDEX entry is the only one for its function.
+static int
+cpuid_search( struct vmx_cpuid_table *t, uint32_t function, uint32_t index ) {
+    int lo = 0, hi = t->nent, mid;
+    struct vmx_cpuid_entry *e;
+
+    while( lo < hi ) {
+        mid = ( lo + hi ) / 2;
+        e = &t->ent[mid];
+        if( e->function < function ||
+            ( e->function == function && e->index < index ) )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct vmx_cpuid_entry *
+cpuid_lookup( struct vmx_cpuid_table *t, uint32_t function, uint32_t index ) {
+    int i = cpuid_search( t, function, index );
+    struct vmx_cpuid_entry *e = &t->ent[i];
+
+    if( i < t->nent && e->function == function &&
+        ( e->index == VMX_CPUID_ANY_INDEX || e->index == index ) )
+        return e;
+    return NULL;
+}
+
+static void
+cpuid_add( struct vmx_cpuid_table *t, uint32_t function, uint32_t index,
+           uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx ) {
+    struct vmx_cpuid_entry *e;
+    int i;
+
+    if( t->nent == VMX_CPUID_MAX_ENTRIES ) {
+        cprintf( "vmx: CPUID table full, dropping leaf %x.%x\n", function, index );
+        return;
+    }
+    // Keep the table sorted for cpuid_lookup().
+    i = cpuid_search( t, function, index );
+    memmove( &t->ent[i + 1], &t->ent[i], ( t->nent - i ) * sizeof( *e ) );
+    t->nent++;
+    e = &t->ent[i];
+    e->function = function;
+    e->index = index;
+    e->eax = eax;
+    e->ebx = ebx;
+    e->ecx = ecx;
+    e->edx = edx;
+}
+
+// Copy the host's answers for leaf 'function' into t.
+static void
+cpuid_add_host( struct vmx_cpuid_table *t, uint32_t function ) {
+    uint32_t eax, ebx, ecx, edx, index;
+    int i;
+
+    for( i = 0; i < CPUID_NINDEXED; i++ )
+        if( cpuid_indexed_leaves[i] == function )
+            break;
+    if( i == CPUID_NINDEXED ) {
+        cpuid_count( function, 0, &eax, &ebx, &ecx, &edx );
+        cpuid_add( t, function, VMX_CPUID_ANY_INDEX, eax, ebx, ecx, edx );
+        return;
+    }
+    // Unlisted subleaves read as zero, which is what the hardware returns
+    // past the last valid one; the topology leaves stop at the first
+    // invalid level instead, and handle_cpuid() makes up the rest.
+    for( index = 0; index < CPUID_MAX_SUBLEAF; index++ ) {
+        cpuid_count( function, index, &eax, &ebx, &ecx, &edx );
+        if( CPUID_IS_TOPOLOGY( function ) && index > 0 &&
+            CPUID_TOPOLOGY_LEVEL_TYPE( ecx ) == 0 )
+            break;
+        if( index == 0 || eax || ebx || ecx || edx )
+            cpuid_add( t, function, index, eax, ebx, ecx, edx );
+    }
+}
+
+const struct vmx_cpuid_policy vmx_cpuid_default_policy = VMX_CPUID_POLICY_DEFAULT;
+
+// The host CPU's answers, collected at boot before the other CPUs start,
+// so the table never changes once guests can run on them.
+static struct vmx_cpuid_table host_cpuid;
+
+void
+vmx_cpuid_host_init( void ) {
+    uint32_t max, function;
+
+    cpuid( 0, &max, NULL, NULL, NULL );
+    for( function = 0; function <= max; function++ )
+        cpuid_add_host( &host_cpuid, function );
+    cpuid( 0x80000000, &max, NULL, NULL, NULL );
+    for( function = 0x80000000; function <= max; function++ )
+        cpuid_add_host( &host_cpuid, function );
+}
+
+// Fill in a guest's CPUID table from the host CPU, filtered through policy,
+// plus the hypervisor leaves.  Called once when the guest is created (and
+// again if its policy is replaced before it first runs), so that CPUID exits
+// never execute the real instruction.
+void
+vmx_cpuid_init( struct vmx_cpuid_table *t, const struct vmx_cpuid_policy *policy ) {
+    struct vmx_cpuid_entry *e;
+
+    assert( host_cpuid.nent > 0 );
+    memcpy( t, &host_cpuid, sizeof( *t ) );
+
+    cpuid_add( t, VMX_CPUID_SIGNATURE, VMX_CPUID_ANY_INDEX, VMX_CPUID_MAX_LEAF,
+               VMX_CPUID_SIG_EBX, VMX_CPUID_SIG_ECX, VMX_CPUID_SIG_EDX );
+    cpuid_add( t, VMX_CPUID_PV_FEATURES, VMX_CPUID_ANY_INDEX,
+               policy->pv_features & VMX_PV_SUPPORTED, 0, 0, 0 );
+
+    if( ( e = cpuid_lookup( t, 1, 0 ) ) ) {
+        e->ecx = ( e->ecx & ~policy->leaf1_ecx_clear ) | CPUID_1_ECX_HYPERVISOR;
+        e->edx &= ~policy->leaf1_edx_clear;
+    }
+    if( ( e = cpuid_lookup( t, 7, 0 ) ) ) {
+        e->ebx &= ~policy->leaf7_ebx_clear;
+        e->ecx &= ~policy->leaf7_ecx_clear;
+        e->edx &= ~policy->leaf7_edx_clear;
+    }
+    if( ( e = cpuid_lookup( t, 0x80000001, 0 ) ) ) {
+        e->ecx &= ~policy->ext1_ecx_clear;
+        e->edx &= ~policy->ext1_edx_clear;
+    }
+}
+
+// Emulate a cpuid instruction by looking the answer up in the guest's
+// precomputed table (see vmx_cpuid_init()).  Leaves that aren't in the
+// table read as zero, except for subleaves of the topology leaves 0xB and
+// 0x1F past the last level: those report the subleaf and an invalid level
+// type in ecx and the x2APIC ID in edx, as the hardware does.
 // 
 // Return true if the exit is handled properly, false if the VM should be terminated.
-//
-// Finally, you need to increment the program counter in the trap frame.
-// 
-// Hint: The TA's solution does not hard-code the length of the cpuid instruction.
 bool
 handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 {
-    int temp = tf->tf_regs.reg_rax;
-
-    uint32_t eax, ebx, ecx, edx;
-    cpuid( temp , &eax, &ebx, &ecx, &edx );
+    uint32_t function = tf->tf_regs.reg_rax;
+    uint32_t index = tf->tf_regs.reg_rcx;
+    struct vmx_cpuid_entry *e;
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if( ( e = cpuid_lookup( ginfo->cpuid_table, function, index ) ) ) {
+        eax = e->eax;
+        ebx = e->ebx;
+        ecx = e->ecx;
+        edx = e->edx;
+    } else if( CPUID_IS_TOPOLOGY( function ) &&
+               ( e = cpuid_lookup( ginfo->cpuid_table, function, 0 ) ) ) {
+        ecx = index & 0xff;
+        edx = e->edx;
+    }
 
-    if(temp == 1)
-    {
-	ecx = ecx & ~32;
+    if( function == 1 ) {
+        ecx &= ~CPUID_1_ECX_OSXSAVE;
+        if( vmcs_read64( VMCS_GUEST_CR4 ) & CR4_OSXSAVE )
+            ecx |= CPUID_1_ECX_OSXSAVE;
     }
 
     tf->tf_regs.reg_rax = eax;
@@ -188,6 +440,37 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 
 }
 
+static void
+e820_set(memory_map_t *mmap, uint64_t base, uint64_t len, uint32_t type) {
+    mmap->size = 20;
+    mmap->base_addr_low = (uint32_t) base;
+    mmap->base_addr_high = (uint32_t) (base >> 32);
+    mmap->length_low = (uint32_t) len;
+    mmap->length_high = (uint32_t) (len >> 32);
+    mmap->type = type;
+}
+
+// Fill mmap_list (at least E820_MAX_ENTRIES long) with the guest's e820 map.
+// Returns the number of entries used.
+static int
+guest_e820_map(struct VmxGuestInfo *ginfo, memory_map_t *mmap_list) {
+    int n = 0;
+    uint64_t lowmem_end = guest_lowmem_end(ginfo);
+    uint64_t highmem_end = guest_highmem_end(ginfo);
+
+    e820_set(&mmap_list[n++], 0, IOPHYSMEM, MB_TYPE_USABLE);
+    e820_set(&mmap_list[n++], IOPHYSMEM, EXTPHYSMEM - IOPHYSMEM, MB_TYPE_RESERVED);
+    e820_set(&mmap_list[n++], EXTPHYSMEM, lowmem_end - EXTPHYSMEM, MB_TYPE_USABLE);
+    if(highmem_end) {
+        e820_set(&mmap_list[n++], lowmem_end, GUEST_HIGHMEM_BASE - lowmem_end,
+                MB_TYPE_RESERVED);
+        e820_set(&mmap_list[n++], GUEST_HIGHMEM_BASE,
+                highmem_end - GUEST_HIGHMEM_BASE, MB_TYPE_USABLE);
+    }
+    assert(n <= E820_MAX_ENTRIES);
+    return n;
+}
+
 // Handle vmcall traps from the guest.
 // We currently support 3 traps: read the virtual e820 map, 
 //   and use host-level IPC (send andrecv).
@@ -198,6 +481,128 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 // 
 // Hint: The TA's solution does not hard-code the length of the cpuid instruction.//
 
+// Post an asynchronous host IPC receive for guest e.  dst is the guest
+// physical page to receive a page into, or ~0 for none; mbox is the guest
+// physical address of its struct vmx_ipc_mailbox.  The mailbox page is
+// pinned until the receive completes, so the pager cannot evict it.
+//
+// Returns 0 on success, or
+//	-E_BUSY if e already has a receive posted.
+//	-E_INVAL if dst or mbox is not valid, resident guest RAM.
+//	-E_NO_MEM if the mailbox page was shared and could not be copied.
+int
+vmx_ipc_post(struct Env *e, uint64_t dst, uint64_t mbox) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    void *hva;
+
+    if(e->env_ipc_recving)
+        return -E_BUSY;
+    // A send that failed part way may have left the last mailbox pinned.
+    vmx_ipc_cancel(e);
+    if(PGOFF(mbox) + sizeof(struct vmx_ipc_mailbox) > PGSIZE ||
+            !guest_gpa_is_ram(ginfo, mbox))
+        return -E_INVAL;
+    if(ept_cow(e->env_pml4e, ROUNDDOWN(mbox, PGSIZE)) < 0)
+        return -E_NO_MEM;
+    ept_gpa2hva(e->env_pml4e, (void *)ROUNDDOWN(mbox, PGSIZE), &hva);
+    if(!hva)
+        return -E_INVAL;
+    if(dst == ~0ULL)
+        dst = UTOP;
+    else if(dst % PGSIZE || !guest_gpa_is_ram(ginfo, dst))
+        return -E_INVAL;
+
+    pa2page(PADDR(hva))->pp_ref++;
+    ginfo->ipc_mbox = (struct vmx_ipc_mailbox *)((char *)hva + PGOFF(mbox));
+    e->env_ipc_dstva = (void *)dst;
+    e->env_ipc_perm = 0;
+    e->env_ipc_from = 0;
+    e->env_ipc_recving = 1;
+    return 0;
+}
+
+// Deliver the message sys_ipc_try_send() left in e's env_ipc_* fields to
+// its mailbox.  The guest keeps running throughout; it sees 'done' set.
+void
+vmx_ipc_complete(struct Env *e) {
+    struct vmx_ipc_mailbox *mb = e->env_vmxinfo.ipc_mbox;
+
+    mb->value = e->env_ipc_value;
+    mb->from = e->env_ipc_from;
+    mb->perm = e->env_ipc_perm;
+    // The guest reads the fields only after it sees 'done'.
+    asm volatile("" : : : "memory");
+    mb->done = 1;
+    vmx_ipc_cancel(e);
+}
+
+// Drop e's posted receive, if any, and unpin its mailbox.
+void
+vmx_ipc_cancel(struct Env *e) {
+    struct vmx_ipc_mailbox *mb = e->env_vmxinfo.ipc_mbox;
+
+    if(!mb)
+        return;
+    page_decref(pa2page(PADDR(mb)));
+    e->env_vmxinfo.ipc_mbox = NULL;
+    e->env_ipc_recving = 0;
+}
+
+// Register the page at gpa as guest e's steal-time page.  The page stays
+// pinned, out of the pager's reach, until the guest is freed.
+//
+// Returns 0 on success, or
+//	-E_BUSY if e already has a steal-time page.
+//	-E_INVAL if gpa is not a resident, page-aligned page of guest RAM.
+//	-E_NO_MEM if the page was shared and could not be copied.
+int
+vmx_steal_setup(struct Env *e, uint64_t gpa) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    void *hva;
+
+    if(ginfo->steal_page)
+        return -E_BUSY;
+    if(gpa % PGSIZE || !guest_gpa_is_ram(ginfo, gpa))
+        return -E_INVAL;
+    if(ept_cow(e->env_pml4e, gpa) < 0)
+        return -E_NO_MEM;
+    ept_gpa2hva(e->env_pml4e, (void *)gpa, &hva);
+    if(!hva)
+        return -E_INVAL;
+
+    pa2page(PADDR(hva))->pp_ref++;
+    ginfo->steal_page = hva;
+    // Count from now on.
+    ginfo->sched_steal = 0;
+    ginfo->sched_preempted = 0;
+    vmx_steal_update(e);
+    return 0;
+}
+
+// Refresh e's steal-time page, if it has one, before entering it.
+void
+vmx_steal_update(struct Env *e) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct vmx_steal_time *st = ginfo->steal_page;
+
+    if(!st)
+        return;
+    st->steal = ginfo->sched_steal;
+    st->preempted = ginfo->sched_preempted;
+    st->tsc_khz = sched_tsc_khz();
+}
+
+// Guest e is going away: unpin its steal-time page.
+void
+vmx_steal_release(struct Env *e) {
+    struct vmx_steal_time *st = e->env_vmxinfo.steal_page;
+
+    if(!st)
+        return;
+    page_decref(pa2page(PADDR(st)));
+    e->env_vmxinfo.steal_page = NULL;
+}
+
 bool
 handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 {
@@ -208,77 +613,48 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
     envid_t to_env;
     uint32_t val;
 
-    memory_map_t mmap_list[3];
-    uintptr_t *hva;
-
-     struct Page * page ;
+    memory_map_t mmap_list[E820_MAX_ENTRIES];
+    int mmap_count;
+    void *hva;
 
     // phys address of the multiboot map in the guest.
     uint64_t multiboot_map_addr = 0x6000;
 
     switch(tf->tf_regs.reg_rax) {
         case VMX_VMCALL_MBMAP:
- 
-
-
-            // Craft a multiboot (e820) memory map for the guest.
-	    //
-            // Create three  memory mapping segments: 640k of low mem, the I/O hole (unusable), and 
-	    //   high memory (phys_size - 1024k).
-	    //
-	    // Once the map is ready, find the kernel virtual address of the guest page (if present),
-	    //   or allocate one and map it at the multiboot_map_addr (0x6000).
-	    // Copy the mbinfo and memory_map_t (segment descriptions) into the guest page, and return
-	    //   a pointer to this region in rbx (as a guest physical address).
-   
-
-            mmap_list[0].size = 20;
-
-            mmap_list[0].base_addr_low = 0;
-            mmap_list[0].base_addr_high = 0;
-            mmap_list[0].length_low = 0x000A0000;
-            mmap_list[0].length_high = 0;
-            mmap_list[0].type = MB_TYPE_USABLE;
-
-            mmap_list[1].size = 20;
-            mmap_list[1].base_addr_low = 0x000A0000;
-            mmap_list[1].base_addr_high = 0;
-            mmap_list[1].length_low = 384*1024;
-            mmap_list[1].length_high = 0;
-            mmap_list[1].type = MB_TYPE_RESERVED;
-
-            mmap_list[2].size = 20;
-            mmap_list[2].base_addr_low = 0x00100000;
-            mmap_list[2].base_addr_high = 0;
-            mmap_list[2].length_low = gInfo->phys_sz - 1024*1024;
-            mmap_list[2].length_high = 0;
-            mmap_list[2].type = MB_TYPE_USABLE;
-
-
-           mbinfo.flags = MB_FLAG_MMAP;
-           mbinfo.mem_lower = 0;
-           mbinfo.mem_upper = 0;
-           mbinfo.boot_device = 0;
-           mbinfo.cmdline = 0;
-           mbinfo.mods_count = 0;
-           mbinfo.mods_addr = 0;
-          // mbinfo.u = 0;
-           mbinfo.mmap_length =sizeof(mmap_list);
-
-           mbinfo.mmap_addr = multiboot_map_addr + sizeof(mbinfo);
-
-          struct Page *p = page_alloc(0);
-          if(!p)
-             return false;
-          p->pp_ref += 1;  
-
-          memcpy(&mbinfo,page2kva(p),sizeof(mbinfo));  	
-          memcpy(&mmap_list,page2kva(p)+sizeof(mbinfo),sizeof(memory_map_t)*3);	
-
-	   ept_map_hva2gpa(eptrt,page2kva(p),(void*)0x6000, __EPTE_FULL,1);
+            // Craft a multiboot (e820) memory map for the guest: 640k of
+            // low mem, the I/O hole (unusable), memory up to the 32-bit
+            // hole and, for guests larger than GUEST_LOWMEM_TOP, the
+            // hole itself and the RAM relocated above 4 GB.
+            mmap_count = guest_e820_map(gInfo, mmap_list);
+
+            memset(&mbinfo, 0, sizeof(mbinfo));
+            mbinfo.flags = MB_FLAG_MMAP;
+            mbinfo.mmap_length = mmap_count * sizeof(memory_map_t);
+            mbinfo.mmap_addr = multiboot_map_addr + sizeof(mbinfo);
+
+            // Find the guest page backing multiboot_map_addr, or allocate
+            // one, and copy the multiboot info and the map into it.
+            if(ept_cow(eptrt, multiboot_map_addr) < 0)
+                return false;
+            ept_gpa2hva(eptrt, (void *)multiboot_map_addr, &hva);
+            if(!hva) {
+                struct Page *p = page_alloc(ALLOC_ZERO);
+                if(!p)
+                    return false;
+                p->pp_ref += 1;
+                if(ept_map_hva2gpa(eptrt, page2kva(p),
+                            (void *)multiboot_map_addr, __EPTE_FULL, 0) < 0) {
+                    page_decref(p);
+                    return false;
+                }
+                hva = page2kva(p);
+            }
 
-          tf->tf_regs.reg_rbx = 0x6000;
+            memcpy(hva, &mbinfo, sizeof(mbinfo));
+            memcpy(hva + sizeof(mbinfo), mmap_list, mbinfo.mmap_length);
 
+            tf->tf_regs.reg_rbx = multiboot_map_addr;
 
         //  cprintf("\nCASE :  VMX_VMCALL_MBMAP\n"); 	    
 
@@ -323,15 +699,63 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
            break;
 
         case VMX_VMCALL_IPCRECV:
-          // cprintf("\nCASE :  VMX_VMCALL_IPCRECV\n");
-           tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
+            // Post the receive and let the guest carry on; the message
+            // is delivered later by vmx_ipc_complete().
+            tf->tf_regs.reg_rax = vmx_ipc_post(curenv,
+                    tf->tf_regs.reg_rdx, tf->tf_regs.reg_rbx);
+            handled = true;
+            break;
 
-	    int r1 = 	syscall(SYS_ipc_recv,tf->tf_regs.reg_rdx,0, 0, 0, 0);
+        case VMX_VMCALL_NOP:
+            handled = true;
+            break;
 
-           tf->tf_regs.reg_rax = r1;   
-	    
-	    handled = true;
-           break;
+        case VMX_VMCALL_CHAN_SETUP:
+            tf->tf_regs.reg_rax = vmchan_setup(curenv, tf->tf_regs.reg_rdx);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_CHAN_KICK:
+            vmchan_kick(curenv);
+            tf->tf_regs.reg_rax = 0;
+            handled = true;
+            break;
+
+        case VMX_VMCALL_SHM_INFO:
+            tf->tf_regs.reg_rax = vmshm_info(curenv, tf->tf_regs.reg_rdx);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_SHM_MAP:
+            tf->tf_regs.reg_rax = vmshm_map(curenv, tf->tf_regs.reg_rdx,
+                    tf->tf_regs.reg_rcx, tf->tf_regs.reg_rbx);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_SHM_NOTIFY:
+            tf->tf_regs.reg_rax = vmshm_notify(curenv, tf->tf_regs.reg_rdx);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_SHM_WAIT:
+            // May leave the guest not runnable; vmexit() reschedules.
+            tf->tf_regs.reg_rax = vmshm_wait(curenv, tf->tf_regs.reg_rdx,
+                    tf->tf_regs.reg_rcx != 0);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_STEAL_SETUP:
+            tf->tf_regs.reg_rax = vmx_steal_setup(curenv, tf->tf_regs.reg_rdx);
+            handled = true;
+            break;
+
+        case VMX_VMCALL_YIELD:
+            // vmexit() reschedules, preferring any other guest.
+            gInfo->yields++;
+            sched_guest_yield(curenv);
+            tf->tf_regs.reg_rax = 0;
+            handled = true;
+            break;
     }
     if(handled) {
                    tf->tf_rip += vmcs_read32(VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH);
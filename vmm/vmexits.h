@@ -1,10 +1,22 @@
 
 #include <inc/trap.h>
 
+bool guest_ram_fault(uint64_t *eptrt, uint64_t gpa, bool write);
 bool handle_eptviolation(uint64_t *eptrt, struct VmxGuestInfo *ginfo);
 bool handle_rdmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
 bool handle_wrmsr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
 bool handle_ioinstr(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
 bool handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
+bool handle_extint(struct Trapframe *tf);
+bool handle_pause(struct Trapframe *tf, struct VmxGuestInfo *ginfo);
+extern const struct vmx_cpuid_policy vmx_cpuid_default_policy;
+void vmx_cpuid_host_init(void);
+void vmx_cpuid_init(struct vmx_cpuid_table *t, const struct vmx_cpuid_policy *policy);
+int vmx_ipc_post(struct Env *e, uint64_t dst, uint64_t mbox);
+void vmx_ipc_complete(struct Env *e);
+void vmx_ipc_cancel(struct Env *e);
+int vmx_steal_setup(struct Env *e, uint64_t gpa);
+void vmx_steal_update(struct Env *e);
+void vmx_steal_release(struct Env *e);
 bool handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt );
 
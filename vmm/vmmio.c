@@ -0,0 +1,698 @@
+
+#include <vmm/vmmio.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/console.h>
+#include <kern/kclock.h>
+#include <vmm/ept.h>
+#include <vmm/vmx.h>
+#include <vmm/vmexits.h>
+
+// MMIO emulation; see vmm/vmmio.h.
+//
+// Only the instructions compilers emit for volatile device accesses are
+// decoded: MOV between a register and memory, MOV of an immediate to
+// memory, and MOVZX loads.  Anything else in an MMIO range kills the guest,
+// as any unhandled EPT violation does.
+//
+// Writes to a device registered VMMIO_COALESCED are not delivered at once
+// but buffered in the device, a store to the same register as the previous
+// buffered one replacing it.  The buffer is replayed to the model in order
+// before the guest's next synchronous access to any of its devices (a read,
+// or a write to a device that is not coalesced), when it fills, and when
+// the device goes away, so a model sees every store that could matter
+// before it has to answer.  The guest still exits on each store, but a
+// model whose writes are expensive, a frame buffer say, does its work once
+// per batch.
+//
+// Port devices share the hooks, the write buffering and the statistics.
+// Only a string instruction touches guest memory; its elements are moved
+// one port access at a time, the guest pages they fall in translated
+// once per page rather than per element.
+
+static struct vmmio_dev devs[VMMIO_MAX_DEVS];
+
+static bool
+range_overlaps( uint64_t base, uint64_t len, uint64_t start, uint64_t end ) {
+    return base < end && start < base + len;
+}
+
+// Register [base, base + len) of guest e's physical address space, or of
+// its I/O ports if flags has VMMIO_PIO, as an emulated device with the
+// given hooks, and store the new device in *dev_store.
+//
+// Returns 0 on success, or
+//	-E_INVAL if the range is empty, overlaps guest RAM, the CGA buffer,
+//		the CMOS ports or another of e's devices, runs past the last
+//		port, or a hook is missing.
+//	-E_NO_MEM if all VMMIO_MAX_DEVS devices are in use.
+int
+vmmio_register( struct Env *e, const char *name, uint64_t base,
+                uint64_t len, int flags, vmmio_read_fn read,
+                vmmio_write_fn write, void *opaque,
+                struct vmmio_dev **dev_store ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct vmmio_dev *dev = NULL;
+    uint64_t port;
+    int i;
+
+    if( len == 0 || base + len < base || !read || !write )
+        return -E_INVAL;
+    if( flags & VMMIO_PIO ) {
+        // handle_ioinstr() models the CMOS itself.
+        if( base + len > 0x10000 ||
+            range_overlaps( base, len, IO_RTC, IO_RTC + 2 ) )
+            return -E_INVAL;
+    } else if( range_overlaps( base, len, 0, IOPHYSMEM ) ||
+        range_overlaps( base, len, EXTPHYSMEM, guest_lowmem_end( ginfo ) ) ||
+        range_overlaps( base, len, GUEST_HIGHMEM_BASE,
+                        guest_highmem_end( ginfo ) ) ||
+        range_overlaps( base, len, CGA_BUF, CGA_BUF + PGSIZE ) )
+        return -E_INVAL;
+
+    for( i = 0; i < VMMIO_MAX_DEVS; i++ ) {
+        if( devs[i].guest == 0 ) {
+            if( !dev )
+                dev = &devs[i];
+        } else if( devs[i].guest == e->env_id &&
+                   ( devs[i].flags & VMMIO_PIO ) == ( flags & VMMIO_PIO ) &&
+                   range_overlaps( base, len, devs[i].base,
+                                   devs[i].base + devs[i].len ) ) {
+            return -E_INVAL;
+        }
+    }
+    if( !dev )
+        return -E_NO_MEM;
+
+    memset( dev, 0, sizeof( *dev ) );
+    dev->name = name;
+    dev->guest = e->env_id;
+    dev->base = base;
+    dev->len = len;
+    dev->flags = flags;
+    dev->read = read;
+    dev->write = write;
+    dev->opaque = opaque;
+    if( flags & VMMIO_PIO )
+        for( port = base; port < base + len; port++ )
+            vmx_io_intercept( ginfo, port, true );
+    *dev_store = dev;
+    return 0;
+}
+
+// Deliver dev's buffered writes to its model.
+void
+vmmio_flush( struct vmmio_dev *dev ) {
+    int i;
+
+    if( dev->npending == 0 )
+        return;
+    for( i = 0; i < dev->npending; i++ )
+        dev->write( dev, dev->pending[i].off, dev->pending[i].size,
+                    dev->pending[i].val );
+    dev->npending = 0;
+    dev->replays++;
+}
+
+static void
+flush_guest( envid_t guest ) {
+    int i;
+
+    for( i = 0; i < VMMIO_MAX_DEVS; i++ )
+        if( devs[i].guest == guest )
+            vmmio_flush( &devs[i] );
+}
+
+// Remove dev, delivering any writes it still buffers.
+void
+vmmio_unregister( struct vmmio_dev *dev ) {
+    struct Env *e;
+    uint64_t port;
+
+    vmmio_flush( dev );
+    if( dev->exits )
+        cprintf( "vmmio: %s: %lld accesses, %lld writes coalesced, "
+                 "%lld merged, %lld replays, %lld string elements\n",
+                 dev->name, (long long) dev->exits,
+                 (long long) dev->coalesced, (long long) dev->merged,
+                 (long long) dev->replays, (long long) dev->elements );
+    if( ( dev->flags & VMMIO_PIO ) && envid2env( dev->guest, &e, 0 ) == 0 )
+        for( port = dev->base; port < dev->base + dev->len; port++ )
+            vmx_io_intercept( &e->env_vmxinfo, port, false );
+    dev->guest = 0;
+}
+
+// Guest e is going away: remove its devices.
+void
+vmmio_release( struct Env *e ) {
+    int i;
+
+    for( i = 0; i < VMMIO_MAX_DEVS; i++ )
+        if( devs[i].guest == e->env_id )
+            vmmio_unregister( &devs[i] );
+}
+
+// The device of guest at addr, a guest physical address or, if pio is
+// VMMIO_PIO, a port.
+static struct vmmio_dev *
+dev_lookup( envid_t guest, uint64_t addr, int pio ) {
+    int i;
+
+    for( i = 0; i < VMMIO_MAX_DEVS; i++ )
+        if( devs[i].guest == guest && ( devs[i].flags & VMMIO_PIO ) == pio &&
+            addr >= devs[i].base && addr - devs[i].base < devs[i].len )
+            return &devs[i];
+    return NULL;
+}
+
+// Copy n bytes at gpa, which must not cross a page, out of guest e.
+static int
+guest_read_phys( struct Env *e, uint64_t gpa, void *buf, size_t n ) {
+    void *hva;
+
+    ept_gpa2hva( e->env_pml4e, (void *) ROUNDDOWN( gpa, PGSIZE ), &hva );
+    if( !hva )
+        return -E_FAULT;
+    memcpy( buf, (char *) hva + PGOFF( gpa ), n );
+    return 0;
+}
+
+// Translate the guest linear address la through the guest's own page
+// tables.  The guest runs unpaged, with 32-bit paging or in long mode;
+// 32-bit PAE paging is not supported.
+static int
+guest_la2gpa( struct Env *e, uint64_t la, uint64_t *gpa ) {
+    uint64_t cr0 = vmcs_read64( VMCS_GUEST_CR0 );
+    uint64_t cr4 = vmcs_read64( VMCS_GUEST_CR4 );
+    uint64_t table = vmcs_read64( VMCS_GUEST_CR3 );
+    uint64_t entry, addr_mask, page_mask;
+    int shift, bits, esize, level;
+    bool long_mode;
+
+    if( !( cr0 & CR0_PG ) ) {
+        *gpa = la;
+        return 0;
+    }
+    long_mode = vmcs_read32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS ) &
+        VMCS_VMENTRY_x64_GUEST;
+    if( long_mode ) {
+        shift = 39, bits = 9, esize = 8;
+        addr_mask = 0x000FFFFFFFFFF000ULL;
+    } else if( !( cr4 & CR4_PAE ) ) {
+        shift = 22, bits = 10, esize = 4;
+        addr_mask = 0xFFFFF000;
+        la = (uint32_t) la;
+    } else {
+        return -E_NOT_SUPP;
+    }
+
+    for( level = 0; ; level++, shift -= bits ) {
+        entry = 0;
+        if( guest_read_phys( e, ( table & addr_mask ) +
+                             ( ( la >> shift ) & ( ( 1 << bits ) - 1 ) ) * esize,
+                             &entry, esize ) < 0 )
+            return -E_FAULT;
+        if( !( entry & PTE_P ) )
+            return -E_FAULT;
+        // Large pages: 4 MB ones need PSE in 32-bit paging, and long
+        // mode has 1 GB and 2 MB ones below the PML4.
+        if( shift == PGSHIFT ||
+            ( ( entry & PTE_PS ) &&
+              ( long_mode ? level > 0 : ( cr4 & CR4_PSE ) != 0 ) ) ) {
+            page_mask = ( 1ULL << shift ) - 1;
+            *gpa = ( entry & addr_mask & ~page_mask ) | ( la & page_mask );
+            return 0;
+        }
+        table = entry;
+    }
+}
+
+// The guest page a copy last went through.
+struct guest_window {
+    uint64_t la;	// Page-aligned linear address, or ~0 if none
+    uint64_t gpa;	// Its guest physical page, or ~0 if untranslated
+    uint8_t *hva;
+    bool store;		// Mapped writable for the guest
+};
+
+#define GUEST_WINDOW_INIT	{ ~0ULL, ~0ULL, NULL, false }
+
+// Point *w at the guest page holding linear address la, making it
+// private first if the guest's memory is to be written there.
+static int
+window_map( struct Env *e, struct guest_window *w, uint64_t la, bool store ) {
+    uint64_t gpa;
+    void *hva;
+    int r;
+
+    if( w->la == ROUNDDOWN( la, PGSIZE ) && ( w->store || !store ) )
+        return 0;
+    w->la = w->gpa = ~0ULL;
+    if( ( r = guest_la2gpa( e, la, &gpa ) ) < 0 )
+        return r;
+    w->gpa = ROUNDDOWN( gpa, PGSIZE );
+    if( store && ept_cow( e->env_pml4e, w->gpa ) < 0 )
+        return -E_NO_MEM;
+    ept_gpa2hva( e->env_pml4e, (void *) w->gpa, &hva );
+    if( !hva )
+        return -E_FAULT;
+    w->la = ROUNDDOWN( la, PGSIZE );
+    w->hva = hva;
+    w->store = store;
+    return 0;
+}
+
+// Copy n bytes between buf and guest e's memory at linear address la:
+// into the guest if store, out of it otherwise.
+static int
+guest_copy( struct Env *e, struct guest_window *w, uint64_t la, void *buf,
+            int n, bool store ) {
+    uint8_t *p = buf;
+    int chunk, r;
+
+    while( n > 0 ) {
+        if( ( r = window_map( e, w, la, store ) ) < 0 )
+            return r;
+        chunk = MIN( n, PGSIZE - PGOFF( la ) );
+        if( store )
+            memcpy( w->hva + PGOFF( la ), p, chunk );
+        else
+            memcpy( p, w->hva + PGOFF( la ), chunk );
+        la += chunk;
+        p += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+// Copy n bytes of guest e's memory at linear address la into buf.
+static int
+guest_fetch( struct Env *e, uint64_t la, uint8_t *buf, int n ) {
+    struct guest_window w = GUEST_WINDOW_INIT;
+
+    return guest_copy( e, &w, la, buf, n, false );
+}
+
+// A decoded MMIO access.
+struct vmmio_insn {
+    int len;		// Instruction length
+    int size;		// Bytes accessed in memory
+    bool write;		// A store
+    int reg;		// Register operand, or -1 for an immediate
+    int reg_size;	// Its size, for loads
+    bool rex;		// A REX prefix selects SPL..DIL over AH..BH
+    uint64_t imm;
+};
+
+#define X86_MAX_INSN_LEN	15
+
+// Bytes of ModRM, SIB and displacement that start at p.
+static int
+modrm_len( const uint8_t *p, int addr_size ) {
+    int mod = p[0] >> 6, rm = p[0] & 7;
+
+    if( mod == 3 )
+        return -1;	// A register, not memory
+    if( addr_size == 2 ) {
+        if( mod == 0 )
+            return rm == 6 ? 3 : 1;
+        return mod == 1 ? 2 : 3;
+    }
+    if( mod == 0 ) {
+        if( rm == 4 )
+            return ( p[1] & 7 ) == 5 ? 6 : 2;
+        return rm == 5 ? 5 : 1;
+    }
+    return ( rm == 4 ? 2 : 1 ) + ( mod == 1 ? 1 : 4 );
+}
+
+// Decode the instruction at the guest's rip into *insn.
+static int
+vmmio_decode( struct Env *e, struct vmmio_insn *insn ) {
+    uint8_t buf[X86_MAX_INSN_LEN], *p = buf, rex = 0;
+    uint32_t cs_ar = vmcs_read32( VMCS_32BIT_GUEST_CS_ACCESS_RIGHTS );
+    int op_size, addr_size, n, i;
+    bool mode64 = BIT( cs_ar, 13 ), opsize_pfx = false, addrsize_pfx = false;
+    uint8_t op;
+
+    // The instruction may end close to an unmapped page, so fetch it a
+    // page at a time and only as far as that page goes at first.
+    n = MIN( X86_MAX_INSN_LEN, PGSIZE - PGOFF( e->env_tf.tf_rip ) );
+    if( guest_fetch( e, e->env_tf.tf_rip, buf, n ) < 0 )
+        return -E_FAULT;
+    if( n < X86_MAX_INSN_LEN &&
+        guest_fetch( e, e->env_tf.tf_rip + n, buf + n,
+                     X86_MAX_INSN_LEN - n ) < 0 )
+        memset( buf + n, 0, X86_MAX_INSN_LEN - n );
+
+    for( ; p < buf + X86_MAX_INSN_LEN - 1; p++ ) {
+        if( *p == 0x66 )
+            opsize_pfx = true;
+        else if( *p == 0x67 )
+            addrsize_pfx = true;
+        else if( *p != 0x26 && *p != 0x2E && *p != 0x36 &&
+                 *p != 0x3E && *p != 0x64 && *p != 0x65 )
+            break;	// Segment overrides need no handling
+    }
+    if( mode64 && ( *p & 0xF0 ) == 0x40 )
+        rex = *p++;
+
+    if( mode64 ) {
+        op_size = ( rex & 8 ) ? 8 : opsize_pfx ? 2 : 4;
+        addr_size = addrsize_pfx ? 4 : 8;
+    } else {
+        bool def32 = BIT( cs_ar, 14 );
+        op_size = ( def32 != opsize_pfx ) ? 4 : 2;
+        addr_size = ( def32 != addrsize_pfx ) ? 4 : 2;
+    }
+
+    memset( insn, 0, sizeof( *insn ) );
+    insn->rex = rex != 0;
+    insn->reg = -1;
+    op = *p++;
+    switch( op ) {
+        case 0x88:	// MOV r/m8, r8
+        case 0x89:	// MOV r/m, r
+        case 0x8A:	// MOV r8, r/m8
+        case 0x8B:	// MOV r, r/m
+            insn->size = ( op & 1 ) ? op_size : 1;
+            insn->reg_size = insn->size;
+            insn->write = op < 0x8A;
+            insn->reg = ( ( *p >> 3 ) & 7 ) | ( ( rex & 4 ) << 1 );
+            if( ( n = modrm_len( p, addr_size ) ) < 0 )
+                return -E_INVAL;
+            p += n;
+            break;
+        case 0xC6:	// MOV r/m8, imm8
+        case 0xC7:	// MOV r/m, imm
+            if( ( *p >> 3 ) & 7 )
+                return -E_INVAL;
+            insn->size = op == 0xC6 ? 1 : op_size;
+            insn->write = true;
+            if( ( n = modrm_len( p, addr_size ) ) < 0 )
+                return -E_INVAL;
+            p += n;
+            n = MIN( insn->size, 4 );
+            for( i = 0; i < n; i++ )
+                insn->imm |= (uint64_t) p[i] << ( 8 * i );
+            // A 32-bit immediate is sign-extended into a 64-bit store.
+            if( insn->size == 8 )
+                insn->imm = (int64_t) (int32_t) insn->imm;
+            p += n;
+            break;
+        case 0x0F:	// MOVZX r, r/m8 and MOVZX r, r/m16
+            op = *p++;
+            if( op != 0xB6 && op != 0xB7 )
+                return -E_INVAL;
+            insn->size = op == 0xB6 ? 1 : 2;
+            insn->reg_size = op_size;
+            insn->reg = ( ( *p >> 3 ) & 7 ) | ( ( rex & 4 ) << 1 );
+            if( ( n = modrm_len( p, addr_size ) ) < 0 )
+                return -E_INVAL;
+            p += n;
+            break;
+        case 0xA0:	// MOV AL, moffs8
+        case 0xA1:	// MOV rAX, moffs
+        case 0xA2:	// MOV moffs8, AL
+        case 0xA3:	// MOV moffs, rAX
+            insn->size = ( op & 1 ) ? op_size : 1;
+            insn->reg_size = insn->size;
+            insn->write = op >= 0xA2;
+            insn->reg = 0;
+            p += addr_size;
+            break;
+        default:
+            return -E_INVAL;
+    }
+
+    insn->len = p - buf;
+    if( insn->len > X86_MAX_INSN_LEN )
+        return -E_INVAL;
+    return 0;
+}
+
+// The guest register with the x86 encoding reg (RAX = 0 ... R15 = 15).
+static uint64_t *
+guest_reg( struct Trapframe *tf, int reg ) {
+    struct PushRegs *r = &tf->tf_regs;
+
+    switch( reg ) {
+        case 0: return &r->reg_rax;
+        case 1: return &r->reg_rcx;
+        case 2: return &r->reg_rdx;
+        case 3: return &r->reg_rbx;
+        case 4: return &tf->tf_rsp;
+        case 5: return &r->reg_rbp;
+        case 6: return &r->reg_rsi;
+        case 7: return &r->reg_rdi;
+        case 8: return &r->reg_r8;
+        case 9: return &r->reg_r9;
+        case 10: return &r->reg_r10;
+        case 11: return &r->reg_r11;
+        case 12: return &r->reg_r12;
+        case 13: return &r->reg_r13;
+        case 14: return &r->reg_r14;
+        default: return &r->reg_r15;
+    }
+}
+
+static uint64_t
+size_mask( int size ) {
+    return size == 8 ? ~0ULL : ( 1ULL << ( 8 * size ) ) - 1;
+}
+
+// Without a REX prefix, byte registers 4 to 7 are AH, CH, DH and BH.
+static bool
+high_byte_reg( struct vmmio_insn *insn ) {
+    return insn->reg_size == 1 && !insn->rex && insn->reg >= 4 &&
+        insn->reg < 8;
+}
+
+static uint64_t
+reg_read( struct Trapframe *tf, struct vmmio_insn *insn ) {
+    if( high_byte_reg( insn ) )
+        return ( *guest_reg( tf, insn->reg - 4 ) >> 8 ) & 0xFF;
+    return *guest_reg( tf, insn->reg ) & size_mask( insn->size );
+}
+
+static void
+reg_write( struct Trapframe *tf, struct vmmio_insn *insn, uint64_t val ) {
+    uint64_t *r;
+
+    if( high_byte_reg( insn ) ) {
+        r = guest_reg( tf, insn->reg - 4 );
+        *r = ( *r & ~0xFF00ULL ) | ( ( val & 0xFF ) << 8 );
+        return;
+    }
+    r = guest_reg( tf, insn->reg );
+    val &= size_mask( insn->size );
+    // Writing a 32-bit register clears the upper half; narrower writes
+    // leave the rest of the register alone.
+    if( insn->reg_size >= 4 )
+        *r = val;
+    else
+        *r = ( *r & ~size_mask( insn->reg_size ) ) | val;
+}
+
+// Buffer a write to coalesced device dev.
+static void
+coalesce( struct vmmio_dev *dev, uint64_t off, int size, uint64_t val ) {
+    struct vmmio_write *w;
+
+    if( dev->npending > 0 ) {
+        w = &dev->pending[dev->npending - 1];
+        if( w->off == off && w->size == size ) {
+            w->val = val;
+            dev->merged++;
+            return;
+        }
+    }
+    if( dev->npending == VMMIO_RING_SIZE )
+        vmmio_flush( dev );
+    w = &dev->pending[dev->npending++];
+    w->off = off;
+    w->size = size;
+    w->val = val;
+    dev->coalesced++;
+}
+
+// Deliver a write to dev, or buffer it if dev is coalesced.  Anything the
+// guest's other devices buffer goes first.
+static void
+dev_write( struct Env *e, struct vmmio_dev *dev, uint64_t off, int size,
+           uint64_t val ) {
+    if( dev->flags & VMMIO_COALESCED ) {
+        coalesce( dev, off, size, val );
+    } else {
+        flush_guest( e->env_id );
+        dev->write( dev, off, size, val );
+    }
+}
+
+// Guest e faulted at gpa, outside its RAM.  If a device is registered
+// there, emulate the access and step over the instruction.
+// Returns false if the access cannot be emulated.
+bool
+vmmio_fault( struct Env *e, uint64_t gpa ) {
+    uint64_t qual = vmcs_read64( VMCS_VMEXIT_QUALIFICATION );
+    struct Trapframe *tf = &e->env_tf;
+    struct vmmio_insn insn;
+    struct vmmio_dev *dev;
+    uint64_t off, val;
+
+    if( !( dev = dev_lookup( e->env_id, gpa, 0 ) ) )
+        return false;
+    // Bit 2 of the qualification flags an instruction fetch.
+    if( BIT( qual, 2 ) || vmmio_decode( e, &insn ) < 0 ) {
+        cprintf( "vmmio: %s: cannot emulate access at rip %lx\n",
+                 dev->name, tf->tf_rip );
+        return false;
+    }
+    off = gpa - dev->base;
+    if( insn.write != BIT( qual, 1 ) || off + insn.size > dev->len )
+        return false;
+    dev->exits++;
+
+    if( insn.write ) {
+        val = insn.reg < 0 ? insn.imm : reg_read( tf, &insn );
+        dev_write( e, dev, off, insn.size, val & size_mask( insn.size ) );
+    } else {
+        flush_guest( e->env_id );
+        val = dev->read( dev, off, insn.size ) & size_mask( insn.size );
+        reg_write( tf, &insn, val );
+    }
+
+    tf->tf_rip += insn.len;
+    return true;
+}
+
+// Address size of the INS or OUTS that exited, in bytes.
+static int
+string_addr_size( void ) {
+    uint32_t cs_ar;
+
+    if( vmx_string_io_info_supported() )
+        return 2 << ( ( vmcs_read32( VMCS_32BIT_VMEXIT_INSTRUCTION_INFO ) >>
+                        7 ) & 7 );
+    // Without the instruction information, assume no address-size
+    // prefix; compilers do not emit one on string I/O.
+    cs_ar = vmcs_read32( VMCS_32BIT_GUEST_CS_ACCESS_RIGHTS );
+    if( BIT( cs_ar, 13 ) )
+        return 8;
+    return BIT( cs_ar, 14 ) ? 4 : 2;
+}
+
+// Set register r to val as a write of size bytes does: a 4- or 8-byte
+// write replaces the whole register, a narrower one keeps the rest.
+static void
+narrow_write( uint64_t *r, uint64_t val, int size ) {
+    if( size >= 4 )
+        *r = val & size_mask( size );
+    else
+        *r = ( *r & ~size_mask( size ) ) | ( val & size_mask( size ) );
+}
+
+// Carry out an INS or OUTS of size-byte elements at offset off of port
+// device dev, all RCX of them at once if rep.  The exit has already given
+// the linear address of the first element.
+//
+// If a guest page the transfer reaches is not resident, the registers are
+// left counting what is still to do and the guest waits for the page
+// before executing the instruction again to finish it.
+static bool
+pio_string( struct Env *e, struct vmmio_dev *dev, uint64_t off, int size,
+            bool in, bool rep ) {
+    struct Trapframe *tf = &e->env_tf;
+    struct guest_window w = GUEST_WINDOW_INIT;
+    int asize = string_addr_size();
+    uint64_t amask = size_mask( asize );
+    uint64_t *index = in ? &tf->tf_regs.reg_rdi : &tf->tf_regs.reg_rsi;
+    uint64_t start = *index & amask;
+    uint64_t base = vmcs_read64( VMCS_GUEST_LINEAR_ADDR ) - start;
+    int64_t step = ( vmcs_read64( VMCS_GUEST_RFLAGS ) & FL_DF ) ? -size : size;
+    uint64_t count = rep ? tf->tf_regs.reg_rcx & amask : 1;
+    uint64_t done, la = 0, val;
+    int r = 0;
+
+    // In 32-bit code the linear address wraps at 4 GB like the index.
+    if( asize < 8 )
+        base = (uint32_t) base;
+    if( in )
+        flush_guest( e->env_id );
+    for( done = 0; done < count; done++ ) {
+        la = base + ( ( start + done * step ) & amask );
+        if( asize < 8 )
+            la = (uint32_t) la;
+        val = 0;
+        if( in ) {
+            // Reading a port can have side effects, so make sure the
+            // element can be stored before asking the model for it.
+            if( ( r = window_map( e, &w, la + size - 1, true ) ) < 0 ||
+                ( r = window_map( e, &w, la, true ) ) < 0 )
+                break;
+            val = dev->read( dev, off, size );
+            if( ( r = guest_copy( e, &w, la, &val, size, true ) ) < 0 )
+                break;
+        } else {
+            if( ( r = guest_copy( e, &w, la, &val, size, false ) ) < 0 )
+                break;
+            dev_write( e, dev, off, size, val );
+        }
+    }
+
+    dev->elements += done;
+    narrow_write( index, start + done * step, asize );
+    if( rep )
+        narrow_write( &tf->tf_regs.reg_rcx, count - done, asize );
+    if( done == count ) {
+        tf->tf_rip += vmcs_read32( VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH );
+        return true;
+    }
+    if( w.gpa != ~0ULL && guest_gpa_is_ram( &e->env_vmxinfo, w.gpa ) )
+        return guest_ram_fault( e->env_pml4e, w.gpa, in );
+    cprintf( "vmmio: %s: cannot %s guest memory at %lx: %e\n", dev->name,
+             in ? "store to" : "load from", la, r );
+    return false;
+}
+
+// Guest e exited on an I/O instruction, with exit qualification qual, to
+// a port handle_ioinstr() does not model itself.  If a device is
+// registered there, emulate the instruction and step over it.
+// Returns false if the access cannot be emulated.
+bool
+vmmio_pio( struct Env *e, uint64_t qual ) {
+    struct Trapframe *tf = &e->env_tf;
+    uint16_t port = ( qual >> 16 ) & 0xFFFF;
+    int size = ( qual & 7 ) + 1;
+    bool in = BIT( qual, 3 );
+    struct vmmio_dev *dev;
+    uint64_t off, val;
+
+    if( !( dev = dev_lookup( e->env_id, port, VMMIO_PIO ) ) ) {
+        cprintf( "vmmio: no device at port %x\n", port );
+        return false;
+    }
+    off = port - dev->base;
+    if( off + size > dev->len )
+        return false;
+    dev->exits++;
+
+    // Bit 4 flags INS and OUTS, bit 5 a REP prefix.
+    if( BIT( qual, 4 ) )
+        return pio_string( e, dev, off, size, in, BIT( qual, 5 ) );
+
+    if( in ) {
+        flush_guest( e->env_id );
+        val = dev->read( dev, off, size ) & size_mask( size );
+        // IN EAX clears the upper half of RAX; AL and AX keep the rest.
+        narrow_write( &tf->tf_regs.reg_rax, val, size );
+    } else {
+        dev_write( e, dev, off, size,
+                   tf->tf_regs.reg_rax & size_mask( size ) );
+    }
+    tf->tf_rip += vmcs_read32( VMCS_32BIT_VMEXIT_INSTRUCTION_LENGTH );
+    return true;
+}
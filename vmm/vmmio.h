@@ -0,0 +1,77 @@
+#ifndef JOS_VMM_VMMIO_H
+#define JOS_VMM_VMMIO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+
+// Emulated MMIO.  A device model registers a range of a guest's physical
+// address space that is left unmapped in the EPT; guest loads and stores
+// there fault, and vmmio_fault() decodes the MOV that faulted and calls the
+// model's read or write hook.
+//
+// A model can claim a range of I/O ports instead, registering it with
+// VMMIO_PIO.  The ports are set in the guest's I/O bitmaps, and
+// vmmio_pio() serves IN and OUT from the exit qualification alone.  INS
+// and OUTS, with or without REP, are carried out in full in the one exit:
+// every element goes through the model's hooks and RCX, RSI and RDI are
+// left as the instruction would leave them.
+
+#define VMMIO_MAX_DEVS		32	// Registered ranges, all guests together
+#define VMMIO_RING_SIZE		64	// Pending writes per coalesced device
+
+// Registration flags.
+#define VMMIO_COALESCED		0x1	// Writes may be buffered and batched
+#define VMMIO_PIO		0x2	// The range is of I/O ports, not memory
+
+struct vmmio_dev;
+
+// Hooks of a device model.  off is relative to the start of the range and
+// size is the access size in bytes: 1, 2, 4 or 8 (at most 4 for ports).
+typedef uint64_t (*vmmio_read_fn)( struct vmmio_dev *dev, uint64_t off,
+                                   int size );
+typedef void (*vmmio_write_fn)( struct vmmio_dev *dev, uint64_t off,
+                                int size, uint64_t val );
+
+struct vmmio_write {
+    uint64_t off;
+    uint64_t val;
+    int size;
+};
+
+struct vmmio_dev {
+    const char *name;
+    envid_t guest;		// Owning guest, or 0 if the slot is free
+    uint64_t base;		// Guest physical or port range
+    uint64_t len;
+    int flags;			// VMMIO_*
+    vmmio_read_fn read;
+    vmmio_write_fn write;
+    void *opaque;		// For the device model
+
+    // Coalesced writes not yet replayed to the model, oldest first.
+    struct vmmio_write pending[VMMIO_RING_SIZE];
+    int npending;
+
+    // Statistics.
+    uint64_t exits;		// Accesses emulated
+    uint64_t coalesced;		// Writes buffered instead of delivered
+    uint64_t merged;		// Buffered writes overwritten by a later one
+    uint64_t replays;		// Times the pending writes were delivered
+    uint64_t elements;		// Port accesses made by INS and OUTS
+};
+
+int vmmio_register( struct Env *e, const char *name, uint64_t base,
+                    uint64_t len, int flags, vmmio_read_fn read,
+                    vmmio_write_fn write, void *opaque,
+                    struct vmmio_dev **dev_store );
+void vmmio_unregister( struct vmmio_dev *dev );
+void vmmio_flush( struct vmmio_dev *dev );
+void vmmio_release( struct Env *e );
+
+bool vmmio_fault( struct Env *e, uint64_t gpa );
+bool vmmio_pio( struct Env *e, uint64_t qual );
+
+#endif /* !JOS_VMM_VMMIO_H */
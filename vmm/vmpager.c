@@ -0,0 +1,442 @@
+
+#include <vmm/vmpager.h>
+
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <vmm/vmwss.h>
+
+// Kernel half of host-side guest paging; see inc/vmpager.h.
+//
+// A guest that touches a swapped-out page, or that faults when host memory
+// has run out, is marked ENV_NOT_RUNNABLE and a request is queued for the
+// pager.  The pager completes a page-in with vmpager_pagein(), which makes
+// the guest runnable again.  Guests waiting for memory are released each
+// time the pager runs out of requests, and simply fault again; if the
+// pager could evict nothing and no memory is free, they are killed.
+
+// Each guest has at most one page-in outstanding, since it is blocked until
+// the page arrives, and there is at most one reclaim request.
+#define VMPAGER_NREQS	( NENV + 1 )
+
+// Guards the pager's registration and the request queue below.  Requests
+// are queued from the VM-exit path and taken by the pager's system calls.
+static struct spinlock pager_lock = {
+#ifdef DEBUG_SPINLOCK
+    .name = "pager_lock"
+#endif
+};
+
+static envid_t pager_envid;		// Registered pager, or 0
+static bool pager_waiting;		// Pager is blocked in vmpager_wait()
+static bool reclaim_pending;		// A RECLAIM request is queued
+static bool reclaim_active;		// The pager is working on a RECLAIM
+static uint64_t reclaim_evicted;	// Pages it has evicted for it so far
+
+static struct vmpager_req reqs[VMPAGER_NREQS];
+static uint32_t req_head, req_tail;
+
+// Return the registered pager env, or NULL if there is none (or it died).
+// The caller holds pager_lock.
+static struct Env *
+pager_env_locked( void ) {
+    struct Env *e;
+
+    if( pager_envid == 0 )
+        return NULL;
+    if( envid2env( pager_envid, &e, 0 ) < 0 ) {
+        pager_envid = 0;
+        pager_waiting = false;
+        return NULL;
+    }
+    return e;
+}
+
+static struct Env *
+pager_env( void ) {
+    struct Env *e;
+
+    spin_lock( &pager_lock );
+    e = pager_env_locked();
+    spin_unlock( &pager_lock );
+    return e;
+}
+
+// Queue a request and wake the pager if it is waiting for one.  The
+// caller holds pager_lock.
+static int
+req_push( struct vmpager_req *req ) {
+    struct Env *pager;
+
+    if( req_tail - req_head == VMPAGER_NREQS )
+        return -E_NO_MEM;
+    reqs[req_tail++ % VMPAGER_NREQS] = *req;
+
+    pager = pager_env_locked();
+    if( pager && pager_waiting ) {
+        pager_waiting = false;
+        env_set_status( pager, ENV_RUNNABLE );
+    }
+    return 0;
+}
+
+static void
+request_reclaim( void ) {
+    struct vmpager_req req = { VMPAGER_REQ_RECLAIM, 0, 0, 0 };
+
+    spin_lock( &pager_lock );
+    if( !reclaim_pending && req_push( &req ) == 0 )
+        reclaim_pending = true;
+    spin_unlock( &pager_lock );
+}
+
+static void
+guest_block( struct Env *e, int why, uint64_t gpa ) {
+    e->env_vmxinfo.pager_wait = why;
+    e->env_vmxinfo.pager_gpa = ROUNDDOWN( gpa, PGSIZE );
+    env_set_status( e, ENV_NOT_RUNNABLE );
+}
+
+static void
+guest_unblock( struct Env *e ) {
+    e->env_vmxinfo.pager_wait = VMPAGER_WAIT_NONE;
+    env_set_status( e, ENV_RUNNABLE );
+}
+
+// The guest e touched gpa, whose EPT entry epte is a swap marker.  Block
+// the guest until the pager reads the page back.
+// Returns false if there is no pager to ask.
+bool
+vmpager_fault( struct Env *e, uint64_t gpa, epte_t *epte ) {
+    struct vmpager_req req;
+    int r;
+
+    if( !pager_env() )
+        return false;
+
+    req.type = VMPAGER_REQ_PAGEIN;
+    req.guest = e->env_id;
+    req.gpa = ROUNDDOWN( gpa, PGSIZE );
+    req.slot = EPTE_SWAP_SLOT( *epte );
+    spin_lock( &pager_lock );
+    r = req_push( &req );
+    spin_unlock( &pager_lock );
+    if( r < 0 )
+        return false;
+    guest_block( e, VMPAGER_WAIT_PAGEIN, gpa );
+    return true;
+}
+
+// No host page was free to back gpa in guest e.  Block the guest and ask
+// the pager to make room.
+// Returns false if there is no pager to ask.
+bool
+vmpager_nomem( struct Env *e, uint64_t gpa ) {
+    if( !pager_env() )
+        return false;
+    request_reclaim();
+    guest_block( e, VMPAGER_WAIT_NOMEM, gpa );
+    return true;
+}
+
+// Called after a guest page has been allocated: start reclaiming before
+// host memory runs out, while the pager can still allocate its buffers.
+void
+vmpager_check_memory( void ) {
+    if( page_nfree < VMPAGER_LOW_WATER && pager_env() )
+        request_reclaim();
+}
+
+// Look up a guest for the pager.  Only the registered pager may page.
+static int
+pager_guest( envid_t guest, struct Env **ge ) {
+    struct Env *pager = pager_env();
+
+    if( !pager || pager != curenv )
+        return -E_BAD_ENV;
+    if( envid2env( guest, ge, 0 ) < 0 || (*ge)->env_type != ENV_TYPE_GUEST )
+        return -E_BAD_ENV;
+    return 0;
+}
+
+// Is gpa a page of guest RAM the pager may move?  Low memory holds the
+// guest's boot structures and the VGA window, so it always stays resident.
+static bool
+pageable_gpa( struct Env *ge, uint64_t gpa ) {
+    return gpa % PGSIZE == 0 && gpa >= EXTPHYSMEM &&
+        guest_gpa_is_ram( &ge->env_vmxinfo, gpa );
+}
+
+// Register curenv as the pager, if there is none yet, and return the next
+// request in *req.  If there is none, release guests waiting for memory and
+// block until one arrives.  Only the pager the kernel started at boot
+// (ENV_TYPE_PAGER) may register: the pager can read and replace any
+// guest's memory.
+//
+// Returns 1 if *req was filled in, 0 after blocking (the caller should ask
+// again), or -E_BAD_ENV if curenv is not of type ENV_TYPE_PAGER or another
+// env is already the pager.
+int
+vmpager_wait( struct vmpager_req *req ) {
+    struct Env *pager;
+    bool stuck;
+    int i;
+
+    if( curenv->env_type != ENV_TYPE_PAGER )
+        return -E_BAD_ENV;
+
+    spin_lock( &pager_lock );
+    pager = pager_env_locked();
+    if( pager && pager != curenv ) {
+        spin_unlock( &pager_lock );
+        return -E_BAD_ENV;
+    }
+    pager_envid = curenv->env_id;
+
+    if( req_head != req_tail ) {
+        *req = reqs[req_head++ % VMPAGER_NREQS];
+        if( req->type == VMPAGER_REQ_RECLAIM ) {
+            reclaim_pending = false;
+            reclaim_active = true;
+            reclaim_evicted = 0;
+        }
+        spin_unlock( &pager_lock );
+        return 1;
+    }
+    // A reclaim that evicted nothing, with no memory free, means swap is
+    // full or nothing is left to evict: waiting would only fault again.
+    stuck = reclaim_active && reclaim_evicted == 0 && page_nfree == 0;
+    reclaim_active = false;
+    // Block before a request can be queued, so its wakeup is not lost.
+    pager_waiting = true;
+    env_set_status( curenv, ENV_NOT_RUNNABLE );
+    spin_unlock( &pager_lock );
+
+    for( i = 0; i < NENV; i++ ) {
+        if( envs[i].env_status != ENV_NOT_RUNNABLE ||
+            envs[i].env_type != ENV_TYPE_GUEST ||
+            envs[i].env_vmxinfo.pager_wait != VMPAGER_WAIT_NOMEM )
+            continue;
+        if( stuck ) {
+            cprintf( "[%08x] out of memory and swap; killing guest %08x\n",
+                     curenv->env_id, envs[i].env_id );
+            env_destroy( &envs[i] );
+        } else
+            guest_unblock( &envs[i] );
+    }
+
+    curenv->env_tf.tf_regs.reg_rax = 0;
+    sched_yield();
+}
+
+struct scan_state {
+    struct Env *ge;
+    uint64_t *gpas;
+    int n, found;
+    bool aged;		// Some accessed bit was cleared
+    uint64_t next;	// Where the next scan should start
+};
+
+// Second-chance victim selection: a page whose accessed bit is set has its
+// bit cleared and is passed over; one that is still clear on the next visit
+// has not been used since and is taken.  Without EPT accessed bits every
+// page looks cold and the cursor degrades to FIFO order.
+static int
+scan_one( epte_t *epte, uint64_t gpa, void *arg ) {
+    struct scan_state *s = arg;
+    struct Page *pp;
+
+    if( !( *epte & __EPTE_FULL ) || ( *epte & __EPTE_SZ ) )
+        return 0;
+    if( !pageable_gpa( s->ge, gpa ) )
+        return 0;
+    // Pages shared with another mapping cannot be written out.
+    pp = pa2page( PTE_ADDR( *epte ) );
+    if( pp->pp_ref != 1 )
+        return 0;
+
+    s->next = gpa + PGSIZE;
+    if( ept_ad_supported() && ( *epte & __EPTE_A ) ) {
+        *epte &= ~__EPTE_A;
+        // Let the working-set sampler see this access too.
+        pp->pp_age = ( pp->pp_age & ~VMWSS_AGE_SEEN ) | VMWSS_AGE_REF;
+        s->aged = true;
+        return 0;
+    }
+    // The sampler cleared the bit of an access we have not seen: that
+    // counts as a reference too.
+    if( pp->pp_age & VMWSS_AGE_SEEN ) {
+        pp->pp_age &= ~VMWSS_AGE_SEEN;
+        return 0;
+    }
+    s->gpas[s->found++] = gpa;
+    return s->found == s->n;
+}
+
+// Pick up to n cold pages of guest RAM and store their gpas in gpas[].
+// Scanning resumes where the previous scan of this guest stopped and wraps
+// around once; a second lap finds the pages whose accessed bits the first
+// lap cleared.
+//
+// Returns the number of gpas stored, or
+//	-E_BAD_ENV if curenv is not the pager or guest is not a guest env.
+//	-E_INVAL if n < 0.
+int
+vmpager_scan( envid_t guest, uint64_t *gpas, int n ) {
+    struct scan_state s;
+    struct Env *ge;
+    uint64_t end, start;
+    int r, lap;
+
+    if( ( r = pager_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( n < 0 )
+        return -E_INVAL;
+
+    end = guest_highmem_end( &ge->env_vmxinfo );
+    if( end == 0 )
+        end = guest_lowmem_end( &ge->env_vmxinfo );
+    start = ge->env_vmxinfo.pager_cursor;
+    if( start < EXTPHYSMEM || start >= end )
+        start = EXTPHYSMEM;
+
+    s.ge = ge;
+    s.gpas = gpas;
+    s.n = n;
+    s.found = 0;
+    s.aged = false;
+    s.next = start;
+    for( lap = 0; lap < 2 && s.found < n; lap++ ) {
+        if( ept_walk_range( ge->env_pml4e, start, end, scan_one, &s ) )
+            break;
+        if( ept_walk_range( ge->env_pml4e, EXTPHYSMEM, start, scan_one, &s ) )
+            break;
+    }
+    ge->env_vmxinfo.pager_cursor = s.next;
+
+    // The guest's TLB may still hold translations whose accessed bit
+    // we cleared; without a flush the hardware would not set it again.
+    if( s.aged )
+        ept_invalidate( ge->env_pml4e );
+    return s.found;
+}
+
+// Take the pages at gpas[0 .. n) away from guest, leaving the swap marker
+// for slots[i] in the EPT entry of gpas[i], and map them read-only at va,
+// va + PGSIZE, ... in the pager so they can be written out.  A single
+// INVEPT covers the whole batch.  Stops at the first page that cannot be
+// evicted.
+//
+// Returns the number of pages evicted, or, if that is none,
+//	-E_BAD_ENV if curenv is not the pager or guest is not a guest env.
+//	-E_INVAL if n is out of range, gpas[0] is not a resident, unshared
+//		page of pageable guest RAM, or va is not a page-aligned
+//		address with n pages below UTOP.
+//	-E_NO_MEM if a page table for va could not be allocated.
+int
+vmpager_evict( envid_t guest, const uint64_t *gpas, const uint64_t *slots,
+               int n, void *va ) {
+    struct Env *ge;
+    struct Page *pp;
+    epte_t *epte;
+    int i, r;
+
+    if( ( r = pager_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( n <= 0 || n > VMPAGER_EVICT_MAX )
+        return -E_INVAL;
+    if( (uintptr_t) va % PGSIZE || (uintptr_t) va > UTOP - n * PGSIZE )
+        return -E_INVAL;
+
+    for( i = 0; i < n; i++ ) {
+        r = -E_INVAL;
+        if( !pageable_gpa( ge, gpas[i] ) )
+            break;
+        epte = epml4e_walk( ge->env_pml4e, (void *) gpas[i], 0 );
+        if( !epte || !( *epte & __EPTE_FULL ) || ( *epte & __EPTE_SZ ) )
+            break;
+        pp = pa2page( PTE_ADDR( *epte ) );
+        if( pp->pp_ref != 1 )
+            break;
+        if( ( r = page_insert( curenv->env_pml4e, pp,
+                               (char *) va + i * PGSIZE, PTE_P | PTE_U ) ) < 0 )
+            break;
+        *epte = EPTE_SWAP_ENTRY( slots[i] );
+        page_decref( pp );
+    }
+    if( i == 0 )
+        return r;
+    ept_invalidate( ge->env_pml4e );
+    spin_lock( &pager_lock );
+    reclaim_evicted += i;
+    spin_unlock( &pager_lock );
+    return i;
+}
+
+// Map the pager's page at va at gpa in guest, replacing the swap marker
+// there, and let the guest run again if it was waiting for this page.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if curenv is not the pager or guest is not a guest env.
+//	-E_INVAL if gpa is not swapped out or nothing is mapped at va.
+//	-E_NO_MEM if the page could not be mapped.
+int
+vmpager_pagein( envid_t guest, uint64_t gpa, void *va ) {
+    struct VmxGuestInfo *ginfo;
+    struct Env *ge;
+    struct Page *pp;
+    epte_t *epte;
+    int r;
+
+    if( ( r = pager_guest( guest, &ge ) ) < 0 )
+        return r;
+    if( !pageable_gpa( ge, gpa ) || (uintptr_t) va >= UTOP )
+        return -E_INVAL;
+    if( !( pp = page_lookup( curenv->env_pml4e, va, NULL ) ) )
+        return -E_INVAL;
+    epte = epml4e_walk( ge->env_pml4e, (void *) gpa, 0 );
+    if( !epte || !( *epte & __EPTE_SWAPPED ) || ( *epte & __EPTE_FULL ) )
+        return -E_INVAL;
+
+    if( ( r = ept_page_insert( ge->env_pml4e, pp, (void *) gpa,
+                               __EPTE_FULL ) ) < 0 )
+        return r;
+
+    ginfo = &ge->env_vmxinfo;
+    if( ginfo->pager_wait == VMPAGER_WAIT_PAGEIN && ginfo->pager_gpa == gpa )
+        guest_unblock( ge );
+    return 0;
+}
+
+// The pager could not bring gpa back for guest.  If retry is set the
+// failure was transient, such as the pager running out of memory: let the
+// guest run, and it will fault and ask again.  Otherwise the page is lost,
+// and so is the guest.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if curenv is not the pager or guest is not a guest env.
+//	-E_INVAL if guest is not waiting for gpa.
+int
+vmpager_fail( envid_t guest, uint64_t gpa, bool retry ) {
+    struct VmxGuestInfo *ginfo;
+    struct Env *ge;
+    int r;
+
+    if( ( r = pager_guest( guest, &ge ) ) < 0 )
+        return r;
+    ginfo = &ge->env_vmxinfo;
+    if( ginfo->pager_wait != VMPAGER_WAIT_PAGEIN ||
+        ginfo->pager_gpa != ROUNDDOWN( gpa, PGSIZE ) )
+        return -E_INVAL;
+    if( retry ) {
+        guest_unblock( ge );
+        return 0;
+    }
+    cprintf( "[%08x] guest page %llx lost in swap; killing guest %08x\n",
+             curenv->env_id, (unsigned long long) gpa, ge->env_id );
+    env_destroy( ge );
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef JOS_VMM_VMPAGER_H
+#define JOS_VMM_VMPAGER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/vmpager.h>
+#include <kern/env.h>
+#include <vmm/ept.h>
+
+bool vmpager_fault( struct Env *e, uint64_t gpa, epte_t *epte );
+bool vmpager_nomem( struct Env *e, uint64_t gpa );
+void vmpager_check_memory( void );
+
+int vmpager_wait( struct vmpager_req *req );
+int vmpager_scan( envid_t guest, uint64_t *gpas, int n );
+int vmpager_evict( envid_t guest, const uint64_t *gpas, const uint64_t *slots,
+                   int n, void *va );
+int vmpager_pagein( envid_t guest, uint64_t gpa, void *va );
+int vmpager_fail( envid_t guest, uint64_t gpa, bool retry );
+
+#endif /* !JOS_VMM_VMPAGER_H */
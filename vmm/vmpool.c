@@ -0,0 +1,258 @@
+
+#include <vmm/vmpool.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/vmpager.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+#include <kern/console.h>
+#include <vmm/vmx.h>
+#include <vmm/vmx_asm.h>
+#include <vmm/vmexits.h>
+
+// Pool of pre-built guest shells.
+//
+// A guest needs six pages of its own before it can run (EPT root, VMCS,
+// MSR load/store area, two I/O bitmaps and the CPUID table), and its VMCS
+// must be loaded with host state, initial guest state and controls one
+// field at a time.  A shell is all of that done in advance: the pages
+// allocated and zeroed, the CPUID table filled in from the default policy
+// and the VMCS set up and cleared again.  env_guest_alloc() takes a ready
+// shell in O(1) when there is one; otherwise it allocates the pages on the
+// spot and vmx_vmrun() sets the VMCS up on the first run, as before.
+//
+// env_guest_free() hands a dead guest's pages back as a dirty shell, all
+// but its EPT root, which goes to the reclaim queue with the rest of the
+// tables.  Dirty shells are scrubbed (VMCS, MSR area and bitmaps wiped, a
+// fresh EPT root put in) and missing ones built one per pass of the idle
+// loop, so neither creating nor destroying a guest pays for it.  Setting a
+// VMCS up needs VMX root operation, so the pool only fills once the first
+// guest has run, and it leaves the pages the pager relies on alone.
+//
+// The pool keeps vmpool_target ready shells, which the kernel monitor's
+// "vmpool" command changes.  When page_alloc() runs dry it takes shells
+// back one at a time.
+
+struct vmpool_shell {
+    uint64_t *pml4;
+    uintptr_t *vmcs;
+    void *msr_area;		// Host entries, then the guest's
+    int msr_count;
+    uint64_t *io_bmap_a;
+    uint64_t *io_bmap_b;
+    struct vmx_cpuid_table *cpuid_table;
+    int host_cpu;		// CPU whose host state the VMCS holds
+};
+
+static struct vmpool_shell ready[VMPOOL_MAX];
+static struct vmpool_shell dirty[VMPOOL_MAX];
+static int nready, ndirty;
+static int vmpool_target = VMPOOL_DEFAULT;
+
+// Statistics.
+static uint64_t hits, misses, built, scrubbed;
+
+static void *
+zpage( void ) {
+    struct Page *pp = page_alloc( ALLOC_ZERO );
+
+    if( !pp )
+        return NULL;
+    pp->pp_ref++;
+    return page2kva( pp );
+}
+
+static void
+kva_decref( void *kva ) {
+    if( kva )
+        page_decref( pa2page( PADDR( kva ) ) );
+}
+
+static void
+shell_free( struct vmpool_shell *s ) {
+    // The CPU may still cache the VMCS of a guest that has just died.
+    if( s->vmcs && thiscpu->is_vmx_root )
+        vmclear( PADDR( s->vmcs ) );
+    kva_decref( s->pml4 );
+    kva_decref( s->vmcs );
+    kva_decref( s->msr_area );
+    kva_decref( s->io_bmap_a );
+    kva_decref( s->io_bmap_b );
+    kva_decref( s->cpuid_table );
+}
+
+// Allocate the pages of a shell.  Its VMCS is not set up.
+static int
+shell_alloc( struct vmpool_shell *s ) {
+    struct Page *pp;
+
+    memset( s, 0, sizeof( *s ) );
+    s->pml4 = zpage();
+    if( ( pp = vmx_init_vmcs() ) )
+        s->vmcs = page2kva( pp );
+    s->msr_area = zpage();
+    s->io_bmap_a = zpage();
+    s->io_bmap_b = zpage();
+    s->cpuid_table = zpage();
+    if( !s->pml4 || !s->vmcs || !s->msr_area || !s->io_bmap_a ||
+        !s->io_bmap_b || !s->cpuid_table ) {
+        shell_free( s );
+        return -E_NO_MEM;
+    }
+    vmx_cpuid_init( s->cpuid_table, &vmx_cpuid_default_policy );
+    return 0;
+}
+
+static void
+shell_install( struct vmpool_shell *s, struct VmxGuestInfo *ginfo ) {
+    ginfo->vmcs = s->vmcs;
+    ginfo->msr_count = s->msr_count;
+    ginfo->msr_host_area = s->msr_area;
+    ginfo->msr_guest_area = (uintptr_t *) ( (char *) s->msr_area +
+                                            PGSIZE / 2 );
+    ginfo->io_bmap_a = s->io_bmap_a;
+    ginfo->io_bmap_b = s->io_bmap_b;
+    ginfo->cpuid_table = s->cpuid_table;
+    ginfo->vmcs_cpu = s->host_cpu;
+}
+
+// Set up the VMCS of s, then clear it so that it is no longer current.
+static int
+shell_prepare( struct vmpool_shell *s ) {
+    struct VmxGuestInfo ginfo;
+    int r;
+
+    memset( &ginfo, 0, sizeof( ginfo ) );
+    shell_install( s, &ginfo );
+    if( ( r = vmx_vmcs_setup( &ginfo, s->pml4 ) ) < 0 )
+        return r;
+    s->msr_count = ginfo.msr_count;
+    s->host_cpu = ginfo.vmcs_cpu;
+    return vmclear( PADDR( s->vmcs ) ) ? -E_VMCS_INIT : 0;
+}
+
+// Turn a dead guest's shell back into one as good as new.
+static int
+shell_scrub( struct vmpool_shell *s ) {
+    if( !( s->pml4 = zpage() ) )
+        return -E_NO_MEM;
+    if( vmx_vmcs_scrub( s->vmcs ) < 0 )
+        return -E_VMCS_INIT;
+    memset( s->msr_area, 0, PGSIZE );
+    memset( s->io_bmap_a, 0, PGSIZE );
+    memset( s->io_bmap_b, 0, PGSIZE );
+    vmx_cpuid_init( s->cpuid_table, &vmx_cpuid_default_policy );
+    s->msr_count = 0;
+    return shell_prepare( s );
+}
+
+// Give the new guest e its EPT root, VMCS, MSR area, I/O bitmaps and CPUID
+// table: a ready shell's if there is one, fresh pages otherwise.
+//
+// Returns 0 on success, or -E_NO_MEM if the pages could not be allocated.
+int
+vmpool_get( struct Env *e ) {
+    struct vmpool_shell s;
+    int r;
+
+    if( nready > 0 ) {
+        s = ready[--nready];
+        e->env_vmxinfo.vmcs_ready = true;
+        hits++;
+    } else {
+        if( ( r = shell_alloc( &s ) ) < 0 )
+            return r;
+        misses++;
+    }
+    shell_install( &s, &e->env_vmxinfo );
+    e->env_pml4e = s.pml4;
+    e->env_cr3 = PADDR( s.pml4 );
+    return 0;
+}
+
+// Guest e is going away: keep its pages, bar the EPT tables, as a dirty
+// shell if the pool is short of shells, and free them otherwise.
+void
+vmpool_put( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct vmpool_shell s;
+
+    memset( &s, 0, sizeof( s ) );
+    s.vmcs = ginfo->vmcs;
+    s.msr_area = ginfo->msr_host_area;
+    s.io_bmap_a = ginfo->io_bmap_a;
+    s.io_bmap_b = ginfo->io_bmap_b;
+    s.cpuid_table = ginfo->cpuid_table;
+    if( nready + ndirty < vmpool_target )
+        dirty[ndirty++] = s;
+    else
+        shell_free( &s );
+}
+
+// Scrub one dirty shell or build one missing shell.  Called when the CPU
+// would otherwise idle.
+void
+vmpool_work( void ) {
+    struct vmpool_shell s;
+
+    if( !thiscpu->is_vmx_root )
+        return;
+    while( nready + ndirty > vmpool_target )
+        vmpool_shrink();
+    if( page_nfree < VMPAGER_LOW_WATER )
+        return;
+
+    if( ndirty > 0 ) {
+        s = dirty[--ndirty];
+        if( shell_scrub( &s ) < 0 ) {
+            shell_free( &s );
+            return;
+        }
+        scrubbed++;
+    } else if( nready < vmpool_target ) {
+        if( shell_alloc( &s ) < 0 )
+            return;
+        if( shell_prepare( &s ) < 0 ) {
+            shell_free( &s );
+            return;
+        }
+        built++;
+    } else {
+        return;
+    }
+    ready[nready++] = s;
+}
+
+// Free one shell, dirty ones first, for page_alloc(), which has run out
+// of pages.
+// Returns false if the pool is empty.
+bool
+vmpool_shrink( void ) {
+    struct vmpool_shell *s;
+
+    if( ndirty > 0 )
+        s = &dirty[--ndirty];
+    else if( nready > 0 )
+        s = &ready[--nready];
+    else
+        return false;
+    shell_free( s );
+    return true;
+}
+
+// Keep target ready shells, at most VMPOOL_MAX.  The pool grows or shrinks
+// to match from the idle loop.
+void
+vmpool_set_target( int target ) {
+    vmpool_target = MAX( 0, MIN( target, VMPOOL_MAX ) );
+}
+
+void
+vmpool_dump( void ) {
+    cprintf( "vmpool: %d ready, %d dirty, target %d\n", nready, ndirty,
+             vmpool_target );
+    cprintf( "vmpool: %lld hits, %lld misses, %lld built, %lld scrubbed\n",
+             (long long) hits, (long long) misses, (long long) built,
+             (long long) scrubbed );
+}
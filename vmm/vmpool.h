@@ -0,0 +1,20 @@
+#ifndef JOS_VMM_VMPOOL_H
+#define JOS_VMM_VMPOOL_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+
+#define VMPOOL_MAX		16	// Shells kept, ready and dirty together
+#define VMPOOL_DEFAULT		4	// Ready shells kept unless told otherwise
+
+int vmpool_get( struct Env *e );
+void vmpool_put( struct Env *e );
+void vmpool_work( void );
+bool vmpool_shrink( void );
+void vmpool_set_target( int target );
+void vmpool_dump( void );
+
+#endif /* !JOS_VMM_VMPOOL_H */
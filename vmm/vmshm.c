@@ -0,0 +1,260 @@
+
+#include <vmm/vmshm.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <vmm/ept.h>
+#include <vmm/vmx.h>
+
+// Inter-VM shared memory; see inc/vmx.h.
+//
+// An object is a set of host pages named by a key.  Host envs bind it to
+// ports of their guests with vmshm_bind(), the first bind creating it, and
+// it goes away when the last guest bound to it does.  A guest then points
+// pages of its own RAM at the object's pages with VMX_VMCALL_SHM_MAP,
+// which replaces their EPT backing, so data written by one guest is read
+// by the others without a copy or an exit.  The object holds a reference
+// on each page, which also keeps the pager away from them.
+
+#define VMSHM_MAX	16	// Objects
+#define VMSHM_MAX_BINDS	8	// Guest ports bound to one object
+
+struct vmshm {
+    uint32_t key;
+    int npages;				// 0 if the slot is free
+    struct Page *pages[VMX_SHM_MAX_PAGES];
+    struct {
+        envid_t guest;
+        int port;
+    } binds[VMSHM_MAX_BINDS];
+    int nbinds;
+};
+
+static struct vmshm shms[VMSHM_MAX];
+
+static void
+shm_free( struct vmshm *shm ) {
+    int i;
+
+    for( i = 0; i < shm->npages; i++ )
+        if( shm->pages[i] )
+            page_decref( shm->pages[i] );
+    shm->npages = 0;
+    shm->nbinds = 0;
+}
+
+// Find the object named key, or create one of npages pages.
+static int
+shm_get( uint32_t key, int npages, struct vmshm **shm_store ) {
+    struct vmshm *shm, *free = NULL;
+    int i;
+
+    for( i = 0; i < VMSHM_MAX; i++ ) {
+        shm = &shms[i];
+        if( shm->npages == 0 ) {
+            if( !free )
+                free = shm;
+        } else if( shm->key == key ) {
+            if( shm->npages != npages )
+                return -E_INVAL;
+            *shm_store = shm;
+            return 0;
+        }
+    }
+    if( !free )
+        return -E_NO_MEM;
+
+    memset( free, 0, sizeof( *free ) );
+    free->key = key;
+    free->npages = npages;
+    for( i = 0; i < npages; i++ ) {
+        if( !( free->pages[i] = page_alloc( ALLOC_ZERO ) ) ) {
+            shm_free( free );
+            return -E_NO_MEM;
+        }
+        free->pages[i]->pp_ref++;
+    }
+    *shm_store = free;
+    return 0;
+}
+
+// The object bound to port of guest e, or NULL.
+static struct vmshm *
+port_shm( struct Env *e, int port ) {
+    if( port < 0 || port >= VMX_SHM_PORTS || !e->env_vmxinfo.shm_ports[port] )
+        return NULL;
+    return &shms[e->env_vmxinfo.shm_ports[port] - 1];
+}
+
+// Bind the shared memory object named key, of npages pages, to port of
+// guest, creating the object if no guest is bound to it yet.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if guest does not exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, port or npages is out of range,
+//		or the object exists with a different size.
+//	-E_BUSY if the port is already bound.
+//	-E_NO_MEM if there is no room for another object or bind, or its
+//		pages could not be allocated.
+int
+vmshm_bind( envid_t guest, uint32_t key, int npages, int port ) {
+    struct vmshm *shm;
+    struct Env *ge;
+    int r;
+
+    if( ( r = envid2env( guest, &ge, 1 ) ) < 0 )
+        return r;
+    if( ge->env_type != ENV_TYPE_GUEST )
+        return -E_INVAL;
+    if( port < 0 || port >= VMX_SHM_PORTS ||
+        npages <= 0 || npages > VMX_SHM_MAX_PAGES )
+        return -E_INVAL;
+    if( ge->env_vmxinfo.shm_ports[port] )
+        return -E_BUSY;
+
+    if( ( r = shm_get( key, npages, &shm ) ) < 0 )
+        return r;
+    if( shm->nbinds == VMSHM_MAX_BINDS )
+        return -E_NO_MEM;
+    shm->binds[shm->nbinds].guest = guest;
+    shm->binds[shm->nbinds].port = port;
+    shm->nbinds++;
+    ge->env_vmxinfo.shm_ports[port] = shm - shms + 1;
+    return 0;
+}
+
+// Guest e is going away: unbind its ports, freeing objects no other
+// guest is bound to.  The EPT entries pointing at object pages hold their
+// own references, which the EPT teardown drops.
+void
+vmshm_release( struct Env *e ) {
+    struct vmshm *shm;
+    int port, i;
+
+    for( port = 0; port < VMX_SHM_PORTS; port++ ) {
+        if( !( shm = port_shm( e, port ) ) )
+            continue;
+        for( i = 0; i < shm->nbinds; i++ )
+            if( shm->binds[i].guest == e->env_id &&
+                shm->binds[i].port == port ) {
+                shm->binds[i] = shm->binds[--shm->nbinds];
+                break;
+            }
+        if( shm->nbinds == 0 )
+            shm_free( shm );
+        e->env_vmxinfo.shm_ports[port] = 0;
+    }
+    e->env_vmxinfo.shm_pending = 0;
+    e->env_vmxinfo.shm_waiting = 0;
+}
+
+// Returns the size in pages of the object bound to port of guest e, or
+// -E_NO_ENT if none is.
+int
+vmshm_info( struct Env *e, int port ) {
+    struct vmshm *shm = port_shm( e, port );
+
+    return shm ? shm->npages : -E_NO_ENT;
+}
+
+// Back the guest RAM page at gpa of guest e with page index of the object
+// bound to port, releasing the host page that backed it before.  Whatever
+// the guest had stored in that page is lost; if the pager had swapped it
+// out, its swap slot is only reclaimed when the guest exits.
+//
+// Returns 0 on success, or
+//	-E_NO_ENT if no object is bound to port.
+//	-E_INVAL if index is out of range or gpa is not a page of guest RAM
+//		mapped with 4 KB pages.
+//	-E_NO_MEM if an EPT page table could not be allocated.
+int
+vmshm_map( struct Env *e, int port, int index, uint64_t gpa ) {
+    struct vmshm *shm = port_shm( e, port );
+    struct Page *old = NULL;
+    epte_t *epte;
+    int r;
+
+    if( !shm )
+        return -E_NO_ENT;
+    if( index < 0 || index >= shm->npages )
+        return -E_INVAL;
+    if( gpa % PGSIZE || !guest_gpa_is_ram( &e->env_vmxinfo, gpa ) )
+        return -E_INVAL;
+
+    epte = epml4e_walk( e->env_pml4e, (void *) gpa, 0 );
+    if( epte && ( *epte & __EPTE_SZ ) )
+        return -E_INVAL;
+    if( epte && ( *epte & __EPTE_FULL ) ) {
+        old = pa2page( PTE_ADDR( *epte ) );
+        if( old == shm->pages[index] )
+            return 0;
+    }
+    if( ( r = ept_page_insert( e->env_pml4e, shm->pages[index], (void *) gpa,
+                               __EPTE_FULL ) ) < 0 )
+        return r;
+    if( old )
+        page_decref( old );
+    return 0;
+}
+
+// Signal every other guest port bound to the object on port of guest e,
+// waking guests blocked waiting for it.
+//
+// Returns the number of ports signalled, or -E_NO_ENT if no object is
+// bound to port.
+int
+vmshm_notify( struct Env *e, int port ) {
+    struct vmshm *shm = port_shm( e, port );
+    struct VmxGuestInfo *pinfo;
+    struct Env *peer;
+    uint32_t bit;
+    int i, n = 0;
+
+    if( !shm )
+        return -E_NO_ENT;
+    for( i = 0; i < shm->nbinds; i++ ) {
+        if( shm->binds[i].guest == e->env_id && shm->binds[i].port == port )
+            continue;
+        if( envid2env( shm->binds[i].guest, &peer, 0 ) < 0 )
+            continue;
+        pinfo = &peer->env_vmxinfo;
+        bit = 1 << shm->binds[i].port;
+        if( ( pinfo->shm_waiting & bit ) &&
+            peer->env_status == ENV_NOT_RUNNABLE ) {
+            // The guest's VMCALL already returns 1.
+            pinfo->shm_waiting = 0;
+            env_set_status( peer, ENV_RUNNABLE );
+        } else {
+            pinfo->shm_pending |= bit;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Take a pending signal on port of guest e.  If there is none and block
+// is set, stop running the guest until a peer signals the port.
+//
+// Returns 1 if a signal was taken (or will be, once the guest runs
+// again), 0 if none was pending and block is clear, or -E_NO_ENT if no
+// object is bound to port.
+int
+vmshm_wait( struct Env *e, int port, bool block ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    uint32_t bit;
+
+    if( !port_shm( e, port ) )
+        return -E_NO_ENT;
+    bit = 1 << port;
+    if( ginfo->shm_pending & bit ) {
+        ginfo->shm_pending &= ~bit;
+        return 1;
+    }
+    if( !block )
+        return 0;
+    ginfo->shm_waiting = bit;
+    env_set_status( e, ENV_NOT_RUNNABLE );
+    return 1;
+}
@@ -0,0 +1,18 @@
+#ifndef JOS_VMM_VMSHM_H
+#define JOS_VMM_VMSHM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+
+int vmshm_bind( envid_t guest, uint32_t key, int npages, int port );
+void vmshm_release( struct Env *e );
+
+int vmshm_info( struct Env *e, int port );
+int vmshm_map( struct Env *e, int port, int index, uint64_t gpa );
+int vmshm_notify( struct Env *e, int port );
+int vmshm_wait( struct Env *e, int port, bool block );
+
+#endif /* !JOS_VMM_VMSHM_H */
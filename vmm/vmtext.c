@@ -0,0 +1,165 @@
+#include <vmm/vmtext.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <kern/pmap.h>
+#include <vmm/ept.h>
+#include <vmm/vmx.h>
+
+// Read-only guest kernel segments shared between guests.
+//
+// A VMM that loads a segment the guest cannot write names it by a key, a
+// hash of its contents, and passes the pages it read it into.  The first
+// VMM to load a key has them copied into pages of the kernel's own, which
+// no env maps writable, to make the cache entry; every later one
+// gets the cached pages mapped into its guest, read-only and
+// copy-on-write, and frees its own.  The contents are compared, so a
+// hash collision cannot give a guest the wrong code.  A guest that writes
+// to a shared page gets a private copy (see ept_cow()).  The cache holds a reference on each page,
+// so a segment stays loaded between launches; it is only dropped when its
+// slot is needed for another key and no guest maps it any more.
+
+#define VMTEXT_MAX	8	// Cached segments
+
+struct vmtext {
+    uint64_t key;
+    int npages;				// 0 if the slot is free
+    struct Page *pages[VMX_TEXT_MAX_PAGES];
+};
+
+static struct vmtext texts[VMTEXT_MAX];
+
+// Is any page of t still mapped somewhere besides the cache?
+static bool
+text_busy( struct vmtext *t ) {
+    int i;
+
+    for( i = 0; i < t->npages; i++ )
+        if( t->pages[i]->pp_ref > 1 )
+            return true;
+    return false;
+}
+
+static void
+text_free( struct vmtext *t ) {
+    int i;
+
+    for( i = 0; i < t->npages; i++ )
+        page_decref( t->pages[i] );
+    t->npages = 0;
+}
+
+// Find the segment named key, or NULL.  *slot is set to a slot a new
+// segment could use, or NULL if every one is busy.
+static struct vmtext *
+text_find( uint64_t key, struct vmtext **slot ) {
+    struct vmtext *t, *idle = NULL;
+    int i;
+
+    *slot = NULL;
+    for( i = 0; i < VMTEXT_MAX; i++ ) {
+        t = &texts[i];
+        if( t->npages == 0 ) {
+            if( !*slot )
+                *slot = t;
+        } else if( t->key == key ) {
+            return t;
+        } else if( !idle && !text_busy( t ) ) {
+            idle = t;
+        }
+    }
+    if( !*slot )
+        *slot = idle;
+    return NULL;
+}
+
+// Map the segment named key, whose npages pages of contents the caller
+// holds at va, at gpa in guest, read-only and copy-on-write.  If no VMM
+// has loaded the segment yet, a copy of the caller's pages becomes the
+// segment.  Either way the caller may unmap them afterwards.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if guest does not exist or is not the caller's child.
+//	-E_INVAL if guest is not a guest, npages is out of range, gpa is
+//		not page-aligned guest RAM, va is not page-aligned or not
+//		mapped, or key names a segment with other contents.
+//	-E_NO_MEM if every slot is in use, or a page table could not be
+//		allocated.
+int
+vmtext_map( envid_t guest, uint64_t key, uint64_t gpa, int npages,
+            void *va ) {
+    struct vmtext *t, *slot;
+    struct Page *pp, *old;
+    struct Env *ge;
+    epte_t *epte;
+    int i, r;
+
+    if( ( r = envid2env( guest, &ge, 1 ) ) < 0 )
+        return r;
+    if( ge->env_type != ENV_TYPE_GUEST )
+        return -E_INVAL;
+    if( npages <= 0 || npages > VMX_TEXT_MAX_PAGES || gpa % PGSIZE )
+        return -E_INVAL;
+    for( i = 0; i < npages; i++ )
+        if( !guest_gpa_is_ram( &ge->env_vmxinfo, gpa + i * PGSIZE ) )
+            return -E_INVAL;
+    if( (uintptr_t) va % PGSIZE || (uintptr_t) va + npages * PGSIZE > UTOP )
+        return -E_INVAL;
+    for( i = 0; i < npages; i++ )
+        if( !page_lookup( curenv->env_pml4e, va + i * PGSIZE, NULL ) )
+            return -E_INVAL;
+
+    if( ( t = text_find( key, &slot ) ) ) {
+        if( t->npages != npages )
+            return -E_INVAL;
+        for( i = 0; i < npages; i++ ) {
+            pp = page_lookup( curenv->env_pml4e, va + i * PGSIZE, NULL );
+            if( memcmp( page2kva( pp ), page2kva( t->pages[i] ), PGSIZE ) )
+                return -E_INVAL;
+        }
+    } else {
+        if( !slot )
+            return -E_NO_MEM;
+        if( slot->npages )
+            text_free( slot );
+        // Copy rather than adopt the caller's pages: it still maps them
+        // writable and could change code every later guest runs.
+        t = slot;
+        t->key = key;
+        for( t->npages = 0; t->npages < npages; t->npages++ ) {
+            if( !( pp = page_alloc( 0 ) ) ) {
+                text_free( t );
+                return -E_NO_MEM;
+            }
+            pp->pp_ref++;
+            old = page_lookup( curenv->env_pml4e, va + t->npages * PGSIZE,
+                               NULL );
+            memcpy( page2kva( pp ), page2kva( old ), PGSIZE );
+            t->pages[t->npages] = pp;
+        }
+    }
+
+    // Nothing to do if the guest maps this segment here already.
+    for( i = 0; i < npages; i++ ) {
+        epte = epml4e_walk( ge->env_pml4e, (void *) ( gpa + i * PGSIZE ), 0 );
+        if( !epte || !( *epte & __EPTE_FULL ) || ( *epte & __EPTE_SZ ) ||
+            pa2page( PTE_ADDR( *epte ) ) != t->pages[i] )
+            break;
+    }
+    if( i == npages )
+        return 0;
+
+    // Clear whatever the range held with one INVEPT, rather than one for
+    // each page replaced.
+    if( ( r = ept_unmap_range( ge->env_pml4e, gpa,
+                               gpa + npages * PGSIZE ) ) < 0 )
+        return r;
+    for( i = 0; i < npages; i++ )
+        if( ( r = ept_page_insert( ge->env_pml4e, t->pages[i],
+                                   (void *) ( gpa + i * PGSIZE ),
+                                   __EPTE_READ | __EPTE_EXEC |
+                                   __EPTE_COW ) ) < 0 )
+            return r;
+    return 0;
+}
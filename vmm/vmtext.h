@@ -0,0 +1,13 @@
+#ifndef JOS_VMM_VMTEXT_H
+#define JOS_VMM_VMTEXT_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+
+int vmtext_map( envid_t guest, uint64_t key, uint64_t gpa, int npages,
+                void *va );
+
+#endif /* !JOS_VMM_VMTEXT_H */
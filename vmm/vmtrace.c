@@ -0,0 +1,117 @@
+
+#include <vmm/vmtrace.h>
+
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <kern/pmap.h>
+#include <kern/env.h>
+
+// Give guest e a trace ring of freshly allocated, zeroed pages.  The ring
+// holds a reference on each of its pages, and so does every mapping of it,
+// so a parent that still maps the ring of a guest that has gone never sees
+// the records of a later one.
+static int
+trace_alloc( struct Env *e ) {
+    struct vmtrace_buf *b;
+    struct Page *pp;
+    int i;
+
+    if( !( pp = page_alloc( ALLOC_ZERO ) ) )
+        return -E_NO_MEM;
+    pp->pp_ref++;
+    b = page2kva( pp );
+    e->env_vmxinfo.trace = b;
+
+    for( i = 0; i < VMTRACE_NPAGES; i++ ) {
+        if( !( pp = page_alloc( ALLOC_ZERO ) ) ) {
+            vmtrace_release( e );
+            return -E_NO_MEM;
+        }
+        pp->pp_ref++;
+        if( i == 0 )
+            b->hdr = page2kva( pp );
+        else
+            b->recs[i - 1] = page2kva( pp );
+    }
+    b->hdr->nrecs = VMTRACE_NRECS;
+    b->hdr->guest = e->env_id;
+    return 0;
+}
+
+// Turn exit tracing of guest e on or off, or query its state.  The ring is
+// allocated the first time tracing is turned on and kept, records and all,
+// until the guest is freed.
+//
+// Returns the previous state, or
+//	-E_INVAL for an unknown op.
+//	-E_NO_MEM if the ring could not be allocated.
+int
+vmtrace_ctl( struct Env *e, int op ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    int r, old = ginfo->trace_on;
+
+    switch( op ) {
+        case VMTRACE_ON:
+            if( !ginfo->trace && ( r = trace_alloc( e ) ) < 0 )
+                return r;
+            ginfo->trace_on = true;
+            break;
+        case VMTRACE_OFF:
+            ginfo->trace_on = false;
+            break;
+        case VMTRACE_STATUS:
+            break;
+        default:
+            return -E_INVAL;
+    }
+    return old;
+}
+
+// Map the trace ring of guest e read-only into dst at va.  The mapping
+// covers VMTRACE_RING_SIZE bytes.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if tracing was never turned on for e, or if va is not
+//		page-aligned or the ring would not fit below UTOP.
+//	-E_NO_MEM if a page table could not be allocated.
+int
+vmtrace_map( struct Env *dst, struct Env *e, void *va ) {
+    struct vmtrace_buf *b = e->env_vmxinfo.trace;
+    uintptr_t uva = (uintptr_t) va;
+    void *kva;
+    int i, r;
+
+    if( !b )
+        return -E_INVAL;
+    if( uva % PGSIZE || uva >= UTOP || UTOP - uva < VMTRACE_RING_SIZE )
+        return -E_INVAL;
+
+    for( i = 0; i < VMTRACE_NPAGES; i++ ) {
+        kva = i == 0 ? (void *) b->hdr : (void *) b->recs[i - 1];
+        r = page_insert( dst->env_pml4e, pa2page( PADDR( kva ) ),
+                         (void *) ( uva + i * PGSIZE ), PTE_P | PTE_U );
+        if( r < 0 )
+            return r;
+    }
+    return 0;
+}
+
+// Drop guest e's trace ring, if it has one.  Mappings of the ring keep
+// their pages until they are unmapped.
+void
+vmtrace_release( struct Env *e ) {
+    struct vmtrace_buf *b = e->env_vmxinfo.trace;
+    int i;
+
+    if( !b )
+        return;
+    e->env_vmxinfo.trace_on = false;
+    if( b->hdr )
+        page_decref( pa2page( PADDR( b->hdr ) ) );
+    for( i = 0; i < VMTRACE_NPAGES - 1; i++ )
+        if( b->recs[i] )
+            page_decref( pa2page( PADDR( b->recs[i] ) ) );
+    page_decref( pa2page( PADDR( b ) ) );
+    e->env_vmxinfo.trace = NULL;
+}
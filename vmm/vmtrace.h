@@ -0,0 +1,52 @@
+#ifndef JOS_VMM_VMTRACE_H
+#define JOS_VMM_VMTRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/x86.h>
+#include <inc/vmtrace.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+// The kernel's view of a guest's trace ring, whose pages need not be
+// contiguous: the header page and the pages of records.
+struct vmtrace_buf {
+    struct vmtrace_ring *hdr;
+    struct vmtrace_rec *recs[VMTRACE_NPAGES - 1];
+};
+
+int vmtrace_ctl( struct Env *e, int op );
+int vmtrace_map( struct Env *dst, struct Env *e, void *va );
+void vmtrace_release( struct Env *e );
+
+// Claim and publish the next record in ring b.  'cycles' is left at zero
+// until vmtrace_end(); exits whose handler never returns here (guest
+// destroyed, guest blocked in IPC receive) keep cycles == 0.
+static inline struct vmtrace_rec *
+vmtrace_begin( struct vmtrace_buf *b, uint64_t tsc, uint32_t reason,
+               uint64_t qual, uint64_t rip ) {
+    uint64_t head = b->hdr->head;
+    uint32_t i = head & (VMTRACE_NRECS - 1);
+    struct vmtrace_rec *rec =
+        &b->recs[i / VMTRACE_RECS_PER_PAGE][i % VMTRACE_RECS_PER_PAGE];
+
+    rec->tsc = tsc;
+    rec->rip = rip;
+    rec->qual = qual;
+    rec->cycles = 0;
+    rec->cpu = cpunum();
+    rec->reason = reason;
+    // The record must be complete before readers can see the new head.
+    asm volatile("" ::: "memory");
+    b->hdr->head = head + 1;
+    return rec;
+}
+
+static inline void
+vmtrace_end( struct vmtrace_rec *rec ) {
+    rec->cycles = read_tsc() - rec->tsc;
+}
+
+#endif
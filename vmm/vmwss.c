@@ -0,0 +1,144 @@
+
+#include <vmm/vmwss.h>
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <kern/pmap.h>
+#include <kern/time.h>
+#include <vmm/ept.h>
+#include <vmm/vmx.h>
+
+// Guest working-set sampler.
+//
+// Every VMWSS_INTERVAL_MS each guest's EPT is walked.  A page whose
+// accessed bit is set was touched during the interval: its bit is cleared
+// and its age, kept in the host page's pp_age, restarts at 0.  Any other
+// page ages by one interval.  The pages touched per interval, smoothed
+// into a moving average, are the working-set estimate; the ages give the
+// idle-page histogram.  Both are kept in VmxGuestInfo.wss for
+// sys_vmwss_get() and the kernel monitor's "wss" command.
+//
+// A page shared by several guests has a single age, that of its most
+// recent use by any of them.  Without EPT accessed bits there is nothing
+// to sample and the estimates stay empty.
+
+#define VMWSS_INTERVAL_MS	1000
+// Weight of the newest interval in the moving average, as a shift: each
+// interval contributes 1/4.
+#define VMWSS_AVG_SHIFT		2
+
+static unsigned vmwss_last_ms;
+
+static int
+wss_one( epte_t *epte, uint64_t gpa, void *arg ) {
+    struct vmx_wss *w = arg;
+    struct Page *pp;
+    int age;
+
+    // Copy-on-write pages, such as the zero page, are not the guest's own.
+    if( !( *epte & __EPTE_FULL ) || ( *epte & ( __EPTE_SZ | __EPTE_COW ) ) )
+        return 0;
+    pp = pa2page( PTE_ADDR( *epte ) );
+    if( *epte & __EPTE_A ) {
+        // The pager has not seen this access yet; see scan_one().
+        *epte &= ~__EPTE_A;
+        pp->pp_age = VMWSS_AGE_SEEN;
+    } else if( pp->pp_age & VMWSS_AGE_REF ) {
+        pp->pp_age = 0;
+    } else {
+        pp->pp_age = ( pp->pp_age & VMWSS_AGE_SEEN ) |
+            MIN( ( pp->pp_age & VMWSS_AGE_MASK ) + 1, VMX_WSS_AGES - 1 );
+    }
+    age = pp->pp_age & VMWSS_AGE_MASK;
+
+    w->resident++;
+    w->idle[age]++;
+    if( age == 0 )
+        w->active++;
+    return 0;
+}
+
+static void
+wss_sample( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct vmx_wss *w = &ginfo->wss;
+    uint64_t highmem_end = guest_highmem_end( ginfo );
+
+    w->resident = 0;
+    w->active = 0;
+    memset( w->idle, 0, sizeof( w->idle ) );
+    ept_walk_range( e->env_pml4e, 0, guest_lowmem_end( ginfo ), wss_one, w );
+    if( highmem_end )
+        ept_walk_range( e->env_pml4e, GUEST_HIGHMEM_BASE, highmem_end,
+                        wss_one, w );
+    // Cached translations would keep the cleared bits from being set.
+    ept_invalidate( e->env_pml4e );
+
+    if( w->samples++ == 0 )
+        ginfo->wss_avg = w->active << 8;
+    else
+        ginfo->wss_avg += ( ( w->active << 8 ) >> VMWSS_AVG_SHIFT ) -
+            ( ginfo->wss_avg >> VMWSS_AVG_SHIFT );
+    w->estimate = ( ginfo->wss_avg + 255 ) >> 8;
+    // An eighth on top, so a guest held to its target can still grow
+    // its working set without thrashing first.
+    w->target = w->estimate + ( w->estimate + 7 ) / 8;
+}
+
+// Called from the scheduler: sample every guest once per interval.
+void
+vmwss_tick( void ) {
+    unsigned now = time_msec();
+    int i;
+
+    if( now - vmwss_last_ms < VMWSS_INTERVAL_MS || !ept_ad_supported() )
+        return;
+    vmwss_last_ms = now;
+    for( i = 0; i < NENV; i++ )
+        if( envs[i].env_type == ENV_TYPE_GUEST &&
+            envs[i].env_status != ENV_FREE && envs[i].env_pml4e )
+            wss_sample( &envs[i] );
+}
+
+// Print every guest's estimate, for the kernel monitor.
+void
+vmwss_dump( void ) {
+    struct vmx_wss *w;
+    int i, age;
+
+    if( !ept_ad_supported() ) {
+        cprintf( "EPT accessed bits are not supported\n" );
+        return;
+    }
+    cprintf( "guest     resident   active estimate   target  "
+             "idle 0..%d+ intervals\n", VMX_WSS_AGES - 1 );
+    for( i = 0; i < NENV; i++ ) {
+        if( envs[i].env_type != ENV_TYPE_GUEST ||
+            envs[i].env_status == ENV_FREE )
+            continue;
+        w = &envs[i].env_vmxinfo.wss;
+        cprintf( "%08x %9lld %8lld %8lld %8lld ", envs[i].env_id,
+                 (long long) w->resident, (long long) w->active,
+                 (long long) w->estimate, (long long) w->target );
+        for( age = 0; age < VMX_WSS_AGES; age++ )
+            cprintf( " %lld", (long long) w->idle[age] );
+        cprintf( "\n" );
+    }
+}
+
+// Copy guest's working-set estimate to *wss.
+//
+// Returns 0 on success, or
+//	-E_BAD_ENV if guest does not exist or is not a guest.
+//	-E_NOT_SUPP if the CPU does not set EPT accessed bits.
+int
+vmwss_get( envid_t guest, struct vmx_wss *wss ) {
+    struct Env *ge;
+
+    if( envid2env( guest, &ge, 0 ) < 0 || ge->env_type != ENV_TYPE_GUEST )
+        return -E_BAD_ENV;
+    if( !ept_ad_supported() )
+        return -E_NOT_SUPP;
+    *wss = ge->env_vmxinfo.wss;
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef JOS_VMM_VMWSS_H
+#define JOS_VMM_VMWSS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/vmx.h>
+#include <kern/env.h>
+
+// Flags kept in pp_age next to the age.  Each marks a guest page whose EPT
+// accessed bit one of the two scanners cleared, so the other still counts
+// it as touched.
+#define VMWSS_AGE_REF	0x80	// Cleared by the pager, for the sampler
+#define VMWSS_AGE_SEEN	0x40	// Cleared by the sampler, for the pager
+#define VMWSS_AGE_MASK	0x3f
+
+void vmwss_tick( void );
+void vmwss_dump( void );
+int vmwss_get( envid_t guest, struct vmx_wss *wss );
+
+#endif /* !JOS_VMM_VMWSS_H */
@@ -3,6 +3,7 @@
 #include <vmm/vmx_asm.h>
 #include <vmm/ept.h>
 #include <vmm/vmexits.h>
+#include <vmm/vmtrace.h>
 
 #include <inc/x86.h>
 #include <inc/error.h>
@@ -15,6 +16,8 @@
 #include <kern/trap.h>
 #include <kern/kclock.h>
 #include <kern/console.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 /* static uintptr_t *msr_bitmap; */
 
@@ -192,7 +195,9 @@ int vmx_init_vmxon() {
 
 void vmcs_host_init() {
     vmcs_write64( VMCS_HOST_CR0, rcr0() ); 
-    vmcs_write64( VMCS_HOST_CR3, rcr3() ); 
+    // Exits run on the kernel's own tables: the cr3 loaded now may belong
+    // to an env that is gone by the time the guest exits.
+    vmcs_write64( VMCS_HOST_CR3, boot_cr3 ); 
     vmcs_write64( VMCS_HOST_CR4, rcr4() );
 
     vmcs_write16( VMCS_16BIT_HOST_ES_SELECTOR, GD_KD );
@@ -284,13 +289,60 @@ void vmx_read_capability_msr( uint32_t msr, uint32_t* hi, uint32_t* lo ) {
     *lo = (uint32_t)( msr_val );
 }
 
+// Can the CPU load the guest's EFER on entry and save it on exit through
+// VMCS fields, and reload the host's on exit?  Otherwise EFER goes through
+// the MSR load/store areas, which the CPU walks on every transition.
+bool
+vmx_efer_ctls_supported( void ) {
+    static int ctls = -1;
+    uint32_t exit_and, entry_and, lo;
+
+    if( ctls < 0 ) {
+        vmx_read_capability_msr( IA32_VMX_EXIT_CTLS, &exit_and, &lo );
+        vmx_read_capability_msr( IA32_VMX_ENTRY_CTLS, &entry_and, &lo );
+        ctls = ( exit_and & VMCS_VMEXIT_SAVE_EFER ) &&
+            ( exit_and & VMCS_VMEXIT_LOAD_EFER ) &&
+            ( entry_and & VMCS_VMENTRY_LOAD_EFER );
+    }
+    return ctls;
+}
+
+// Does the CPU report the address size and segment of INS and OUTS in the
+// VM-exit instruction information (IA32_VMX_BASIC bit 54)?
+bool
+vmx_string_io_info_supported( void ) {
+    return BIT( read_msr( IA32_VMX_BASIC ), 54 );
+}
+
+// Log2 of the TSC cycles per VMX preemption timer tick, or -1 if guests
+// run without the timer.
+static int vmx_preempt_shift = -1;
+
+// Convert a slice in TSC cycles to a preemption timer value.  A zero value
+// would exit before the guest ran a single instruction.
+static uint32_t
+vmx_preempt_ticks( uint64_t cycles ) {
+    uint64_t ticks = cycles >> vmx_preempt_shift;
+
+    return MAX( MIN( ticks, 0xFFFFFFFFULL ), 1 );
+}
+
 static void 
-vmcs_ctls_init( struct Env* e ) {
+vmcs_ctls_init( struct VmxGuestInfo *ginfo, epte_t *eptrt ) {
     // Set pin based vm exec controls.
     uint32_t pinbased_ctls_or, pinbased_ctls_and;
     vmx_read_capability_msr( IA32_VMX_PINBASED_CTLS, 
             &pinbased_ctls_and, &pinbased_ctls_or );
 
+    // Host interrupts exit the guest, so the host keeps its timer tick
+    // and devices while a guest runs.
+    pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT;
+    // Bound each entry by the guest's time slice, where the CPU can.
+    if( pinbased_ctls_and & VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT ) {
+        pinbased_ctls_or |= VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT;
+        vmx_preempt_shift = read_msr( IA32_VMX_MISC ) & 0x1F;
+    }
+
     vmcs_write32( VMCS_32BIT_CONTROL_PIN_BASED_EXEC_CONTROLS, 
             pinbased_ctls_or & pinbased_ctls_and );
 
@@ -321,6 +373,13 @@ vmcs_ctls_init( struct Env* e ) {
     // Enable EPT.
     procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT;
     procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST;
+    // Take the CPU from guests spinning on a lock (see handle_pause()).
+    if( procbased_ctls2_and & VMCS_SECONDARY_VMEXEC_CTL_PAUSE_LOOP_EXITING ) {
+        procbased_ctls2_or |= VMCS_SECONDARY_VMEXEC_CTL_PAUSE_LOOP_EXITING;
+        vmcs_write32( VMCS_32BIT_CONTROL_PAUSE_LOOP_EXITING_GAP, VMX_PLE_GAP );
+        vmcs_write32( VMCS_32BIT_CONTROL_PAUSE_LOOP_EXITING_WINDOW,
+                      VMX_PLE_WINDOW );
+    }
     vmcs_write32( VMCS_32BIT_CONTROL_SECONDARY_VMEXEC_CONTROLS, 
             procbased_ctls2_or & procbased_ctls2_and );
 
@@ -330,17 +389,23 @@ vmcs_ctls_init( struct Env* e ) {
             &exit_ctls_and, &exit_ctls_or );
 
     exit_ctls_or |= VMCS_VMEXIT_HOST_ADDR_SIZE;
+    // Take the interrupt vector from the VMCS rather than the IDT.
+    exit_ctls_or |= VMCS_VMEXIT_ACK_INTR;
+    if( vmx_efer_ctls_supported() ) {
+        exit_ctls_or |= VMCS_VMEXIT_SAVE_EFER | VMCS_VMEXIT_LOAD_EFER;
+        vmcs_write64( VMCS_64BIT_HOST_IA32_EFER, read_msr( EFER_MSR ) );
+    }
     vmcs_write32( VMCS_32BIT_CONTROL_VMEXIT_CONTROLS, 
             exit_ctls_or & exit_ctls_and );
 
     vmcs_write64( VMCS_64BIT_CONTROL_VMEXIT_MSR_STORE_ADDR,
-            PADDR(e->env_vmxinfo.msr_guest_area));
+            PADDR(ginfo->msr_guest_area));
     vmcs_write32( VMCS_32BIT_CONTROL_VMEXIT_MSR_STORE_COUNT,
-            e->env_vmxinfo.msr_count);
+            ginfo->msr_count);
     vmcs_write64( VMCS_64BIT_CONTROL_VMEXIT_MSR_LOAD_ADDR,
-            PADDR(e->env_vmxinfo.msr_host_area));
+            PADDR(ginfo->msr_host_area));
     vmcs_write32( VMCS_32BIT_CONTROL_VMEXIT_MSR_LOAD_COUNT,
-            e->env_vmxinfo.msr_count);
+            ginfo->msr_count);
 
     // Set VM entry controls.
     uint32_t entry_ctls_or, entry_ctls_and;
@@ -348,22 +413,25 @@ vmcs_ctls_init( struct Env* e ) {
             &entry_ctls_and, &entry_ctls_or );
 
     vmcs_write64( VMCS_64BIT_CONTROL_VMENTRY_MSR_LOAD_ADDR,
-            PADDR(e->env_vmxinfo.msr_guest_area));
+            PADDR(ginfo->msr_guest_area));
     vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_MSR_LOAD_COUNT,
-            e->env_vmxinfo.msr_count);
+            ginfo->msr_count);
 
+    if( vmx_efer_ctls_supported() ) {
+        entry_ctls_or |= VMCS_VMENTRY_LOAD_EFER;
+        vmcs_write64( VMCS_64BIT_GUEST_IA32_EFER, 0 );
+    }
     vmcs_write32( VMCS_32BIT_CONTROL_VMENTRY_CONTROLS, 
             entry_ctls_or & entry_ctls_and );
     
-    uint64_t ept_ptr = e->env_cr3 | ( ( EPT_LEVELS - 1 ) << 3 );
-    vmcs_write64( VMCS_64BIT_CONTROL_EPTPTR, ept_ptr );
+    vmcs_write64( VMCS_64BIT_CONTROL_EPTPTR, ept_eptp( eptrt ) );
 
     vmcs_write32( VMCS_32BIT_CONTROL_EXCEPTION_BITMAP, 
-            e->env_vmxinfo.exception_bmap);
+            ginfo->exception_bmap);
     vmcs_write64( VMCS_64BIT_CONTROL_IO_BITMAP_A,
-            PADDR(e->env_vmxinfo.io_bmap_a));
+            PADDR(ginfo->io_bmap_a));
     vmcs_write64( VMCS_64BIT_CONTROL_IO_BITMAP_B,
-            PADDR(e->env_vmxinfo.io_bmap_b));
+            PADDR(ginfo->io_bmap_b));
 
 }
 
@@ -388,12 +456,29 @@ extern int g;
 void vmexit() {
     int exit_reason = -1;
     bool exit_handled = false;
+    struct vmtrace_rec *trace = NULL;
+    uint64_t exit_tsc = 0;
+
+    // Another CPU destroyed the guest while it ran.
+    if( curenv->env_status == ENV_DYING )
+        env_destroy( curenv );
+
+    if( curenv->env_vmxinfo.trace_on )
+        exit_tsc = read_tsc();
+
     // Get the reason for VMEXIT from the VMCS.
     // Your code here.
 
 
     exit_reason = vmcs_read32(VMCS_32BIT_VMEXIT_REASON);
 
+    // tf_rip still holds the exiting instruction; handlers advance it.
+    if( curenv->env_vmxinfo.trace_on )
+        trace = vmtrace_begin( curenv->env_vmxinfo.trace, exit_tsc,
+                               exit_reason & EXIT_REASON_MASK,
+                               vmcs_read64( VMCS_VMEXIT_QUALIFICATION ),
+                               curenv->env_tf.tf_rip );
+
   //cprintf( "---VMEXIT Reason: %d---\n", exit_reason );
     /* vmcs_dump_cpu(); */
  
@@ -425,6 +510,17 @@ void vmexit() {
             exit_handled = handle_vmcall(&curenv->env_tf, &curenv->env_vmxinfo,
                     curenv->env_pml4e);
             break;
+        case EXIT_REASON_EXTERNAL_INT:
+            exit_handled = handle_extint(&curenv->env_tf);
+            break;
+        case EXIT_REASON_PAUSE:
+            exit_handled = handle_pause(&curenv->env_tf, &curenv->env_vmxinfo);
+            break;
+        case EXIT_REASON_VMX_PREEMPT_TIMER:
+            // The guest's slice is over; sched_yield() below decides
+            // whether it keeps the CPU.
+            exit_handled = true;
+            break;
         case EXIT_REASON_HLT:
             cprintf("\nHLT in guest, exiting guest.\n");
             env_destroy(curenv);
@@ -432,6 +528,8 @@ void vmexit() {
             break;
     }
 
+    if( trace )
+        vmtrace_end( trace );
 
     if(!exit_handled) {
         cprintf( "\nUnhandled VMEXIT, aborting guest.\n" );
@@ -447,18 +545,86 @@ void vmexit() {
 }
 
 
+// Handle an exit that needs nothing but guest e's own state, without the
+// kernel lock: CPUID, EFER accesses and the kick of ept_invalidate().  The
+// guest is entered again straight away unless its slice is over or another
+// CPU has changed its status.
+// Returns false if the exit is left to vmexit().
+static bool
+vmexit_fast( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+    struct Trapframe *tf = &e->env_tf;
+    struct vmtrace_rec *trace = NULL;
+    uint32_t reason, info;
+    uint64_t now = read_tsc();
+
+    if( e->env_status != ENV_RUNNING || now >= ginfo->sched_slice_end )
+        return false;
+
+    reason = vmcs_read32( VMCS_32BIT_VMEXIT_REASON ) & EXIT_REASON_MASK;
+    switch( reason ) {
+        case EXIT_REASON_CPUID:
+            break;
+        case EXIT_REASON_RDMSR:
+        case EXIT_REASON_WRMSR:
+            if( (uint32_t) tf->tf_regs.reg_rcx != EFER_MSR )
+                return false;
+            break;
+        case EXIT_REASON_EXTERNAL_INT:
+            info = vmcs_read32( VMCS_32BIT_VMEXIT_INTERRUPTION_INFO );
+            if( !BIT( info, 31 ) || ( info & 0xFF ) != IRQ_OFFSET + IRQ_KICK )
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    if( ginfo->trace_on )
+        trace = vmtrace_begin( ginfo->trace, now, reason,
+                               vmcs_read64( VMCS_VMEXIT_QUALIFICATION ),
+                               tf->tf_rip );
+    switch( reason ) {
+        case EXIT_REASON_CPUID:
+            handle_cpuid( tf, ginfo );
+            break;
+        case EXIT_REASON_RDMSR:
+            handle_rdmsr( tf, ginfo );
+            break;
+        case EXIT_REASON_WRMSR:
+            handle_wrmsr( tf, ginfo );
+            break;
+        default:
+            lapic_eoi();
+            break;
+    }
+    if( trace )
+        vmtrace_end( trace );
+
+    // The timer starts over at each entry: give it what is left.
+    if( vmx_preempt_shift >= 0 )
+        vmcs_write32( VMCS_32BIT_GUEST_PREEMPTION_TIMER_VALUE,
+                      vmx_preempt_ticks( ginfo->sched_slice_end - now ) );
+    vmcs_write64( VMCS_GUEST_RIP, tf->tf_rip );
+    return true;
+}
+
 #define ASM_VMX_VMLAUNCH          ".byte 0x0f, 0x01, 0xc2"
 #define ASM_VMX_VMRESUME          ".byte 0x0f, 0x01, 0xc3"
 #define ASM_VMX_VMWRITE_RSP_RDX   ".byte 0x0f, 0x79, 0xd4"
 
+// Enter curenv, whose VMCS is current, and return at its next exit.
+// tf->tf_es is set if the entry failed.
 void asm_vmrun(struct Trapframe *tf) {
 
    
     // NOTE: Since we re-use Trapframe structure, tf.tf_err contains the value
     // of cr2 of the guest.
-    tf->tf_ds = curenv->env_runs;
+    tf->tf_ds = curenv->env_vmxinfo.vmcs_launched;
     tf->tf_es = 0;
 
+    // Charge the guest for the time between entry and exit.
+    uint64_t entry_tsc = read_tsc();
+
     //cprintf("VMRUN\n"); 
     asm volatile (
             "push %%rdx; push %%rbp;"
@@ -473,7 +639,7 @@ void asm_vmrun(struct Trapframe *tf) {
             "je 2f \n\t"
             "mov %%rax, %%cr2 \n\t"
             "2: \n\t"
-            "cmp $1,%c[launched](%0) \n\t"
+            "cmpw $0,%c[launched](%0) \n\t"
             "mov %c[rax](%0), %%rax \n\t"   
             "mov %c[rbx](%0), %%rbx \n\t"
             "mov %c[rdx](%0), %%rdx \n\t"
@@ -540,35 +706,49 @@ void asm_vmrun(struct Trapframe *tf) {
                     , "rax", "rbx", "rdi", "rsi"
                         , "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
     );
+    sched_guest_account(curenv, read_tsc() - entry_tsc);
 
-
-    if(tf->tf_es) {
-        cprintf("Error during VMLAUNCH/VMRESUME\n");
-    } else {
-
+    if(!tf->tf_es) {
+        curenv->env_vmxinfo.vmcs_launched = true;
         curenv->env_tf.tf_rsp = vmcs_read64(VMCS_GUEST_RSP);
         curenv->env_tf.tf_rip = vmcs_read64(VMCS_GUEST_RIP);
-        vmexit();
     }
 }
 
+// Fill in the MSR areas, which switch the MSRs that have no VMCS field of
+// their own between guest and host values.
 void
 msr_setup(struct VmxGuestInfo *ginfo) {
     struct vmx_msr_entry *entry;
     uint32_t idx[] = { EFER_MSR };
-    int i, count = sizeof(idx) / sizeof(idx[0]);
+    int i, count = 0, n = sizeof(idx) / sizeof(idx[0]);
 
-    assert(count <= MAX_MSR_COUNT);
-    ginfo->msr_count = count;
-    
-    for(i=0; i<count; ++i) {
-        entry = ((struct vmx_msr_entry *)ginfo->msr_host_area) + i;
+    assert(n <= MAX_MSR_COUNT);
+    for(i=0; i<n; ++i) {
+        if(idx[i] == EFER_MSR && vmx_efer_ctls_supported())
+            continue;
+        entry = ((struct vmx_msr_entry *)ginfo->msr_host_area) + count;
         entry->msr_index = idx[i];
         entry->msr_value = read_msr(idx[i]);
         
-        entry = ((struct vmx_msr_entry *)ginfo->msr_guest_area) + i;
+        entry = ((struct vmx_msr_entry *)ginfo->msr_guest_area) + count;
         entry->msr_index = idx[i];
+        count++;
     }
+    ginfo->msr_count = count;
+}
+
+// Make the guest exit on accesses to port, or let it reach the port
+// directly again.  Bitmap A covers ports 0 to 0x7FFF, bitmap B the rest.
+void
+vmx_io_intercept(struct VmxGuestInfo *ginfo, uint16_t port, bool on) {
+    uint64_t *bmap = port < 0x8000 ? ginfo->io_bmap_a : ginfo->io_bmap_b;
+    int bit = port & 0x7FFF;
+
+    if(on)
+        bmap[bit / 64] |= 1ULL << (bit % 64);
+    else
+        bmap[bit / 64] &= ~(1ULL << (bit % 64));
 }
 
 void
@@ -576,16 +756,70 @@ bitmap_setup(struct VmxGuestInfo *ginfo) {
     unsigned int io_ports[] = { IO_RTC, IO_RTC+1 };
     int i, count = sizeof(io_ports) / sizeof(io_ports[0]);
     
-    for(i=0; i<count; ++i) {
-        int idx = io_ports[i] / (sizeof(uint64_t) * 8);
-        if(io_ports[i] < 0x7FFF) {
-            ginfo->io_bmap_a[idx] |= ((0x1uL << (io_ports[i] & 0x3F)));
-        } else if (io_ports[i] < 0xFFFF) {
-            ginfo->io_bmap_b[idx] |= ((0x1uL << (io_ports[i] & 0x3F)));
-        } else {
-            assert(false);
-        }
-    }
+    for(i=0; i<count; ++i)
+        vmx_io_intercept(ginfo, io_ports[i], true);
+}
+
+// Set up the VMCS of a guest that has not run yet, whose EPT root is eptrt:
+// host state, initial guest state, controls, I/O bitmaps and MSR areas.
+// The VMCS is left current.
+//
+// Processor must be in VMX root operation before executing this function.
+int
+vmx_vmcs_setup( struct VmxGuestInfo *ginfo, uint64_t *eptrt ) {
+    physaddr_t vmcs_phy_addr = PADDR(ginfo->vmcs);
+    uint8_t error;
+
+    // Call VMCLEAR on the VMCS region.
+    error = vmclear(vmcs_phy_addr);
+    // Check if VMCLEAR succeeded. ( RFLAGS.CF = 0 and RFLAGS.ZF = 0 )
+    if ( error )
+        return -E_VMCS_INIT; 
+
+    // Make this VMCS working VMCS.
+    error = vmptrld(vmcs_phy_addr);
+    if ( error )
+        return -E_VMCS_INIT; 
+
+    vmcs_host_init();
+    vmcs_guest_init();
+    // Setup IO and exception bitmaps.
+    bitmap_setup(ginfo);
+    // Setup the msr load/store area
+    msr_setup(ginfo);
+    vmcs_ctls_init(ginfo, eptrt);
+    ginfo->vmcs_ready = true;
+    ginfo->vmcs_active = true;
+    ginfo->vmcs_launched = false;
+    ginfo->vmcs_cpu = cpunum();
+    return 0;
+}
+
+// Guest e is leaving this CPU: write its VMCS back to memory so that any
+// CPU can load it next.  Its next entry launches it afresh.
+void
+vmx_vmcs_put( struct Env *e ) {
+    struct VmxGuestInfo *ginfo = &e->env_vmxinfo;
+
+    if( !ginfo->vmcs_active )
+        return;
+    assert( ginfo->vmcs_cpu == cpunum() );
+    vmclear( PADDR( ginfo->vmcs ) );
+    ginfo->vmcs_active = false;
+    ginfo->vmcs_launched = false;
+}
+
+// Wipe the VMCS region vmcs back to the state vmx_init_vmcs() returns it
+// in, flushing whatever the CPU still caches of it first.
+int
+vmx_vmcs_scrub( uintptr_t *vmcs ) {
+    uint32_t vmcs_rev_id = (uint32_t) read_msr( IA32_VMX_BASIC );
+
+    if( vmclear( PADDR( vmcs ) ) )
+        return -E_VMCS_INIT;
+    memset( vmcs, 0, PGSIZE );
+    memcpy( vmcs, &vmcs_rev_id, sizeof( vmcs_rev_id ) );
+    return 0;
 }
 
 /* 
@@ -597,29 +831,13 @@ int vmx_vmrun( struct Env *e ) {
         return -E_INVAL;
     }
     uint8_t error;
+    uint64_t slice;
 
-    if( e->env_runs == 1 ) {
-        
-        physaddr_t vmcs_phy_addr = PADDR(e->env_vmxinfo.vmcs);
-
-        // Call VMCLEAR on the VMCS region.
-        error = vmclear(vmcs_phy_addr);
-        // Check if VMCLEAR succeeded. ( RFLAGS.CF = 0 and RFLAGS.ZF = 0 )
-        if ( error )
-            return -E_VMCS_INIT; 
-
-        // Make this VMCS working VMCS.
-        error = vmptrld(vmcs_phy_addr);
-        if ( error )
-            return -E_VMCS_INIT; 
-
-        vmcs_host_init();
-        vmcs_guest_init();
-        // Setup IO and exception bitmaps.
-        bitmap_setup(&e->env_vmxinfo);
-        // Setup the msr load/store area
-        msr_setup(&e->env_vmxinfo);
-        vmcs_ctls_init(e);
+    if( !e->env_vmxinfo.vmcs_ready ) {
+        // A guest that did not come from the shell pool sets its VMCS
+        // up on its first run.
+        if( vmx_vmcs_setup( &e->env_vmxinfo, e->env_pml4e ) < 0 )
+            return -E_VMCS_INIT;
 
         /* ept_alloc_static(e->env_pml4e, &e->env_vmxinfo); */
 
@@ -629,11 +847,38 @@ int vmx_vmrun( struct Env *e ) {
         if ( error ) {
             return -E_VMCS_INIT; 
         }
+        e->env_vmxinfo.vmcs_active = true;
+        // Exits must land on this CPU's TSS, not that of the CPU the
+        // VMCS was last set up on.
+        if( e->env_vmxinfo.vmcs_cpu != cpunum() ) {
+            vmcs_host_init();
+            e->env_vmxinfo.vmcs_cpu = cpunum();
+        }
     }
 
+    vmx_steal_update( e );
     vmcs_write64( VMCS_GUEST_RSP, curenv->env_tf.tf_rsp  );
     vmcs_write64( VMCS_GUEST_RIP, curenv->env_tf.tf_rip );
+    slice = sched_guest_slice( e );
+    e->env_vmxinfo.sched_slice_end = read_tsc() + slice;
+    if( vmx_preempt_shift >= 0 )
+        vmcs_write32( VMCS_32BIT_GUEST_PREEMPTION_TIMER_VALUE,
+                      vmx_preempt_ticks( slice ) );
     //panic ("asm vmrun incomplete\n");
-    asm_vmrun( &e->env_tf );
+
+    // Other CPUs may use the kernel while this one is in the guest, and
+    // the exits vmexit_fast() handles need no lock either.
+    unlock_kernel();
+    do {
+        ept_guest_enter( e->env_pml4e );
+        asm_vmrun( &e->env_tf );
+        ept_guest_exit();
+    } while( !e->env_tf.tf_es && vmexit_fast( e ) );
+    lock_kernel();
+
+    if( e->env_tf.tf_es )
+        cprintf( "Error during VMLAUNCH/VMRESUME\n" );
+    else
+        vmexit();
     return 0;
 }
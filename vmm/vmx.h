@@ -25,9 +25,64 @@ struct vmx_msr_entry {
     uint64_t msr_value;
 } __attribute__((__packed__));
 
+// One precomputed CPUID answer.  index is VMX_CPUID_ANY_INDEX for leaves
+// that ignore ecx.
+struct vmx_cpuid_entry {
+    uint32_t function;
+    uint32_t index;
+    uint32_t eax, ebx, ecx, edx;
+};
+
+#define VMX_CPUID_ANY_INDEX 0xFFFFFFFF
+
+// A guest's CPUID answers, one page per guest.
+struct vmx_cpuid_table {
+    int nent;
+    struct vmx_cpuid_entry ent[( PGSIZE - sizeof(int) ) / sizeof(struct vmx_cpuid_entry)];
+};
+
+#define VMX_CPUID_MAX_ENTRIES \
+    ( sizeof(((struct vmx_cpuid_table *) 0)->ent) / sizeof(struct vmx_cpuid_entry) )
+
 int vmx_init_vmxon();
 int vmx_vmrun( struct Env *e );
+bool vmx_efer_ctls_supported( void );
+bool vmx_string_io_info_supported( void );
+void vmx_io_intercept( struct VmxGuestInfo *ginfo, uint16_t port, bool on );
 struct Page * vmx_init_vmcs();
+int vmx_vmcs_setup( struct VmxGuestInfo *ginfo, uint64_t *eptrt );
+int vmx_vmcs_scrub( uintptr_t *vmcs );
+void vmx_vmcs_put( struct Env *e );
+
+// End of the guest RAM below the 32-bit hole.
+static inline uint64_t
+guest_lowmem_end( struct VmxGuestInfo *ginfo ) {
+    return MIN( ginfo->phys_sz, GUEST_LOWMEM_TOP );
+}
+
+// End of the guest RAM relocated above 4 GB, or 0 if there is none.
+static inline uint64_t
+guest_highmem_end( struct VmxGuestInfo *ginfo ) {
+    if ( ginfo->phys_sz <= GUEST_LOWMEM_TOP )
+        return 0;
+    return GUEST_HIGHMEM_BASE + ( ginfo->phys_sz - GUEST_LOWMEM_TOP );
+}
+
+// Is gpa inside the guest physical address space (RAM or the legacy
+// VGA/BIOS hole below 1 MB)?
+static inline bool
+guest_gpa_valid( struct VmxGuestInfo *ginfo, uint64_t gpa ) {
+    return gpa < guest_lowmem_end( ginfo ) ||
+        ( gpa >= GUEST_HIGHMEM_BASE && gpa < guest_highmem_end( ginfo ) );
+}
+
+// Is gpa backed by guest RAM, i.e. may it be lazily populated on first touch?
+static inline bool
+guest_gpa_is_ram( struct VmxGuestInfo *ginfo, uint64_t gpa ) {
+    if ( gpa >= IOPHYSMEM && gpa < EXTPHYSMEM )
+        return false;
+    return guest_gpa_valid( ginfo, gpa );
+}
 
 /* VMX Capalibility MSRs */
 #define IA32_VMX_BASIC 0X480
@@ -329,6 +384,7 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 #define VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT	0x1
 #define VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT	0x8
 #define VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS	0x20
+#define VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT	0x40
 
 #define VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT  0x4
 #define VMCS_PROC_BASED_VMEXEC_CTL_USETSCOFF	0x8
@@ -354,10 +410,22 @@ static __inline uint64_t vmcs_read64(uint32_t field)
 
 #define VMCS_SECONDARY_VMEXEC_CTL_ENABLE_EPT          0x2
 #define VMCS_SECONDARY_VMEXEC_CTL_UNRESTRICTED_GUEST  0x80
+#define VMCS_SECONDARY_VMEXEC_CTL_PAUSE_LOOP_EXITING  0x400
+
+// Pause-loop exiting: a guest exits once it has spun in a PAUSE loop for
+// more than VMX_PLE_WINDOW TSC cycles, PAUSEs at most VMX_PLE_GAP cycles
+// apart counting as one loop.  A larger window suits guests whose locks
+// are held briefly; a smaller one gives the CPU away sooner.
+#define VMX_PLE_GAP	128
+#define VMX_PLE_WINDOW	4096
 
 #define VMCS_VMEXIT_HOST_ADDR_SIZE ( 0x1 << 9 )
+#define VMCS_VMEXIT_ACK_INTR ( 0x1 << 15 )
+#define VMCS_VMEXIT_SAVE_EFER ( 0x1 << 20 )
+#define VMCS_VMEXIT_LOAD_EFER ( 0x1 << 21 )
 
 #define VMCS_VMENTRY_x64_GUEST ( 0x1 << 9 )
+#define VMCS_VMENTRY_LOAD_EFER ( 0x1 << 15 )
 
 // VMEXIT reasons.
 #define EXIT_REASON_MASK		0xFFFF